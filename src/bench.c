@@ -0,0 +1,590 @@
+/*
+dsp microbenchmarks (make bench)
+
+times the per sample stages of the audio path on synthetic pcm, in every
+bit depth and a few channel counts, with every kernel the cpu can run:
+convert (gain 1.0), convert + gain + saturation, the crossfade mixer,
+the limiter (reducing, and ramping the gain), the resampler tiers, the
+loudness filters and header parsing, from memory and from files.
+each case runs one FRAMES_PER_TICK period at a time, like the audio
+thread, for at least BENCH_MIN_NS and the best of BENCH_RUNS is kept.
+ns are per frame of the track (per file for headers), GB/s counts the
+bytes read by the stage. "json" prints one object per line instead of a
+table, so the numbers of two builds can be diffed by a script
+*/
+
+#include "types.h"
+#include "convert.h"
+#include "resampler.h"
+#include "loudness.h"
+#include "fd_handle.h"
+#include "limiter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define BENCH_MIN_NS 20000000 // 20 ms per run
+#define BENCH_RUNS 5
+#define BENCH_FILES 64 // files parsed per header-file iteration
+#define BENCH_IN_RATE 44100
+#define BENCH_OUT_RATE 48000
+
+static const struct {
+	const char* name;
+	uint16_t audio_format;
+	uint16_t bits;
+} bench_formats[] = {
+	{ "u8", WAV_FORMAT_PCM, 8 },
+	{ "s16", WAV_FORMAT_PCM, 16 },
+	{ "s24", WAV_FORMAT_PCM, 24 },
+	{ "s32", WAV_FORMAT_PCM, 32 },
+	{ "f32", WAV_FORMAT_FLOAT, 32 },
+};
+static const uint16_t bench_channels[] = { 1, 2, 6 };
+static const enum resample_quality bench_tiers[] = { RESAMPLE_FAST, RESAMPLE_MEDIUM, RESAMPLE_BEST };
+
+struct bench_case {
+	const char* stage;
+	const char* format;
+	const char* isa;
+	unsigned int channels;
+	size_t units; // frames (or files) per iteration
+	size_t bytes; // read per iteration, 0 when GB/s means nothing
+	void (*body)(struct bench_case* bc);
+
+	convert_fn convert;
+	convert_gain_fn convert_gain;
+	mix_fn mix;
+	const float* gain; // two periods, one per input of the mixer
+	struct limiter* lim;
+	float level; // limiter gain, the ramp alternates between it and 90% of it
+	struct resampler* rs;
+	struct kweight* kw;
+	kweight_fn kweight;
+	true_peak_fn true_peak;
+	const uint8_t* src;
+	int32_t* dst;
+	size_t samples;
+	size_t dst_frames;
+	size_t header_len;
+	char (*paths)[PATH_MAX_LENGTH];
+};
+
+static int json;
+static const char* only; // stage filter
+
+static int64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift, the same noise on every run
+static uint32_t noise(uint32_t* state) {
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return *state = x;
+}
+
+static void fill_noise(void* buf, size_t len) {
+	uint32_t state = 0x12345678;
+	uint8_t* p = buf;
+
+	for (size_t i = 0; i < len; i++) {
+		p[i] = noise(&state) >> 24;
+	}
+}
+
+/*	--- RUNNER --- */
+
+static double bench_iteration_ns(struct bench_case* bc) {
+	size_t iters = 1;
+	int64_t took;
+
+	// grows the iteration count until one run is long enough to time
+	for (;;) {
+		int64_t start = now_ns();
+
+		for (size_t i = 0; i < iters; i++) {
+			bc->body(bc);
+		}
+
+		took = now_ns() - start;
+
+		if (took >= BENCH_MIN_NS) {
+			break;
+		}
+
+		iters *= (took > 0 && BENCH_MIN_NS / took < 10) ? 2 : 10;
+	}
+
+	double best = (double) took / iters;
+
+	for (int run = 1; run < BENCH_RUNS; run++) {
+		int64_t start = now_ns();
+
+		for (size_t i = 0; i < iters; i++) {
+			bc->body(bc);
+		}
+
+		double ns = (double) (now_ns() - start) / iters;
+
+		if (ns < best) {
+			best = ns;
+		}
+	}
+
+	return best;
+}
+
+static void bench_report(struct bench_case* bc) {
+	if (only && strcmp(only, bc->stage) != 0) {
+		return;
+	}
+
+	double ns = bench_iteration_ns(bc);
+	double per_unit = ns / bc->units;
+	double gbps = bc->bytes / ns; // bytes per ns is GB/s
+
+	if (json) {
+		printf("{\"stage\":\"%s\",\"format\":\"%s\",\"isa\":\"%s\",\"channels\":%u,"
+			"\"ns_per_%s\":%.3f", bc->stage, bc->format, bc->isa, bc->channels,
+			bc->bytes ? "frame" : "file", per_unit);
+
+		if (bc->bytes) {
+			printf(",\"gb_per_s\":%.3f", gbps);
+		}
+
+		printf("}\n");
+	} else if (bc->bytes) {
+		printf("%-12s %-8s %-7s %3u %12.3f %-5s %8.2f\n", bc->stage, bc->format,
+			bc->isa, bc->channels, per_unit, "frame", gbps);
+	} else {
+		printf("%-12s %-8s %-7s %3s %12.3f %-5s %8s\n", bc->stage, bc->format,
+			bc->isa, "-", per_unit, "file", "-");
+	}
+
+	fflush(stdout);
+}
+
+/*	--- CONVERT --- */
+
+static void body_convert(struct bench_case* bc) {
+	bc->convert(bc->dst, bc->src, bc->samples);
+}
+
+static void body_convert_gain(struct bench_case* bc) {
+	bc->convert_gain(bc->dst, bc->src, bc->samples, 0.7f);
+}
+
+// floats is src as samples inside full scale, random bytes would be mostly NaN and huge values
+static void bench_convert(enum cpu_isa best, const uint8_t* src, const uint8_t* floats, int32_t* dst) {
+	for (size_t f = 0; f < sizeof(bench_formats) / sizeof(*bench_formats); f++) {
+		for (size_t c = 0; c < sizeof(bench_channels) / sizeof(*bench_channels); c++) {
+			for (int isa = ISA_SCALAR; isa <= (int) best; isa++) {
+				uint16_t format = bench_formats[f].audio_format;
+				uint16_t bits = bench_formats[f].bits;
+				unsigned int channels = bench_channels[c];
+				struct bench_case bc = {
+					.format = bench_formats[f].name,
+					.isa = cpu_isa_name(isa),
+					.channels = channels,
+					.units = FRAMES_PER_TICK,
+					.bytes = FRAMES_PER_TICK * channels * (bits / 8),
+					.convert = convert_kernel_for(format, bits, isa),
+					.convert_gain = convert_gain_kernel_for(format, bits, isa),
+					.src = (format == WAV_FORMAT_FLOAT) ? floats : src,
+					.dst = dst,
+					.samples = FRAMES_PER_TICK * channels,
+				};
+
+				bc.stage = "convert";
+				bc.body = body_convert;
+				bench_report(&bc);
+
+				bc.stage = "convert-gain";
+				bc.body = body_convert_gain;
+				bench_report(&bc);
+			}
+		}
+	}
+}
+
+/*	--- MIX --- */
+
+static void body_mix(struct bench_case* bc) {
+	const int32_t* a = (const int32_t*) bc->src;
+
+	bc->mix(bc->dst, a, a + bc->samples, bc->gain, bc->gain + bc->samples, bc->samples);
+}
+
+static void bench_mix(enum cpu_isa best, const uint8_t* src, int32_t* dst, const float* gain) {
+	for (size_t c = 0; c < sizeof(bench_channels) / sizeof(*bench_channels); c++) {
+		for (int isa = ISA_SCALAR; isa <= (int) best; isa++) {
+			unsigned int channels = bench_channels[c];
+			size_t samples = FRAMES_PER_TICK * channels;
+			struct bench_case bc = {
+				.stage = "mix",
+				.format = "s32",
+				.isa = cpu_isa_name(isa),
+				.channels = channels,
+				.units = FRAMES_PER_TICK,
+				.bytes = samples * 2 * (sizeof(int32_t) + sizeof(float)),
+				.body = body_mix,
+				.mix = mix_kernel_for(isa),
+				.gain = gain,
+				.src = src,
+				.dst = dst,
+				.samples = samples,
+			};
+
+			bench_report(&bc);
+		}
+	}
+}
+
+/*	--- LIMITER --- */
+
+// in place over dst, the period after it in src is the look-ahead
+static void body_limiter(struct bench_case* bc) {
+	limiter_set_gain(bc->lim, bc->level);
+	limiter_process(bc->lim, bc->dst, FRAMES_PER_TICK,
+		(const int32_t*) bc->src + bc->samples, LIMITER_LOOKAHEAD, 1.0f);
+}
+
+// a new gain every period: always ramping, never reducing
+static void body_gain_ramp(struct bench_case* bc) {
+	bc->level = (bc->level == 0.5f) ? 0.45f : 0.5f;
+	body_limiter(bc);
+}
+
+static void bench_limiter(enum cpu_isa best, const uint8_t* src, int32_t* dst) {
+	for (size_t c = 0; c < sizeof(bench_channels) / sizeof(*bench_channels); c++) {
+		for (int isa = ISA_SCALAR; isa <= (int) best; isa++) {
+			unsigned int channels = bench_channels[c];
+			size_t samples = FRAMES_PER_TICK * channels;
+			struct limiter lim = { 0 };
+
+			if (limiter_setup(&lim, channels, BENCH_OUT_RATE) < 0) {
+				continue;
+			}
+
+			lim.scale = scale_kernel_for(isa);
+			lim.peak = peak_kernel_for(isa);
+
+			// the noise is at a quarter of full scale, 4x keeps the limiter reducing
+			struct bench_case bc = {
+				.stage = "limiter",
+				.format = "s32",
+				.isa = cpu_isa_name(isa),
+				.channels = channels,
+				.units = FRAMES_PER_TICK,
+				.bytes = samples * sizeof(int32_t),
+				.body = body_limiter,
+				.lim = &lim,
+				.level = 4.0f,
+				.src = src,
+				.dst = dst,
+				.samples = samples,
+			};
+
+			memcpy(dst, src, samples * sizeof(int32_t));
+			bench_report(&bc);
+
+			bc.stage = "gain-ramp";
+			bc.body = body_gain_ramp;
+			limiter_reset(&lim);
+			memcpy(dst, src, samples * sizeof(int32_t));
+			bench_report(&bc);
+
+			limiter_free(&lim);
+		}
+	}
+}
+
+/*	--- RESAMPLE --- */
+
+static void body_resample(struct bench_case* bc) {
+	size_t in_frames = resampler_block(bc->rs, bc->dst_frames);
+
+	resampler_process(bc->rs, (const int32_t*) bc->src, in_frames, bc->dst, bc->dst_frames);
+}
+
+static void bench_resample(enum cpu_isa best, const uint8_t* src, int32_t* dst) {
+	for (size_t t = 0; t < sizeof(bench_tiers) / sizeof(*bench_tiers); t++) {
+		for (size_t c = 0; c < sizeof(bench_channels) / sizeof(*bench_channels); c++) {
+			for (int isa = ISA_SCALAR; isa <= (int) best; isa++) {
+				unsigned int channels = bench_channels[c];
+				struct resampler rs;
+
+				if (resampler_init(&rs, BENCH_IN_RATE, BENCH_OUT_RATE, channels, bench_tiers[t]) < 0) {
+					continue;
+				}
+
+				rs.dot = resample_dot_for(isa);
+
+				// frames of the track consumed per period of output
+				size_t in_frames = resampler_block(&rs, FRAMES_PER_TICK);
+				struct bench_case bc = {
+					.stage = "resample",
+					.format = resample_quality_name(bench_tiers[t]),
+					.isa = cpu_isa_name(isa),
+					.channels = channels,
+					.units = in_frames,
+					.bytes = in_frames * channels * sizeof(int32_t),
+					.body = body_resample,
+					.rs = &rs,
+					.src = src,
+					.dst = dst,
+					.dst_frames = FRAMES_PER_TICK,
+				};
+
+				bench_report(&bc);
+				resampler_free(&rs);
+			}
+		}
+	}
+}
+
+/*	--- LOUDNESS --- */
+
+// planar float channels, FRAMES_PER_TICK + TRUE_PEAK_TAPS - 1 samples each
+static void body_kweight(struct bench_case* bc) {
+	const float* x[LOUDNESS_MAX_CHANNELS];
+	double energy[LOUDNESS_MAX_CHANNELS] = {0};
+
+	for (unsigned int c = 0; c < bc->channels; c++) {
+		x[c] = (const float*) bc->src + c * (FRAMES_PER_TICK + TRUE_PEAK_TAPS - 1);
+	}
+
+	bc->kweight(bc->kw, x, FRAMES_PER_TICK, energy);
+}
+
+static void body_true_peak(struct bench_case* bc) {
+	for (unsigned int c = 0; c < bc->channels; c++) {
+		bc->true_peak((const float*) bc->src + c * (FRAMES_PER_TICK + TRUE_PEAK_TAPS - 1),
+			FRAMES_PER_TICK);
+	}
+}
+
+static void bench_loudness(enum cpu_isa best, const uint8_t* src) {
+	for (size_t c = 0; c < sizeof(bench_channels) / sizeof(*bench_channels); c++) {
+		for (int isa = ISA_SCALAR; isa <= (int) best; isa++) {
+			unsigned int channels = bench_channels[c];
+			struct kweight kw;
+
+			kweight_init(&kw, BENCH_OUT_RATE, channels);
+
+			struct bench_case bc = {
+				.stage = "kweight",
+				.format = "f32",
+				.isa = cpu_isa_name(isa),
+				.channels = channels,
+				.units = FRAMES_PER_TICK,
+				.bytes = FRAMES_PER_TICK * channels * sizeof(float),
+				.body = body_kweight,
+				.kw = &kw,
+				.kweight = kweight_kernel_for(isa),
+				.true_peak = true_peak_kernel_for(isa),
+				.src = src,
+			};
+
+			bench_report(&bc);
+
+			bc.stage = "true-peak";
+			bc.body = body_true_peak;
+			bench_report(&bc);
+		}
+	}
+}
+
+/*	--- HEADERS --- */
+
+static void body_header(struct bench_case* bc) {
+	struct wav_information wav;
+
+	wav_parse_header(bc->src, bc->header_len, &wav);
+}
+
+static void body_header_file(struct bench_case* bc) {
+	struct wav_information wav;
+
+	for (size_t i = 0; i < bc->units; i++) {
+		int fd = get_wav_information(bc->paths[i], &wav);
+
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+}
+
+static int write_file(const char* path, const uint8_t* buf, size_t len) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	ssize_t n = write(fd, buf, len);
+	close(fd);
+
+	return (n == (ssize_t) len) ? 0 : -1;
+}
+
+/*
+a canonical header, and one with a LIST chunk between fmt and data like
+most tagged files have, which makes the parser walk one more chunk
+*/
+static size_t build_tagged_header(uint8_t* buf) {
+	uint8_t hdr[WAV_CANONICAL_HEADER];
+	uint32_t list_size = 200;
+
+	wav_build_header(hdr, 2, 16, BENCH_IN_RATE, FRAMES_PER_TICK * 4);
+
+	memcpy(buf, hdr, 36);
+	memcpy(buf + 36, "LIST", 4);
+	buf[40] = list_size & 0xFF;
+	buf[41] = list_size >> 8;
+	buf[42] = 0;
+	buf[43] = 0;
+	memcpy(buf + 44, "INFO", 4);
+	memset(buf + 48, 'x', list_size - 4);
+	memcpy(buf + 44 + list_size, hdr + 36, 8);
+
+	return WAV_CANONICAL_HEADER + 8 + list_size;
+}
+
+static void bench_headers(void) {
+	uint8_t buf[WAV_HEADER_BLOCK] = {0};
+	struct bench_case bc = {
+		.stage = "header",
+		.isa = "-",
+		.units = 1,
+		.body = body_header,
+		.src = buf,
+	};
+
+	wav_build_header(buf, 2, 16, BENCH_IN_RATE, FRAMES_PER_TICK * 4);
+	bc.format = "plain";
+	bc.header_len = WAV_CANONICAL_HEADER;
+	bench_report(&bc);
+
+	bc.format = "list";
+	bc.header_len = build_tagged_header(buf);
+	bench_report(&bc);
+
+	if (only && strcmp(only, "header-file") != 0) {
+		return;
+	}
+
+	// the same files every iteration, so this is the page cache path
+	const char* tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	char dir[PATH_MAX_LENGTH - 16]; // room for the file names
+	static char paths[BENCH_FILES][PATH_MAX_LENGTH];
+	uint8_t file[WAV_HEADER_BLOCK + FRAMES_PER_TICK * 4] = {0};
+	size_t len = build_tagged_header(file) + FRAMES_PER_TICK * 4;
+	int made = 0;
+
+	snprintf(dir, sizeof(dir), "%s/nyplay-bench-XXXXXX", tmp);
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return;
+	}
+
+	for (; made < BENCH_FILES; made++) {
+		snprintf(paths[made], PATH_MAX_LENGTH, "%s/%03d.wav", dir, made);
+
+		if (write_file(paths[made], file, len) < 0) {
+			break;
+		}
+	}
+
+	if (made == BENCH_FILES) {
+		bc.stage = "header-file";
+		bc.format = "list";
+		bc.units = BENCH_FILES;
+		bc.body = body_header_file;
+		bc.paths = paths;
+		bench_report(&bc);
+	}
+
+	for (int i = 0; i < made; i++) {
+		unlink(paths[i]);
+	}
+
+	rmdir(dir);
+}
+
+int main(int argc, const char* argv[]) {
+	if (argc > 3 || (argc >= 2 && strcmp(argv[1], "json") != 0 && strcmp(argv[1], "table") != 0)) {
+		fprintf(stderr, "usage: %s [table|json] [STAGE]\n", argv[0]);
+		fprintf(stderr, "stages: convert, convert-gain, mix, resample, kweight, true-peak, header, header-file\n");
+		return 1;
+	}
+
+	json = (argc >= 2 && strcmp(argv[1], "json") == 0);
+	only = (argc == 3) ? argv[2] : NULL;
+
+	enum cpu_isa best = cpu_detect_isa();
+	size_t max_channels = bench_channels[sizeof(bench_channels) / sizeof(*bench_channels) - 1];
+
+	// big enough for a period of s32 in and (resampled) out
+	size_t len = FRAMES_PER_TICK * 2 * max_channels * sizeof(int32_t);
+	uint8_t* src = malloc(len);
+	int32_t* dst = malloc(len);
+	float* gain = malloc(len); // a period of gains for each input of the mixer
+	float* planar = malloc(len); // noise as float, for the loudness filters
+
+	if (!src || !dst || !gain || !planar) {
+		perror("malloc");
+		free(src);
+		free(dst);
+		free(gain);
+		free(planar);
+		return 1;
+	}
+
+	fill_noise(src, len);
+
+	// keeps the s32 input of the resampler well inside full scale
+	for (size_t i = 0; i < len / sizeof(int32_t); i++) {
+		((int32_t*) src)[i] >>= 2;
+	}
+
+	// the middle of an equal power fade
+	for (size_t i = 0; i < len / sizeof(float); i++) {
+		gain[i] = 0.7071f;
+		planar[i] = ((int32_t*) src)[i] / 2147483648.0f;
+	}
+
+	if (!json) {
+		printf("cpu: %s, %d frames per period, best of %d runs\n\n",
+			cpu_isa_name(best), FRAMES_PER_TICK, BENCH_RUNS);
+		printf("%-12s %-8s %-7s %3s %12s %-5s %8s\n",
+			"stage", "format", "isa", "ch", "ns", "per", "GB/s");
+	}
+
+	bench_convert(best, src, (const uint8_t*) planar, dst);
+	bench_mix(best, src, dst, gain);
+	bench_limiter(best, src, dst);
+	bench_resample(best, src, dst);
+	bench_loudness(best, (const uint8_t*) planar);
+	bench_headers();
+
+	free(src);
+	free(dst);
+	free(gain);
+	free(planar);
+
+	return 0;
+}
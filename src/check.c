@@ -0,0 +1,808 @@
+/*
+correctness checks (make check)
+
+what can't be checked by ear: wav_parse_header gets hand-built riff,
+rf64, extensible and truncated headers, every simd kernel runs against the
+scalar one on random input (every length up to a few vectors, at
+unaligned offsets, with values that saturate and NaN), and the dsp stages are held to what they
+promise: the loudness of the ebu reference tone with both gates, the
+true peak between samples, the amplitude and frequency the resampler
+keeps, the limiter's ceiling and its gain ramp. prints every check that
+failed, the exit status is 1 if one did
+*/
+
+#include "types.h"
+#include "convert.h"
+#include "fd_handle.h"
+#include "resampler.h"
+#include "loudness.h"
+#include "limiter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define CHECK_MAX_SAMPLES 72 // lengths 0..CHECK_MAX_SAMPLES go through every kernel
+#define CHECK_OFFSETS 8 // and each one from these many unaligned starts
+#define CHECK_RATE 48000
+
+#define CHECK(ok, ...) check_that((ok), __LINE__, __VA_ARGS__)
+
+static int checks;
+static int failures;
+
+static void check_that(int ok, int line, const char* fmt, ...) {
+	checks++;
+
+	if (ok) {
+		return;
+	}
+
+	va_list ap;
+	va_start(ap, fmt);
+	printf("FAIL check.c:%d: ", line);
+	vprintf(fmt, ap);
+	printf("\n");
+	va_end(ap);
+	failures++;
+}
+
+// xorshift, the same input on every run
+static uint32_t random_state = 0x9e3779b9;
+
+static uint32_t random_u32(void) {
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+
+	return random_state;
+}
+
+static float random_float(float lo, float hi) {
+	return lo + (hi - lo) * (random_u32() >> 8) / 16777216.0f;
+}
+
+// the parser reports what it refuses on stderr, expected here
+static int quiet_begin(void) {
+	fflush(stderr);
+
+	int saved = dup(STDERR_FILENO);
+	int null = open("/dev/null", O_WRONLY);
+
+	if (null >= 0) {
+		dup2(null, STDERR_FILENO);
+		close(null);
+	}
+
+	return saved;
+}
+
+static void quiet_end(int saved) {
+	fflush(stderr);
+
+	if (saved >= 0) {
+		dup2(saved, STDERR_FILENO);
+		close(saved);
+	}
+}
+
+/*	--- HEADERS --- */
+
+static void put16(uint8_t* p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static void put64(uint8_t* p, uint64_t v) {
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+// a chunk header at pos, returns where its payload starts
+static size_t put_chunk(uint8_t* buf, size_t pos, const char* id, uint32_t size) {
+	memcpy(buf + pos, id, 4);
+	put32(buf + pos + 4, size);
+
+	return pos + 8;
+}
+
+static size_t put_riff(uint8_t* buf, const char* magic) {
+	memcpy(buf, magic, 4);
+	put32(buf + 4, 0); // nothing checks the riff size
+	memcpy(buf + 8, "WAVE", 4);
+
+	return 12;
+}
+
+static size_t put_fmt(uint8_t* buf, size_t pos, uint16_t format, uint16_t channels,
+	uint16_t bits)
+{
+	uint8_t* p = buf + put_chunk(buf, pos, "fmt ", 16);
+
+	put16(p, format);
+	put16(p + 2, channels);
+	put32(p + 4, CHECK_RATE);
+	put32(p + 8, CHECK_RATE * channels * (bits / 8));
+	put16(p + 12, channels * (bits / 8));
+	put16(p + 14, bits);
+
+	return pos + 8 + 16;
+}
+
+static size_t put_fmt_extensible(uint8_t* buf, size_t pos, uint16_t sub_format,
+	uint16_t channels, uint16_t bits, uint16_t valid_bits)
+{
+	static const uint8_t guid_tail[14] = {
+		0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+	};
+
+	put_fmt(buf, pos, WAV_FORMAT_EXTENSIBLE, channels, bits);
+	put32(buf + pos + 4, WAV_FMT_EXTENSIBLE_SIZE);
+
+	uint8_t* p = buf + pos + 8;
+	put16(p + 16, 22); // cb_size
+	put16(p + 18, valid_bits);
+	put32(p + 20, (channels == 2) ? 0x3 : 0x4); // channel mask
+	put16(p + 24, sub_format);
+	memcpy(p + 26, guid_tail, sizeof(guid_tail));
+
+	return pos + 8 + WAV_FMT_EXTENSIBLE_SIZE;
+}
+
+static int parse(const uint8_t* buf, size_t len, struct wav_information* wav) {
+	memset(wav, 0, sizeof(*wav));
+
+	int saved = quiet_begin();
+	int ret = wav_parse_header(buf, len, wav);
+	quiet_end(saved);
+
+	return ret;
+}
+
+static void check_headers(void) {
+	uint8_t buf[256];
+	struct wav_information wav;
+
+	// the 44 byte header most files have
+	size_t pos = put_riff(buf, "RIFF");
+	pos = put_fmt(buf, pos, WAV_FORMAT_PCM, 2, 16);
+	pos = put_chunk(buf, pos, "data", 4000);
+	CHECK(parse(buf, pos, &wav) == 0, "canonical header refused");
+	CHECK(wav.audio_format == WAV_FORMAT_PCM && wav.channels == 2 && wav.bits_per_sample == 16
+		&& wav.sample_rate == CHECK_RATE && wav.frame_size == 4,
+		"canonical fmt: format %u, %u ch, %u bits, %u Hz, frame %u",
+		wav.audio_format, wav.channels, wav.bits_per_sample, wav.sample_rate, wav.frame_size);
+	CHECK(wav.data_offset == 44 && wav.data_size == 4000 && wav.frames_left == 1000,
+		"canonical data: offset %llu, size %llu, frames %llu", (unsigned long long) wav.data_offset,
+		(unsigned long long) wav.data_size, (unsigned long long) wav.frames_left);
+
+	// cut anywhere before the end of the data header: not refused, more is needed
+	for (size_t len = 12; len < pos; len++) {
+		CHECK(parse(buf, len, &wav) == 1, "canonical header cut at %zu isn't incomplete", len);
+	}
+
+	for (size_t len = 0; len < 12; len++) {
+		CHECK(parse(buf, len, &wav) == -1, "riff header cut at %zu isn't refused", len);
+	}
+
+	// what the wav sink and the bench write reads back
+	uint8_t built[WAV_CANONICAL_HEADER];
+	wav_build_header(built, 6, 24, 96000, 6 * 3 * 1000);
+	CHECK(parse(built, sizeof(built), &wav) == 0 && wav.channels == 6 && wav.bits_per_sample == 24
+		&& wav.sample_rate == 96000 && wav.data_offset == 44 && wav.frames_left == 1000,
+		"wav_build_header: %u ch, %u bits, %u Hz, %llu frames", wav.channels,
+		wav.bits_per_sample, wav.sample_rate, (unsigned long long) wav.frames_left);
+
+	memcpy(buf, "RIFX", 4);
+	CHECK(parse(buf, pos, &wav) == -1, "big endian riff accepted");
+	memcpy(buf, "RIFF", 4);
+	memcpy(buf + 8, "AVI ", 4);
+	CHECK(parse(buf, pos, &wav) == -1, "riff that isn't WAVE accepted");
+
+	// an odd sized INFO list before data is padded to an even size
+	pos = put_riff(buf, "RIFF");
+	pos = put_fmt(buf, pos, WAV_FORMAT_PCM, 1, 8);
+	pos = put_chunk(buf, pos, "LIST", 5);
+	memcpy(buf + pos, "INFOx", 5);
+	buf[pos + 5] = 0;
+	pos = put_chunk(buf, pos + 6, "data", 301);
+	CHECK(parse(buf, pos, &wav) == 0 && (size_t) wav.data_offset == pos && wav.data_size == 301
+		&& wav.chunks[CHUNK_LIST].size == 5, "padded LIST: data at %llu, size %llu",
+		(unsigned long long) wav.data_offset, (unsigned long long) wav.data_size);
+
+	// 24 valid bits in a 32-bit container are plain s32
+	pos = put_riff(buf, "RIFF");
+	pos = put_fmt_extensible(buf, pos, WAV_FORMAT_PCM, 2, 32, 24);
+	pos = put_chunk(buf, pos, "data", 800);
+	CHECK(parse(buf, pos, &wav) == 0 && wav.audio_format == WAV_FORMAT_PCM
+		&& wav.bits_per_sample == 32 && wav.valid_bits == 24 && wav.frame_size == 8
+		&& wav.frames_left == 100, "extensible pcm: format %u, %u/%u bits, frame %u",
+		wav.audio_format, wav.valid_bits, wav.bits_per_sample, wav.frame_size);
+
+	put16(buf + 12 + 8 + 18, 33);
+	CHECK(parse(buf, pos, &wav) == -1, "33 valid bits in a 32-bit container accepted");
+
+	pos = put_riff(buf, "RIFF");
+	pos = put_fmt_extensible(buf, pos, WAV_FORMAT_FLOAT, 6, 32, 32);
+	pos = put_chunk(buf, pos, "data", 2400);
+	CHECK(parse(buf, pos, &wav) == 0 && wav.audio_format == WAV_FORMAT_FLOAT
+		&& wav.channels == 6 && wav.frames_left == 100, "extensible float: format %u, %u ch",
+		wav.audio_format, wav.channels);
+
+	buf[pos - 8 - 14] ^= 0xFF; // the guid tail of the sub format
+	CHECK(parse(buf, pos, &wav) == -1, "unknown extensible sub format accepted");
+
+	// rf64 and bw64: data says WAV_SIZE_IN_DS64 and the real size is in ds64
+	const char* magics[] = { "RF64", "BW64" };
+	uint64_t big = (6ULL << 30) + 4;
+
+	for (int m = 0; m < 2; m++) {
+		pos = put_riff(buf, magics[m]);
+		put32(buf + 4, WAV_SIZE_IN_DS64);
+		uint8_t* ds64 = buf + put_chunk(buf, pos, "ds64", WAV_DS64_SIZE);
+		put64(ds64, big + 72); // riff size
+		put64(ds64 + 8, big); // data size
+		put64(ds64 + 16, big / 4); // sample count
+		put32(ds64 + 24, 0); // table length
+		pos = put_fmt(buf, pos + 8 + WAV_DS64_SIZE, WAV_FORMAT_PCM, 2, 16);
+		pos = put_chunk(buf, pos, "data", WAV_SIZE_IN_DS64);
+
+		CHECK(parse(buf, pos, &wav) == 0 && wav.data_size == big && wav.data_offset == pos
+			&& wav.frames_left == big / 4, "%s: data size %llu at %llu", magics[m],
+			(unsigned long long) wav.data_size, (unsigned long long) wav.data_offset);
+
+		for (size_t len = 12; len < pos; len++) {
+			CHECK(parse(buf, len, &wav) != 0, "%s cut at %zu accepted", magics[m], len);
+		}
+	}
+
+	put32(buf + 16, WAV_DS64_SIZE - 8);
+	CHECK(parse(buf, pos, &wav) == -1, "short ds64 chunk accepted");
+
+	// what can't be played
+	static const struct {
+		uint16_t format;
+		uint16_t bits;
+	} refused[] = {
+		{ 0x0055, 16 }, // mp3
+		{ WAV_FORMAT_PCM, 12 },
+		{ WAV_FORMAT_PCM, 40 },
+		{ WAV_FORMAT_FLOAT, 64 },
+		{ WAV_FORMAT_FLOAT, 16 },
+	};
+
+	for (size_t i = 0; i < sizeof(refused) / sizeof(*refused); i++) {
+		pos = put_riff(buf, "RIFF");
+		pos = put_fmt(buf, pos, refused[i].format, 2, refused[i].bits);
+		pos = put_chunk(buf, pos, "data", 64);
+		CHECK(parse(buf, pos, &wav) == -1, "format 0x%04x with %u bits accepted",
+			refused[i].format, refused[i].bits);
+	}
+
+	pos = put_riff(buf, "RIFF");
+	put_fmt(buf, pos, WAV_FORMAT_PCM, 2, 16);
+	put32(buf + pos + 4, 14);
+	pos = put_chunk(buf, pos + 8 + 14, "data", 64);
+	CHECK(parse(buf, pos, &wav) == -1, "14 byte fmt accepted");
+}
+
+/*	--- KERNELS --- */
+
+static const struct {
+	const char* name;
+	uint16_t audio_format;
+	uint16_t bits;
+} check_formats[] = {
+	{ "u8", WAV_FORMAT_PCM, 8 },
+	{ "s16", WAV_FORMAT_PCM, 16 },
+	{ "s24", WAV_FORMAT_PCM, 24 },
+	{ "s32", WAV_FORMAT_PCM, 32 },
+	{ "f32", WAV_FORMAT_FLOAT, 32 },
+};
+
+static const float check_gains[] = { 0.0f, 0.37f, 1.0f, 3.5f };
+
+// integer pcm is random bytes, float has to go past full scale and be NaN too
+static void check_convert(enum cpu_isa isa, const uint8_t* ints, const uint8_t* floats) {
+	int32_t want[CHECK_MAX_SAMPLES];
+	int32_t got[CHECK_MAX_SAMPLES];
+
+	for (size_t f = 0; f < sizeof(check_formats) / sizeof(*check_formats); f++) {
+		uint16_t format = check_formats[f].audio_format;
+		uint16_t bits = check_formats[f].bits;
+		size_t bytes = bits / 8;
+		const uint8_t* src = (format == WAV_FORMAT_FLOAT) ? floats : ints;
+		convert_fn reference = convert_kernel_for(format, bits, ISA_SCALAR);
+		convert_fn kernel = convert_kernel_for(format, bits, isa);
+		convert_gain_fn gain_reference = convert_gain_kernel_for(format, bits, ISA_SCALAR);
+		convert_gain_fn gain_kernel = convert_gain_kernel_for(format, bits, isa);
+
+		for (size_t n = 0; n <= CHECK_MAX_SAMPLES; n++) {
+			for (size_t o = 0; o < CHECK_OFFSETS; o++) {
+				const uint8_t* in = src + o * bytes;
+
+				reference(want, in, n);
+				kernel(got, in, n);
+				CHECK(memcmp(want, got, n * sizeof(int32_t)) == 0,
+					"convert %s %s: %zu samples at %zu differ", check_formats[f].name,
+					cpu_isa_name(isa), n, o);
+
+				for (size_t g = 0; g < sizeof(check_gains) / sizeof(*check_gains); g++) {
+					gain_reference(want, in, n, check_gains[g]);
+					gain_kernel(got, in, n, check_gains[g]);
+					CHECK(memcmp(want, got, n * sizeof(int32_t)) == 0,
+						"convert-gain %s %s x%.2f: %zu samples at %zu differ",
+						check_formats[f].name, cpu_isa_name(isa), check_gains[g], n, o);
+				}
+			}
+		}
+	}
+}
+
+// relative to the size of the terms, the simd kernels add in another order
+static int close_enough(double a, double b, double scale, double tolerance) {
+	return fabs(a - b) <= tolerance * (scale + 1e-30);
+}
+
+static void check_s32_kernels(enum cpu_isa isa, const int32_t* a, const int32_t* b,
+	const float* gain)
+{
+	int32_t want[CHECK_MAX_SAMPLES];
+	int32_t got[CHECK_MAX_SAMPLES];
+	size_t len = CHECK_MAX_SAMPLES + CHECK_OFFSETS;
+
+	for (size_t n = 0; n <= CHECK_MAX_SAMPLES; n++) {
+		for (size_t o = 0; o < CHECK_OFFSETS; o++) {
+			mix_kernel_for(ISA_SCALAR)(want, a + o, b + o, gain + o, gain + len + o, n);
+			mix_kernel_for(isa)(got, a + o, b + o, gain + o, gain + len + o, n);
+			CHECK(memcmp(want, got, n * sizeof(int32_t)) == 0, "mix %s: %zu samples at %zu differ",
+				cpu_isa_name(isa), n, o);
+
+			memcpy(want, a + o, n * sizeof(int32_t));
+			memcpy(got, a + o, n * sizeof(int32_t));
+			scale_kernel_for(ISA_SCALAR)(want, gain + o, n);
+			scale_kernel_for(isa)(got, gain + o, n);
+			CHECK(memcmp(want, got, n * sizeof(int32_t)) == 0, "scale %s: %zu samples at %zu differ",
+				cpu_isa_name(isa), n, o);
+
+			float peak = peak_kernel_for(ISA_SCALAR)(a + o, n);
+			float simd_peak = peak_kernel_for(isa)(a + o, n);
+			CHECK(peak == simd_peak, "peak %s: %zu samples at %zu, %g instead of %g",
+				cpu_isa_name(isa), n, o, simd_peak, peak);
+		}
+	}
+}
+
+static void check_float_kernels(enum cpu_isa isa, const float* x) {
+	size_t len = CHECK_MAX_SAMPLES + CHECK_OFFSETS;
+
+	for (size_t n = 0; n <= CHECK_MAX_SAMPLES; n++) {
+		for (size_t o = 0; o < CHECK_OFFSETS; o++) {
+			const float* a = x + o;
+			const float* b = x + len + o;
+			double terms = 0.0;
+
+			for (size_t i = 0; i < (n & ~15); i++) {
+				terms += fabs((double) a[i] * b[i]);
+			}
+
+			// the resampler's taps are a multiple of 16, the kernels have no tail
+			float want = resample_dot_for(ISA_SCALAR)(a, b, n & ~15);
+			float got = resample_dot_for(isa)(a, b, n & ~15);
+			CHECK(close_enough(want, got, terms, 1e-5), "resampler dot %s: %zu samples at %zu,"
+				" %g instead of %g", cpu_isa_name(isa), n & ~15, o, got, want);
+
+			// the true peak kernels read TRUE_PEAK_TAPS - 1 samples of history first
+			want = true_peak_kernel_for(ISA_SCALAR)(a, n);
+			got = true_peak_kernel_for(isa)(a, n);
+			CHECK(close_enough(want, got, want, 1e-5), "true peak %s: %zu samples at %zu,"
+				" %g instead of %g", cpu_isa_name(isa), n, o, got, want);
+		}
+	}
+
+	// the filter state carries over from one call to the next, the energy adds up
+	struct kweight want_kw, got_kw;
+	const float* planes[2] = { x, x + len };
+	double want_energy[2] = {0};
+	double got_energy[2] = {0};
+
+	kweight_init(&want_kw, CHECK_RATE, 2);
+	kweight_init(&got_kw, CHECK_RATE, 2);
+
+	for (size_t n = 0; n <= CHECK_MAX_SAMPLES; n += 7) {
+		kweight_kernel_for(ISA_SCALAR)(&want_kw, planes, n, want_energy);
+		kweight_kernel_for(isa)(&got_kw, planes, n, got_energy);
+
+		for (int c = 0; c < 2; c++) {
+			CHECK(close_enough(want_energy[c], got_energy[c], want_energy[c], 1e-9),
+				"k-weighting %s: %zu samples, channel %d, energy %g instead of %g",
+				cpu_isa_name(isa), n, c, got_energy[c], want_energy[c]);
+		}
+	}
+}
+
+static void check_kernels(void) {
+	enum cpu_isa best = cpu_detect_isa();
+	size_t len = CHECK_MAX_SAMPLES + CHECK_OFFSETS + TRUE_PEAK_TAPS;
+	uint8_t* src = malloc(len * sizeof(int32_t));
+	float* floats = malloc(len * sizeof(float));
+	int32_t* a = malloc(len * sizeof(int32_t));
+	int32_t* b = malloc(len * sizeof(int32_t));
+	float* gain = malloc(2 * len * sizeof(float));
+	float* x = malloc(2 * len * sizeof(float));
+
+	if (!src || !floats || !a || !b || !gain || !x) {
+		perror("malloc");
+		CHECK(0, "no memory for the kernel checks");
+		goto done;
+	}
+
+	for (size_t i = 0; i < len * sizeof(int32_t); i++) {
+		src[i] = random_u32();
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		floats[i] = random_float(-2.0f, 2.0f);
+
+		switch (i % 11) {
+			case 3: floats[i] = NAN; break;
+			case 5: floats[i] = INFINITY; break;
+			case 7: floats[i] = -INFINITY; break;
+			case 9: floats[i] = 1.0f; break;
+		}
+
+		a[i] = (int32_t) random_u32();
+		b[i] = (int32_t) random_u32();
+	}
+
+	a[3] = INT32_MIN;
+	a[4] = INT32_MAX;
+
+	for (size_t i = 0; i < 2 * len; i++) {
+		gain[i] = random_float(0.0f, 2.5f);
+		x[i] = random_float(-1.0f, 1.0f);
+	}
+
+	for (enum cpu_isa isa = ISA_SSE2; isa <= best; isa++) {
+		check_convert(isa, src, (const uint8_t*) floats);
+		check_s32_kernels(isa, a, b, gain);
+		check_float_kernels(isa, x);
+	}
+
+	done:
+		free(src);
+		free(floats);
+		free(a);
+		free(b);
+		free(gain);
+		free(x);
+}
+
+/*	--- DSP --- */
+
+// a stereo s24 file of frames samples from fill, -1 if it can't be written
+static int write_track(char* path, size_t frames,
+	int32_t (*fill)(size_t frame, int channel))
+{
+	int fd = mkstemp(path);
+
+	if (fd < 0) {
+		perror("mkstemp");
+		return -1;
+	}
+
+	size_t bytes = frames * 2 * 3;
+	uint8_t hdr[WAV_CANONICAL_HEADER];
+	uint8_t* data = malloc(bytes);
+	int ret = -1;
+
+	if (!data) {
+		perror("malloc");
+		goto done;
+	}
+
+	for (size_t i = 0; i < 2 * frames; i++) {
+		int32_t v = fill(i / 2, i % 2);
+		data[3 * i] = v >> 8;
+		data[3 * i + 1] = v >> 16;
+		data[3 * i + 2] = v >> 24;
+	}
+
+	wav_build_header(hdr, 2, 24, CHECK_RATE, bytes);
+
+	if (write(fd, hdr, sizeof(hdr)) == sizeof(hdr) && write(fd, data, bytes) == (ssize_t) bytes) {
+		ret = 0;
+	}
+
+	done:
+		free(data);
+		close(fd);
+		return ret;
+}
+
+static int32_t sine(size_t frame, double hz, double dbfs, double phase) {
+	double amplitude = pow(10.0, dbfs / 20.0) * 2147483647.0;
+	return (int32_t) lrint(amplitude * sin(2.0 * M_PI * hz * frame / CHECK_RATE + phase));
+}
+
+// the ebu tech 3341 reference: a 1 kHz stereo sine at -23 dBFS is -23 LUFS
+static int32_t reference_tone(size_t frame, int channel) {
+	(void) channel;
+	return sine(frame, 1000.0, -23.0, 0.0);
+}
+
+// the second half is silence, the absolute gate (-70 LUFS) drops it
+static int32_t tone_then_silence(size_t frame, int channel) {
+	return (frame < 10 * CHECK_RATE) ? reference_tone(frame, channel) : 0;
+}
+
+// the second half is 20 dB down, the relative gate (-10 LU) drops it
+static int32_t tone_then_quiet(size_t frame, int channel) {
+	(void) channel;
+	return sine(frame, 1000.0, (frame < 10 * CHECK_RATE) ? -23.0 : -43.0, 0.0);
+}
+
+// fs/4 at 45 degrees: every sample is 3 dB under the peaks between them
+static int32_t peaks_between_samples(size_t frame, int channel) {
+	(void) channel;
+	return sine(frame, CHECK_RATE / 4.0, -6.0, M_PI / 4.0);
+}
+
+static void check_loudness(void) {
+	static const struct {
+		const char* name;
+		int32_t (*fill)(size_t frame, int channel);
+		size_t seconds;
+		float loudness;
+		float true_peak;
+	} tracks[] = {
+		{ "reference tone", reference_tone, 20, -23.0f, -23.0f },
+		{ "tone then silence", tone_then_silence, 20, -23.0f, -23.0f },
+		{ "tone then -20 dB", tone_then_quiet, 20, -23.0f, -23.0f },
+		{ "fs/4 at 45 degrees", peaks_between_samples, 5, NAN, -6.0f },
+	};
+
+	for (size_t i = 0; i < sizeof(tracks) / sizeof(*tracks); i++) {
+		char path[] = "/tmp/nyplay-check-XXXXXX";
+		float loudness, true_peak;
+
+		if (write_track(path, tracks[i].seconds * CHECK_RATE, tracks[i].fill) < 0) {
+			CHECK(0, "%s: can't write %s", tracks[i].name, path);
+			unlink(path);
+			continue;
+		}
+
+		int ret = loudness_measure(path, &loudness, &true_peak, NULL);
+		unlink(path);
+
+		CHECK(ret == 0, "%s: not measured", tracks[i].name);
+
+		if (ret < 0) {
+			continue;
+		}
+
+		CHECK(isnan(tracks[i].loudness) || fabsf(loudness - tracks[i].loudness) <= 0.1f,
+			"%s: %.2f LUFS instead of %.1f", tracks[i].name, loudness, tracks[i].loudness);
+		CHECK(fabsf(true_peak - tracks[i].true_peak) <= 0.3f,
+			"%s: true peak %.2f dBTP instead of %.1f", tracks[i].name, true_peak,
+			tracks[i].true_peak);
+	}
+}
+
+// a 1 kHz sine from 44.1 to 48 kHz keeps its amplitude and its frequency
+static void check_resampler(void) {
+	static const enum resample_quality tiers[] = { RESAMPLE_FAST, RESAMPLE_MEDIUM, RESAMPLE_BEST };
+	const uint32_t in_rate = 44100;
+	const double amplitude = 0.5 * 2147483648.0;
+	size_t in_frames = in_rate;
+	size_t max_out = 2 * CHECK_RATE;
+	int32_t* in = malloc(in_frames * sizeof(int32_t));
+	int32_t* out = malloc(max_out * sizeof(int32_t));
+
+	if (!in || !out) {
+		perror("malloc");
+		CHECK(0, "no memory for the resampler checks");
+		goto done;
+	}
+
+	for (size_t i = 0; i < in_frames; i++) {
+		in[i] = (int32_t) lrint(amplitude * sin(2.0 * M_PI * 1000.0 * i / in_rate));
+	}
+
+	for (size_t t = 0; t < sizeof(tiers) / sizeof(*tiers); t++) {
+		struct resampler rs;
+		const char* name = resample_quality_name(tiers[t]);
+
+		if (resampler_init(&rs, in_rate, CHECK_RATE, 1, tiers[t]) < 0) {
+			CHECK(0, "resampler %s: init failed", name);
+			continue;
+		}
+
+		size_t used = 0;
+		size_t made = 0;
+
+		while (used < in_frames) {
+			size_t n = resampler_block(&rs, FRAMES_PER_TICK);
+			n = (n < in_frames - used) ? n : in_frames - used;
+			made += resampler_process(&rs, in + used, n, out + made, max_out - made);
+			used += n;
+		}
+
+		resampler_free(&rs);
+
+		// the filter delays the output, less than its length
+		CHECK(made <= CHECK_RATE && made > CHECK_RATE - 200,
+			"resampler %s: %zu frames out of a second", name, made);
+
+		// the second half is far from the start, where the filter fills up
+		double peak = 0.0;
+		size_t crossings = 0;
+
+		for (size_t i = made / 2; i < made; i++) {
+			peak = fmax(peak, fabs((double) out[i]));
+			crossings += out[i - 1] < 0 && out[i] >= 0;
+		}
+
+		double db = 20.0 * log10(peak / amplitude);
+		double hz = crossings / ((double) (made - made / 2) / CHECK_RATE);
+
+		CHECK(fabs(db) < 0.1, "resampler %s: 1 kHz comes out %.3f dB off", name, db);
+		CHECK(fabs(hz - 1000.0) < 5.0, "resampler %s: 1 kHz comes out at %.1f Hz", name, hz);
+	}
+
+	done:
+		free(in);
+		free(out);
+}
+
+/*
+a period at a time, like audio_convert: the frames are converted at
+unity and the limiter gets the ones after them as look-ahead while it's
+engaged, otherwise the fused kernel applies the gain
+*/
+static void limit(struct limiter* lim, const int32_t* in, int32_t* out, size_t frames,
+	size_t start, size_t n, float gain)
+{
+	size_t ahead = frames - start - n;
+	ahead = (ahead < LIMITER_LOOKAHEAD) ? ahead : LIMITER_LOOKAHEAD;
+
+	limiter_set_gain(lim, gain);
+	memcpy(out + 2 * start, in + 2 * start, 2 * n * sizeof(int32_t));
+
+	if (limiter_engaged(lim)) {
+		limiter_process(lim, out + 2 * start, n, in + 2 * (start + n), ahead, 1.0f);
+	} else {
+		convert_gain_select(WAV_FORMAT_PCM, 32)(out + 2 * start,
+			(const uint8_t*) (in + 2 * start), 2 * n, gain);
+	}
+}
+
+static void check_limiter(void) {
+	size_t frames = 2 * CHECK_RATE;
+	int32_t* in = malloc(frames * 2 * sizeof(int32_t));
+	int32_t* out = malloc(frames * 2 * sizeof(int32_t));
+	struct limiter lim = {0};
+
+	if (!in || !out || limiter_setup(&lim, 2, CHECK_RATE) < 0) {
+		CHECK(0, "no memory for the limiter checks");
+		goto done;
+	}
+
+	// bursts of a loud sine, and single full scale samples of both signs
+	for (size_t i = 0; i < frames; i++) {
+		double level = ((i / 4800) % 2) ? -1.0 : -14.0;
+		in[2 * i] = sine(i, 440.0, level, 0.0);
+		in[2 * i + 1] = sine(i, 650.0, level, 1.0);
+	}
+
+	in[2 * 30000] = INT32_MAX;
+	in[2 * 30001 + 1] = INT32_MIN;
+
+	limiter_reset(&lim);
+
+	// turned up from unity to 4x halfway through the first period that's loud
+	for (size_t start = 0; start < frames; start += FRAMES_PER_TICK) {
+		size_t n = (frames - start < FRAMES_PER_TICK) ? frames - start : FRAMES_PER_TICK;
+		limit(&lim, in, out, frames, start, n, (start < 2000) ? 1.0f : 4.0f);
+	}
+
+	double peak = 0.0;
+
+	for (size_t i = 0; i < 2 * frames; i++) {
+		peak = fmax(peak, fabs(out[i] / 2147483648.0));
+	}
+
+	CHECK(peak <= LIMITER_CEILING + 1e-6, "limiter: peak %.6f over the %.6f ceiling",
+		peak, LIMITER_CEILING);
+
+	// a quiet signal turned down: a straight ramp over LIMITER_RAMP_FRAMES, then flat
+	for (size_t i = 0; i < frames; i++) {
+		in[2 * i] = in[2 * i + 1] = sine(i, 440.0, -20.0, 0.0) | 1; // never 0
+	}
+
+	limiter_reset(&lim);
+	limit(&lim, in, out, frames, 0, FRAMES_PER_TICK, 1.0f);
+	limit(&lim, in, out, frames, FRAMES_PER_TICK, LIMITER_RAMP_FRAMES, 0.5f);
+	limit(&lim, in, out, frames, FRAMES_PER_TICK + LIMITER_RAMP_FRAMES, FRAMES_PER_TICK, 0.5f);
+
+	double worst = 0.0;
+
+	for (size_t i = FRAMES_PER_TICK; i < 2 * FRAMES_PER_TICK + LIMITER_RAMP_FRAMES; i++) {
+		double done = (double) (i - FRAMES_PER_TICK + 1) / LIMITER_RAMP_FRAMES;
+		double want = 1.0 - 0.5 * ((done < 1.0) ? done : 1.0);
+		double got = (double) out[2 * i] / in[2 * i];
+
+		// the gain is only as exact as an s32 sample that's 20 dB down
+		worst = fmax(worst, fabs(got - want) * fabs((double) in[2 * i]) / 2147483648.0);
+	}
+
+	CHECK(worst < 1e-6, "limiter: the gain ramp is off by up to %g of full scale", worst);
+	CHECK(!limiter_engaged(&lim), "limiter: still engaged under unity after the ramp");
+
+	// an f32 sine 6 dB over full scale turned up 1.5x, converted at 1 / headroom:
+	// under the ceiling and still a sine, its crests weren't clipped off
+	float* wave = (float*) in;
+	float headroom = LIMITER_FLOAT_HEADROOM;
+
+	for (size_t i = 0; i < frames; i++) {
+		wave[2 * i] = wave[2 * i + 1] = (float) (2.0 * sin(2.0 * M_PI * 440.0 * i / CHECK_RATE));
+	}
+
+	convert_gain_select(WAV_FORMAT_FLOAT, 32)(out, (const uint8_t*) wave, 2 * frames,
+		1.0f / headroom);
+	limiter_reset(&lim);
+	limiter_set_gain(&lim, 1.5f);
+
+	for (size_t start = 0; start < frames; start += FRAMES_PER_TICK) {
+		size_t n = (frames - start < FRAMES_PER_TICK) ? frames - start : FRAMES_PER_TICK;
+		size_t ahead = frames - start - n;
+
+		ahead = (ahead < LIMITER_LOOKAHEAD) ? ahead : LIMITER_LOOKAHEAD;
+		limiter_process(&lim, out + 2 * start, n, out + 2 * (start + n), ahead, headroom);
+	}
+
+	double lowest = INFINITY, highest = 0.0;
+	peak = 0.0;
+
+	// past the release, where the reduction has settled
+	for (size_t i = frames / 2; i < frames; i++) {
+		double got = out[2 * i] / 2147483648.0;
+
+		peak = fmax(peak, fabs(got));
+
+		if (fabs(wave[2 * i]) > 0.5f) {
+			lowest = fmin(lowest, got / wave[2 * i]);
+			highest = fmax(highest, got / wave[2 * i]);
+		}
+	}
+
+	CHECK(peak <= LIMITER_CEILING + 1e-6, "limiter: f32 peak %.6f over the %.6f ceiling",
+		peak, LIMITER_CEILING);
+	CHECK(highest - lowest < 0.1 * highest, "limiter: f32 overs clipped, the gain goes "
+		"from %.4f to %.4f over a period", lowest, highest);
+
+	done:
+		limiter_free(&lim);
+		free(in);
+		free(out);
+}
+
+int main(void) {
+	check_headers();
+	check_kernels();
+	check_loudness();
+	check_resampler();
+	check_limiter();
+
+	printf("%d checks, %d failed (cpu: %s)\n", checks, failures, cpu_isa_name(cpu_detect_isa()));
+
+	return failures > 0;
+}
@@ -1,6 +1,11 @@
 #include "cli_interface.h"
 #include "fd_handle.h"
 #include "sound_engine.h"
+#include "convert.h"
+#include "resampler.h"
+#include "loudness.h"
+#include "screen.h"
+#include "stats.h"
 #include <dirent.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -8,6 +13,9 @@
 #include <fcntl.h>
 #include <time.h>
 #include <termios.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 /*
 3 -> pause
@@ -20,7 +28,7 @@
 
 static struct termios orig_termios;
 
-static int is_wav(const char* name) {
+int is_wav(const char* name) {
 	const char* dot = strrchr(name, '.');
 
 	if (!dot) {
@@ -34,7 +42,8 @@ void list_wavs
 (
 	const char* path,
 	int recursive,
-	void (*on_wav) (const char* fullpath, const char* fullname, void* userdata),
+	void (*on_wav) (const char* fullpath, const char* fullname,
+		const struct stat* sb, void* userdata),
 	void* userdata
 )
 {
@@ -63,7 +72,7 @@ void list_wavs
 		if (S_ISDIR(st.st_mode) && recursive) { // actual file is a dir?
 			list_wavs(fullpath, recursive, on_wav, userdata);
 		} else if (S_ISREG(st.st_mode) && is_wav(ent->d_name)) {
-			on_wav(fullpath, ent->d_name, userdata);
+			on_wav(fullpath, ent->d_name, &st, userdata);
 		}
 	}
 
@@ -106,6 +115,7 @@ int command_to_player(struct player_state* st) {
 	enable_raw_mode();
 
 	printf("\033[?25l");
+	screen_invalidate(&st->screen); // command mode output is on the terminal
 
 	return 0;
 }
@@ -118,25 +128,122 @@ static void drain_stdin(void) {
 	}
 }
 
+struct track* get_current_music(struct player_state* st) {
+	return &st->playlist.items[st->current_track];
+}
+
+struct track* get_nth_music(struct player_state* st, size_t index) {
+	if (index >= st->playlist.len) {
+		fprintf(stderr, "index out of bounds\n");
+		return NULL;
+	}
+
+	return &st->playlist.items[index];
+}
+
+/*
+opens, parses and maps a track into wav. used for the current track and
+to preload the next one
+*/
+static int open_track(struct player_state* st, size_t index,
+	struct wav_information* wav)
+{
+	struct track* t = get_nth_music(st, index);
+
+	if (!t) {
+		return -1;
+	}
+
+	int fd = get_wav_information(t->path, wav);
+
+	if (fd < 0) {
+		fprintf(stderr, "reading wav failed\n");
+		return -1;
+	}
+
+	if (stream_format_init(&wav->format, wav->audio_format, wav->channels,
+		wav->bits_per_sample, wav->sample_rate) < 0) {
+		fprintf(stderr, "unsupported bits per sample: %u\n", wav->bits_per_sample);
+		close(fd);
+		return -1;
+	}
+
+	wav->format.gain = st->normalize ? loudness_gain(t) : 1.0f;
+
+	if (init_wav_buf(wav) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	// falls back to read() when the data chunk can't be mapped
+	if (wav_map_data(fd, wav) < 0) {
+		wav->data = NULL;
+	}
+
+	return fd;
+}
+
+static void close_track(int fd, struct wav_information* wav) {
+	wav_unmap_data(wav);
+	free(wav->buf);
+	wav->buf = NULL;
+
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+void discard_preload(struct player_state* st) {
+	if (!st->preload.ready) {
+		return;
+	}
+
+	close_track(st->preload.fd, &st->preload.wav);
+	st->preload.fd = -1;
+	st->preload.ready = 0;
+	st->crossfade.start = 0;
+}
+
+/*
+the track fading out is done (or cut short by a key): it's closed and
+the ring carries the current track as it is again
+*/
+static void crossfade_end(struct player_state* st) {
+	struct crossfade* xf = &st->crossfade;
+
+	if (!xf->active) {
+		return;
+	}
+
+	close_track(xf->fd, &xf->wav);
+	xf->fd = -1;
+	xf->active = 0;
+
+	if (st->audio.started) {
+		audio_set_format(st, &st->wav.format);
+	}
+}
+
 static int player_to_command(struct player_state* st) {
+	audio_shutdown(st);
+	crossfade_end(st);
+	crossfade_free(&st->crossfade);
+
 	st->mode = COMMAND;
 	st->state = STOPPED;
 	st->current_track = 0;
 	st->track_loop = 0;
 	st->playlist_loop = 0;
-	close(st->fd);
+	close_track(st->fd, &st->wav);
 	st->fd = -1;
 	st->playlist_random = 0;
 
-	free(st->wav.buf);
-	free(st->wav.buf32);
+	discard_preload(st);
 
 	if (st->random_list.indexes) {
 		random_list_free(&st->random_list);
 	}
 
-	audio_shutdown(st);
-
 	disable_raw_mode();
 	printf("\033[?25h");
 
@@ -145,56 +252,174 @@ static int player_to_command(struct player_state* st) {
 	return 0;
 }
 
-struct track* get_current_music(struct player_state* st) {
-	return &st->playlist.items[st->current_track];
-}
-
-struct track* get_nth_music(struct player_state* st, size_t index) {
+int set_current_music(struct player_state* st, size_t index) {
 	if (index >= st->playlist.len) {
 		fprintf(stderr, "index out of bounds\n");
-		return NULL;
+		return -1;
 	}
 
-	return &st->playlist.items[index];
-}
+	struct wav_information wav = {0};
+	int fd;
 
-int set_current_music(struct player_state* st, size_t index) {
-	if (index >= st->playlist.len) {
-		fprintf(stderr, "index out of bounds\n");
-		return -1;
+	if (st->preload.ready && st->preload.track == index) {
+		// already opened and prefilled by preload_next_music
+		wav = st->preload.wav;
+		fd = st->preload.fd;
+		st->preload.fd = -1;
+		st->preload.ready = 0;
+	} else {
+		discard_preload(st);
+		fd = open_track(st, index, &wav);
+
+		if (fd < 0) {
+			return -1;
+		}
 	}
  
 	if (st->wav.buf && st->fd > 0) {
-		free(st->wav.buf);
-		free(st->wav.buf32);
+		close_track(st->fd, &st->wav);
 	}
 
-	struct track* t = get_nth_music(st, index);
+	st->wav = wav;
+	st->fd = fd;
+	st->current_track = index;
+	st->crossfade.start = 0;
 
-	int fd = get_wav_information(t->path, &st->wav);
+	// while playing, tell the audio thread where the new track starts (a crossfade queues s32)
+	if (st->audio.started && !st->crossfade.active) {
+		audio_set_format(st, &st->wav.format);
+	}
 
+	return 0;
+}
 
-	if (init_wav_buf(&st->wav) < 0) {
-		return -1;
+/*
+the track next_music would pick, without touching random_list.
+returns -1 when the playlist ends after the current track
+*/
+static int peek_next_music(struct player_state* st, size_t* index) {
+	if (st->track_loop) {
+		*index = st->current_track;
+		return 0;
 	}
 
-	if (fd < 0) {
-		fprintf(stderr, "reading wav failed\n");
+	if (st->playlist_random) {
+		struct random_list* rl = &st->random_list;
+
+		if (!rl->indexes) {
+			return -1;
+		}
+
+		if (rl->waiting) {
+			if (rl->current >= rl->size) {
+				return -1;
+			}
+
+			*index = rl->indexes[rl->current];
+			return 0;
+		}
+
+		if (rl->current + 1 < rl->size) {
+			*index = rl->indexes[rl->current + 1];
+			return 0;
+		}
+
+		if (st->playlist_loop) {
+			*index = rl->indexes[rl->size];
+			return 0;
+		}
+
 		return -1;
 	}
 
-	st->fd = fd;
-	st->current_track = index;
+	if (st->current_track >= st->playlist.len - 1) {
+		if (st->playlist_loop) {
+			*index = 0;
+			return 0;
+		}
+
+		return -1;
+	}
 
+	*index = st->current_track + 1;
 	return 0;
 }
 
-static size_t get_full_duration(const struct player_state* st) {
-	size_t total_frames = st->wav.data_size / st->wav.frame_size;
+/*
+with crossfade on, the preloaded track starts crossfade_ms before the
+end of the current one, if both can be mixed as they are: same rate and
+channels, the resampler runs on the audio thread on a single stream.
+the fade is cut to the length of the shorter track
+*/
+static void crossfade_arm(struct player_state* st) {
+	const struct wav_information* next = &st->preload.wav;
+	size_t frames = (size_t) st->wav.sample_rate * st->crossfade_ms / 1000;
+
+	st->crossfade.start = 0;
+
+	if (frames == 0 || st->crossfade.active || next->channels != st->wav.channels
+		|| next->sample_rate != st->wav.sample_rate) {
+		return;
+	}
+
+	st->crossfade.start = (frames < next->frames_left) ? frames : next->frames_left;
+}
+
+/*
+gapless playback: once the current track is about to end, the next one
+is opened, parsed and its first PREFILL_MS brought into memory, so
+next_music only swaps it in and play_wav_stream keeps queueing frames
+into the ring without a hole between the two tracks
+*/
+void preload_next_music(struct player_state* st) {
+	if (st->wav.sample_rate == 0) {
+		return;
+	}
+
+	size_t ahead = (size_t) st->wav.sample_rate * (PRELOAD_AHEAD_MS + st->crossfade_ms) / 1000;
+
+	if (st->wav.frames_left > ahead) {
+		return;
+	}
+
+	size_t index;
+
+	if (peek_next_music(st, &index) < 0) {
+		discard_preload(st);
+		return;
+	}
+
+	if (st->preload.ready) {
+		if (st->preload.track == index) {
+			return;
+		}
+
+		discard_preload(st); // loop/random changed since it was opened
+	}
+
+	struct wav_information wav = {0};
+	int fd = open_track(st, index, &wav);
+
+	if (fd < 0) {
+		return; // next_music will try again and report the error
+	}
+
+	wav_prefill(fd, &wav, (size_t) wav.byte_rate * PREFILL_MS / 1000);
+
+	st->preload.wav = wav;
+	st->preload.fd = fd;
+	st->preload.track = index;
+	st->preload.ready = 1;
+
+	crossfade_arm(st);
+}
+
+static uint64_t get_full_duration(const struct player_state* st) {
+	uint64_t total_frames = st->wav.data_size / st->wav.frame_size;
 	return total_frames / st->wav.sample_rate;
 }
 
-static size_t get_duration_until_now(const struct player_state* st) {
+static uint64_t get_duration_until_now(const struct player_state* st) {
 	return st->wav.frames_played / st->wav.sample_rate;	
 }
 
@@ -339,6 +564,39 @@ int next_music(struct player_state* st) {
 	return 0;
 }
 
+/*
+the current track reached its fade point (play_wav_stream returned 4):
+it goes on as the track fading out and the next one becomes the current
+track, queued under it
+*/
+static int crossfade_start(struct player_state* st) {
+	struct crossfade* xf = &st->crossfade;
+
+	if (crossfade_init(st) < 0) {
+		xf->start = 0; // plays to the end, gapless
+		return 0;
+	}
+
+	int ret = next_music(st);
+
+	if (ret == -1) { // nothing to fade into after all, the track ends on its own
+		st->fd = xf->fd;
+		st->wav = xf->wav;
+		xf->fd = -1;
+		xf->active = 0;
+		return 0;
+	}
+
+	if (st->wav.channels != xf->wav.channels || st->wav.sample_rate != xf->wav.sample_rate) {
+		crossfade_end(st);
+		return ret;
+	}
+
+	audio_set_format(st, &xf->format);
+
+	return ret;
+}
+
 void print_help() {
 	printf("\033[H\033[J");
 	printf("commands for command mode:\n\n");
@@ -346,6 +604,10 @@ void print_help() {
 	printf("(play) -> (play 0)\n");
 	printf("(list) -> list all wav files\n");
 	printf("(loop) -> enable/disable playlist loop\n");
+	printf("(resample quality) -> rate conversion: off, fast, medium or best\n");
+	printf("(crossfade seconds) -> fade each track into the next one, 0 to disable\n");
+	printf("(loudness on|off) -> play every track at the same loudness (ebu r128)\n");
+	printf("(stats) -> xruns and time spent per stage, (stats json [file]) to dump them, (stats reset)\n");
 	printf("(clear) -> clean the terminal\n");
 	printf("(help) -> list all possible commands\n");
 	printf("(about) -> about the program\n");
@@ -376,6 +638,36 @@ void print_about() {
 	printf("commands (simpler to write) that you can write to get specific results\n\n");
 }
 
+// stats, stats json [FILE], stats reset
+static void print_stats(const char* line, struct player_state* st) {
+	char arg[16] = "";
+	char path[PATH_MAX_LENGTH] = "";
+
+	sscanf(line, "%*s %15s %1023s", arg, path);
+
+	if (strcmp(arg, "reset") == 0) {
+		stats_reset(&st->stats);
+		printf("stats: reset\n");
+	} else if (strcmp(arg, "json") == 0 && *path) {
+		FILE* f = fopen(path, "w");
+
+		if (!f) {
+			perror("fopen");
+			return;
+		}
+
+		stats_print_json(&st->stats, f);
+		fclose(f);
+		printf("stats: written to %s\n", path);
+	} else if (strcmp(arg, "json") == 0) {
+		stats_print_json(&st->stats, stdout);
+	} else if (*arg) {
+		printf("stats: (stats), (stats json [file]) or (stats reset)\n");
+	} else {
+		stats_print(&st->stats, stdout);
+	}
+}
+
 void process_command_input(char* line, struct player_state* st) {
 	char cmd[16];
 	int flag;
@@ -435,6 +727,58 @@ void process_command_input(char* line, struct player_state* st) {
 		} else {
 			printf("playlistloop: disabled\n");
 		}
+	} else if (strcmp(cmd, "resample") == 0) {
+		char tier[16];
+
+		// takes effect on the next play, the audio thread isn't running here
+		if (sscanf(line, "%*s %15s", tier) == 1
+			&& resample_quality_parse(tier, &st->resample_quality) < 0) {
+			printf("resample: off, fast, medium or best\n");
+			return;
+		}
+
+		printf("resample: %s\n", resample_quality_name(st->resample_quality));
+	} else if (strcmp(cmd, "loudness") == 0) {
+		char arg[16];
+
+		if (sscanf(line, "%*s %15s", arg) == 1) {
+			if (strcmp(arg, "on") == 0) {
+				st->normalize = 1;
+			} else if (strcmp(arg, "off") == 0) {
+				st->normalize = 0;
+			} else {
+				printf("loudness: on or off\n");
+				return;
+			}
+		}
+
+		printf("loudness: %s, tracks brought to %.0f LUFS\n",
+			st->normalize ? "on" : "off", LOUDNESS_TARGET);
+
+		size_t queued = loudness_queued(&st->loudness);
+
+		if (queued > 0) {
+			printf("analyzed %zu of %zu new tracks\n", loudness_done(&st->loudness), queued);
+		}
+	} else if (strcmp(cmd, "crossfade") == 0) {
+		float seconds;
+
+		if (sscanf(line, "%*s %f", &seconds) == 1) {
+			if (seconds < 0 || seconds * 1000 > CROSSFADE_MAX_MS) {
+				printf("crossfade: 0 to %d seconds\n", CROSSFADE_MAX_MS / 1000);
+				return;
+			}
+
+			st->crossfade_ms = (unsigned int) (seconds * 1000);
+		}
+
+		if (st->crossfade_ms) {
+			printf("crossfade: %.1f seconds\n", st->crossfade_ms / 1000.0);
+		} else {
+			printf("crossfade: disabled\n");
+		}
+	} else if (strcmp(cmd, "stats") == 0) {
+		print_stats(line, st);
 	} else if (strcmp(cmd, "clear") == 0) {
 		printf("\033[H\033[J");		
 	} else if(strcmp(cmd, "about") == 0) {
@@ -475,12 +819,14 @@ void command_loop(struct player_state* st, volatile sig_atomic_t* should_exit) {
 }
 
 static void render_progress_bar(struct player_state* st, int width) {
+	struct screen* scr = &st->screen;
+
 	if (st->wav.frames_left == 0) {
 		return;
 	}
 
-	size_t total = st->wav.data_size / st->wav.frame_size;
-	size_t current = total - st->wav.frames_left;
+	uint64_t total = st->wav.data_size / st->wav.frame_size;
+	uint64_t current = total - st->wav.frames_left;
 
 	float ratio = (float) current / (float) total;
 
@@ -491,156 +837,136 @@ static void render_progress_bar(struct player_state* st, int width) {
 	int filled = (int) (ratio * width);
 
 	int duration = (int) get_duration_until_now(st);
-	int minutes =  duration / 60;
-	int seconds = duration % 60;
+	screen_printf(scr, "%d:%02d [", duration / 60, duration % 60);
 
-	if (seconds < 10) {
-		printf("%d:0%d ", minutes, seconds);
-	} else {
-		printf("%d:%d ", minutes, seconds);
-	}
+	// one run of each color, not an escape per cell
+	char bar[UI_WIDTH + 1];
 
-	putchar('[');
-
-	for (int i = 0; i < width; i++) {
-		if (i < filled) {
-			printf("\033[33m");
-			putchar('#');
-			printf("\033[0m");
-		} else {
-			putchar('-');
-		}
+	if (width > UI_WIDTH) {
+		width = UI_WIDTH;
 	}
 
-	putchar(']');
-	putchar(' ');
+	memset(bar, '#', filled);
+	bar[filled] = '\0';
+	screen_style(scr, STYLE_BAR);
+	screen_puts(scr, bar);
+
+	memset(bar, '-', width - filled);
+	bar[width - filled] = '\0';
+	screen_style(scr, STYLE_PLAIN);
+	screen_puts(scr, bar);
 
 	duration = (int) get_full_duration(st);
-	minutes =  duration / 60;
-	seconds = duration % 60;
+	screen_printf(scr, "] %d:%02d ", duration / 60, duration % 60);
+}
 
-	if (seconds < 10) {
-		printf("%d:0%d ", minutes, seconds);
-	} else {
-		printf("%d:%d ", minutes, seconds);
+static void render_flag(struct screen* scr, const char* label, int enabled) {
+	screen_style(scr, STYLE_LABEL);
+	screen_puts(scr, label);
+	screen_style(scr, STYLE_PLAIN);
+	screen_puts(scr, ": ");
+	screen_style(scr, enabled ? STYLE_ON : STYLE_OFF);
+	screen_puts(scr, enabled ? "enabled" : "disabled");
+	screen_style(scr, STYLE_PLAIN);
+	screen_puts(scr, "\n");
+}
+
+static const struct {
+	const char* key;
+	const char* action;
+} key_help[] = {
+	{"(space) ", "play/pause"},
+	{"(a) ", "prev"},
+	{"(d) ", "next"},
+	{"(l) ", "loop"},
+	{"(q) ", "quit"},
+	{"(w) ", "volume up"},
+	{"(s) ", "volume down"},
+	{"(,) ", "-5 seconds"},
+	{"(.) ", "+5 seconds"},
+	{"(r) ", "random"},
+	{"(i) ", "show/hide stats"},
+	{"(h) ", "show/hide commands"},
+};
+
+// what playing costs so far, the full table is the stats command
+static void render_stats(struct screen* scr, const struct stats* s) {
+	screen_style(scr, STYLE_LABEL);
+	screen_puts(scr, "xruns");
+	screen_style(scr, STYLE_PLAIN);
+	screen_printf(scr, ": %llu  ", (unsigned long long) s->xruns);
+	screen_style(scr, STYLE_LABEL);
+	screen_puts(scr, "periods");
+	screen_style(scr, STYLE_PLAIN);
+	screen_printf(scr, ": %llu\n", (unsigned long long) s->periods);
+
+	for (int m = 0; m < STAT_COUNT; m++) {
+		const struct stats_hist* h = &s->hist[m];
+		uint64_t count = h->count;
+
+		screen_printf(scr, "%-9s p50 %9.1f  p99 %9.1f  max %9.1f us\n", stats_metric_name(m),
+			stats_percentile(h, 0.50) / 1e3, stats_percentile(h, 0.99) / 1e3,
+			count ? h->max / 1e3 : 0.0);
 	}
 }
 
+/*
+the frame is built in st->screen and only what changed since the last
+one goes out, so most calls (the progress bar moved a second) send a
+few bytes and a paused or unchanged player sends none
+*/
 static void render_ui(struct player_state* st) {
-	if (st->state == PAUSED) {
+	struct screen* scr = &st->screen;
+
+	if (st->state != PLAYING) {
 		return;
 	}
 
-	printf("\033[H\033[J");
-
-	if (st->state == PLAYING) {
-		struct track* t = get_current_music(st);
-		printf("\033[4;37mcurrent track\033[0m");
-		printf(" [%ld/%ld]: ",
-			st->current_track + 1, st->playlist.len);
-		printf("\033[36m");
-		printf("%s", t->name);
-		printf("\033[0m\n");
-		printf("\033[4;37mvolume\033[0m: %.1f%%\n", st->player_gain * 100.0);
-
-		printf("\033[4;37mplaylistloop\033[0m: ");
-		if (st->playlist_loop) {
-			printf("\033[34m");
-			printf("enabled");
-			printf("\033[0m\n");
-		} else {
-			printf("\033[31m");
-			printf("disabled");
-			printf("\033[0m\n");
-		}
-
-		printf("\033[4;37mlooptrack\033[0m: ");
-		if (st->track_loop) {
-			printf("\033[34m");
-			printf("enabled");
-			printf("\033[0m\n");
-		} else {
-			printf("\033[31m");
-			printf("disabled");
-			printf("\033[0m\n");
-		}
-
-		printf("\033[4;37mrandom\033[0m: ");
-		if (st->playlist_random) {
-			printf("\033[34m");
-			printf("enabled");
-			printf("\033[0m\n");
-		} else {
-			printf("\033[31m");
-			printf("disabled");
-			printf("\033[0m\n");
-		}
-
-		printf("\n");
-
-		render_progress_bar(st, UI_WIDTH);
-		printf("\n");
-
-		if (st->show_commands) {
-			printf("\n\033[35m");
-			printf("(space) ");
-			printf("\033[0m");
-			printf("play/pause");
-
-			printf("\n\033[35m");
-			printf("(a) ");
-			printf("\033[0m");
-			printf("prev");
-
-			printf("\n\033[35m");
-			printf("(d) ");
-			printf("\033[0m");
-			printf("next");
-
-			printf("\n\033[35m");
-			printf("(l) ");
-			printf("\033[0m");
-			printf("loop");
-
-			printf("\n\033[35m");
-			printf("(q) ");
-			printf("\033[0m");
-			printf("quit");
-
-			printf("\n\033[35m");
-			printf("(w) ");
-			printf("\033[0m");
-			printf("volume up");
-
-			printf("\n\033[35m");
-			printf("(s) ");
-			printf("\033[0m");
-			printf("volume down");
-
-			printf("\n\033[35m");
-			printf("(,) ");
-			printf("\033[0m");
-			printf("-5 seconds");
-
-			printf("\n\033[35m");
-			printf("(.) ");
-			printf("\033[0m");
-			printf("+5 seconds");
-
-			printf("\n\033[35m");
-			printf("(r) ");
-			printf("\033[0m");
-			printf("random");
+	uint64_t start = stats_now_ns();
+	screen_begin(scr);
+
+	struct track* t = get_current_music(st);
+	screen_style(scr, STYLE_LABEL);
+	screen_puts(scr, "current track");
+	screen_style(scr, STYLE_PLAIN);
+	screen_printf(scr, " [%ld/%ld]: ", st->current_track + 1, st->playlist.len);
+	screen_style(scr, STYLE_TRACK);
+	screen_puts(scr, t->name);
+	screen_style(scr, STYLE_PLAIN);
+	screen_puts(scr, "\n");
+
+	screen_style(scr, STYLE_LABEL);
+	screen_puts(scr, "volume");
+	screen_style(scr, STYLE_PLAIN);
+	screen_printf(scr, ": %.1f%%\n", st->player_gain * 100.0);
+
+	render_flag(scr, "playlistloop", st->playlist_loop);
+	render_flag(scr, "looptrack", st->track_loop);
+	render_flag(scr, "random", st->playlist_random);
+
+	screen_puts(scr, "\n");
+	render_progress_bar(st, UI_WIDTH);
+	screen_puts(scr, "\n");
+
+	if (st->show_stats) {
+		screen_puts(scr, "\n");
+		render_stats(scr, &st->stats);
+	}
 
-			printf("\n\033[35m");
-			printf("(h) ");
-			printf("\033[0m");
-			printf("show/hide commands");
+	if (st->show_commands) {
+		screen_puts(scr, "\n");
 
-			printf("\n");
+		for (size_t i = 0; i < sizeof(key_help) / sizeof(key_help[0]); i++) {
+			screen_style(scr, STYLE_KEY);
+			screen_puts(scr, key_help[i].key);
+			screen_style(scr, STYLE_PLAIN);
+			screen_puts(scr, key_help[i].action);
+			screen_puts(scr, "\n");
 		}
-
 	}
+
+	screen_flush(scr);
+	stats_since(&st->stats, STAT_RENDER, start);
 }
 
 static int handle_random_playlist(struct player_state* st) {
@@ -676,11 +1002,15 @@ static int handle_random_playlist(struct player_state* st) {
 static int process_key(struct player_state* st, char c) {
 	if (c == ' ') {
 		st->state = (st->state == PAUSED) ? PLAYING : PAUSED;
+		audio_set_paused(st, st->state == PAUSED);
 		return 3;
 	}
 
 	if (c == 'd') {
-		return next_music(st);
+		crossfade_end(st);
+		int ret = next_music(st);
+		audio_flush(st);
+		return ret;
 	}
 
 	if (c == 'q') {
@@ -689,6 +1019,7 @@ static int process_key(struct player_state* st, char c) {
 
 	if (c == 'w') {
 		st->player_gain += 0.1;
+		audio_set_gain(st, st->player_gain);
 		return 0;
 	}
 
@@ -700,25 +1031,36 @@ static int process_key(struct player_state* st, char c) {
 		}
 	}
 
+	if (c == 'i') {
+		st->show_stats = !st->show_stats;
+		return 0;
+	}
+
 	if (c == 's') {
 		if (st->player_gain > 0.0f) {
 			st->player_gain -= 0.1;
+			audio_set_gain(st, st->player_gain);
 		}
 
 		return 0;
 	}
 
 	if (c == 'a') {
-		return prev_music(st);
+		crossfade_end(st);
+		int ret = prev_music(st);
+		audio_flush(st);
+		return ret;
 	}
 
 	if (c == '.') {
-		apply_offset(st, 5 * (int32_t) st->wav.sample_rate);
+		crossfade_end(st);
+		audio_seek(st, SEEK_STEP_S * (int64_t) st->wav.sample_rate);
 		return 0;
 	}
 
 	if (c == ',') {
-		apply_offset(st, -5 * (int32_t) st->wav.sample_rate);
+		crossfade_end(st);
+		audio_seek(st, -SEEK_STEP_S * (int64_t) st->wav.sample_rate);
 		return 0;
 	}
 
@@ -744,6 +1086,23 @@ int process_player_input(struct player_state* st) {
 	return process_key(st, input);
 }
 
+// the ui timer only runs while playing, a paused player has nothing to redraw
+static void ui_timer_set(int timer, int armed) {
+	struct itimerspec its = {0};
+
+	if (armed) {
+		its.it_interval.tv_nsec = UI_REFRESH_MS * 1000 * 1000;
+		its.it_value = its.it_interval;
+	}
+
+	timerfd_settime(timer, 0, &its, NULL);
+}
+
+/*
+sleeps in poll until a key, the ui timer or the audio thread (half the
+ring free again) wakes it up. nothing runs on its own while paused, the
+audio thread blocks too
+*/
 void player_loop(struct player_state* st, volatile sig_atomic_t* should_exit) {
 	/*
 	stdin is nonblocking during player loop
@@ -751,11 +1110,22 @@ void player_loop(struct player_state* st, volatile sig_atomic_t* should_exit) {
 	int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
 	fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
 
-	struct timespec ts = {
-		.tv_sec = 0,
-		.tv_nsec = 16 * 1000 * 1000
+	int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (timer < 0) {
+		perror("timerfd_create");
+	} else {
+		ui_timer_set(timer, 1);
+	}
+
+	struct pollfd fds[3] = {
+		{ .fd = STDIN_FILENO, .events = POLLIN },
+		{ .fd = timer, .events = POLLIN }, // ignored by poll when -1
+		{ .fd = st->audio.space_fd, .events = POLLIN }
 	};
 
+	int redraw = 1;
+
 	while (st->running && (st->mode == PLAYER)) {
 		if (*should_exit) {
 			st->running = 0;
@@ -769,7 +1139,15 @@ void player_loop(struct player_state* st, volatile sig_atomic_t* should_exit) {
 
 		int ret = process_player_input(st);
 
+		if (ret != -2) {
+			redraw = 1;
+		}
+
 		if (ret == 3) { // pause
+			if (timer >= 0) {
+				ui_timer_set(timer, st->state == PLAYING);
+			}
+
 			continue;
 		} else if (ret == 1) { // finished
 			ret = next_music(st);
@@ -783,8 +1161,28 @@ void player_loop(struct player_state* st, volatile sig_atomic_t* should_exit) {
 			break;
 		}
 
+		preload_next_music(st);
 		ret = play_wav_stream(st);
 
+		if (ret == 4) { // fade point of the current track
+			if (crossfade_start(st) == -1) {
+				player_to_command(st);
+				break;
+			}
+
+			ret = play_wav_stream(st);
+		}
+
+		if (ret == 5) { // crossfade over
+			crossfade_end(st);
+			ret = play_wav_stream(st);
+		}
+
+		if (ret == -1) { // error
+			player_to_command(st);
+			break;
+		}
+
 		if (ret == 1) { // finished
 			ret = next_music(st);
 
@@ -792,18 +1190,52 @@ void player_loop(struct player_state* st, volatile sig_atomic_t* should_exit) {
 				player_to_command(st);
 				break;
 			}
+
+			// keep filling the ring right after the last frame of the old track
+			play_wav_stream(st);
+		}
+
+		if (redraw) {
+			render_ui(st);
+			redraw = 0;
+		}
+
+		int timeout = -1;
+
+		if (st->state == PLAYING && audio_want_space(st) == 0) {
+			timeout = 0;
+		}
+
+		// a key still waiting makes this return right away
+		if (poll(fds, 3, timeout) < 0) {
+			continue; // EINTR, should_exit is checked on top
+		}
+
+		if (fds[1].revents & POLLIN) {
+			uint64_t expirations;
+			read(timer, &expirations, sizeof(expirations));
+			redraw = 1;
 		}
 
-		render_ui(st);
-		nanosleep(&ts, NULL);
+		if (fds[2].revents & POLLIN) {
+			eventfd_t value;
+			eventfd_read(st->audio.space_fd, &value);
+		}
+	}
+
+	if (timer >= 0) {
+		close(timer);
 	}
 }
 
 /*	--- CALLBACKS --- */
 
-void print_wav(const char* path, const char* fullname, void* userdata) {
+void print_wav(const char* path, const char* fullname,
+	const struct stat* sb, void* userdata)
+{
 	(void) userdata;
 	(void) fullname;
+	(void) sb;
 
 	printf("%s\n", path);
 }
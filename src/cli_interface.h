@@ -9,10 +9,13 @@ the main loop must be:
 loop {
 	wait_timeout_events()
 	process_user_input() // stdin
-	feed_audio_output() // data_buf
+	feed_audio_output() // data_buf -> audio ring
 	update_ui()
 }
 
+writing to the pcm happens on a separate audio thread (sound_engine.c),
+so a slow update_ui() can't starve the device
+
 */
 
 #ifndef CLI_INTERFACE_H
@@ -21,19 +24,27 @@ loop {
 #include "types.h"
 #include <stdatomic.h>
 #include <signal.h>
+#include <sys/stat.h>
 #include <alsa/asoundlib.h>
 
 #define UI_WIDTH 20
+#define UI_REFRESH_MS 250 // progress bar redraw while playing
 
 struct track* get_current_music(struct player_state* st);
 int set_current_music(struct player_state* st, size_t index);
+void preload_next_music(struct player_state* st);
+void discard_preload(struct player_state* st);
+
+// case-insensitive .wav extension check
+int is_wav(const char* name);
 
 /* search and list .wav files */
 void list_wavs
 (
 	const char* path,
 	int recursive,
-	void (*on_wav) (const char* fullpath, const char* fullname, void* userdata),
+	void (*on_wav) (const char* fullpath, const char* fullname,
+		const struct stat* sb, void* userdata),
 	void* userdata
 );
 
@@ -54,6 +65,7 @@ void disable_raw_mode();
 
 /*	--- CALLBACKS --- */
 
-void print_wav(const char* path, const char* fullname, void* userdata);
+void print_wav(const char* path, const char* fullname,
+	const struct stat* sb, void* userdata);
 
 #endif
\ No newline at end of file
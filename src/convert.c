@@ -0,0 +1,948 @@
+#include "convert.h"
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+all kernels produce the same thing: the sample left aligned in an int32_t,
+so a 16-bit 0x1234 becomes 0x12340000 and 8-bit (unsigned) is recentered
+around 0 first.
+
+the fused kernels (convert_gain) also multiply by the gain and saturate
+in the same pass. the left aligned value goes through a float: 8, 16 and
+24-bit samples fit in its mantissa, and clamping before converting back
+replaces the old per sample clamp_s32 branches. 32-bit samples are
+already left aligned, converting them is a copy; with gain their low 8
+bits don't survive the float, far below what a dac resolves.
+
+32-bit float samples are scaled by 2^31 and saturated, with or without
+gain: full scale is +-1.0 but a float file can go past it, and a NaN
+becomes silence instead of full scale negative.
+
+the mix kernels (crossfades) add two s32 streams, each with a gain per
+sample, with the same float path and saturation
+*/
+
+// largest float below 2^31, INT32_MAX itself rounds up to 2^31 and overflows
+#define GAIN_MAX 2147483520.0f
+#define GAIN_MIN -2147483648.0f
+#define F32_SCALE 2147483648.0f // float full scale to s32
+
+static inline int32_t gain_sat_scalar(int32_t v, float gain) {
+	float f = (float) v * gain;
+
+	f = (f > GAIN_MAX) ? GAIN_MAX : f;
+	f = (f < GAIN_MIN) ? GAIN_MIN : f;
+
+	return (int32_t) f;
+}
+
+/*	--- SCALAR --- */
+
+static inline int32_t load_u8(const uint8_t* src) {
+	return ((int32_t) *src - 128) << 24;
+}
+
+static inline int32_t load_s16(const uint8_t* src) {
+	int16_t v = (int16_t)(src[0] | (src[1] << 8));
+	return (int32_t) ((uint32_t) (int32_t) v << 16);
+}
+
+/*
+reading 4 bytes from the start of a 3 byte sample and shifting left by 8
+drops the byte of the next sample and leaves the 24 bits left aligned.
+only valid when there is a next sample
+*/
+static inline int32_t load_s24_fast(const uint8_t* src) {
+	uint32_t v;
+	memcpy(&v, src, 4);
+	return (int32_t) (v << 8);
+}
+
+static inline int32_t load_s24(const uint8_t* src) {
+	return (int32_t) (((uint32_t) src[0] << 8)
+		| ((uint32_t) src[1] << 16)
+		| ((uint32_t) src[2] << 24));
+}
+
+static void convert_u8_scalar(int32_t* dst, const uint8_t* src, size_t samples) {
+	for (size_t i = 0; i < samples; i++) {
+		dst[i] = load_u8(src + i);
+	}
+}
+
+static void convert_s16_scalar(int32_t* dst, const uint8_t* src, size_t samples) {
+	for (size_t i = 0; i < samples; i++) {
+		dst[i] = load_s16(src + 2 * i);
+	}
+}
+
+static void convert_s24_scalar(int32_t* dst, const uint8_t* src, size_t samples) {
+	size_t i = 0;
+
+	for (; i + 1 < samples; i++) {
+		dst[i] = load_s24_fast(src + 3 * i);
+	}
+
+	for (; i < samples; i++) {
+		dst[i] = load_s24(src + 3 * i);
+	}
+}
+
+static void convert_s32(int32_t* dst, const uint8_t* src, size_t samples) {
+	memcpy(dst, src, samples * sizeof(int32_t));
+}
+
+static inline int32_t load_s32(const uint8_t* src) {
+	int32_t v;
+	memcpy(&v, src, sizeof(v));
+	return v;
+}
+
+static void convert_gain_u8_scalar(int32_t* dst, const uint8_t* src,
+	size_t samples, float gain)
+{
+	for (size_t i = 0; i < samples; i++) {
+		dst[i] = gain_sat_scalar(load_u8(src + i), gain);
+	}
+}
+
+static void convert_gain_s16_scalar(int32_t* dst, const uint8_t* src,
+	size_t samples, float gain)
+{
+	for (size_t i = 0; i < samples; i++) {
+		dst[i] = gain_sat_scalar(load_s16(src + 2 * i), gain);
+	}
+}
+
+static void convert_gain_s24_scalar(int32_t* dst, const uint8_t* src,
+	size_t samples, float gain)
+{
+	size_t i = 0;
+
+	for (; i + 1 < samples; i++) {
+		dst[i] = gain_sat_scalar(load_s24_fast(src + 3 * i), gain);
+	}
+
+	for (; i < samples; i++) {
+		dst[i] = gain_sat_scalar(load_s24(src + 3 * i), gain);
+	}
+}
+
+static void convert_gain_s32_scalar(int32_t* dst, const uint8_t* src,
+	size_t samples, float gain)
+{
+	for (size_t i = 0; i < samples; i++) {
+		dst[i] = gain_sat_scalar(load_s32(src + 4 * i), gain);
+	}
+}
+
+static inline int32_t load_f32(const uint8_t* src, float scale) {
+	float f;
+	memcpy(&f, src, sizeof(f));
+
+	f *= scale;
+	f = (f == f) ? f : 0.0f; // NaN, and inf times a gain of 0
+	f = (f > GAIN_MAX) ? GAIN_MAX : f;
+	f = (f < GAIN_MIN) ? GAIN_MIN : f;
+
+	return (int32_t) f;
+}
+
+static void convert_gain_f32_scalar(int32_t* dst, const uint8_t* src,
+	size_t samples, float gain)
+{
+	float scale = gain * F32_SCALE;
+
+	for (size_t i = 0; i < samples; i++) {
+		dst[i] = load_f32(src + 4 * i, scale);
+	}
+}
+
+static void convert_f32_scalar(int32_t* dst, const uint8_t* src, size_t samples) {
+	convert_gain_f32_scalar(dst, src, samples, 1.0f);
+}
+
+static void mix_scalar(int32_t* dst, const int32_t* a, const int32_t* b,
+	const float* gain_a, const float* gain_b, size_t samples)
+{
+	for (size_t i = 0; i < samples; i++) {
+		float f = (float) a[i] * gain_a[i] + (float) b[i] * gain_b[i];
+
+		f = (f > GAIN_MAX) ? GAIN_MAX : f;
+		f = (f < GAIN_MIN) ? GAIN_MIN : f;
+
+		dst[i] = (int32_t) f;
+	}
+}
+
+static void scale_scalar(int32_t* buf, const float* gain, size_t samples) {
+	for (size_t i = 0; i < samples; i++) {
+		float f = (float) buf[i] * gain[i];
+
+		f = (f > GAIN_MAX) ? GAIN_MAX : f;
+		f = (f < GAIN_MIN) ? GAIN_MIN : f;
+
+		buf[i] = (int32_t) f;
+	}
+}
+
+static float peak_scalar(const int32_t* buf, size_t samples) {
+	float peak = 0.0f;
+
+	for (size_t i = 0; i < samples; i++) {
+		float f = fabsf((float) buf[i]);
+		peak = (f > peak) ? f : peak;
+	}
+
+	return peak;
+}
+
+#ifdef CONVERT_X86
+
+/*	--- SSE2 --- */
+
+/*
+the widen helpers turn 4 samples into 4 left aligned s32 lanes, the
+kernels below are just loops over them, with or without the gain stage
+*/
+
+__attribute__((target("sse2")))
+static inline __m128i widen_u8_sse2(const uint8_t* src) {
+	const __m128i zero = _mm_setzero_si128();
+	int32_t raw;
+	memcpy(&raw, src, 4);
+
+	// unsigned -> signed, then interleaving with zeros puts each byte on top
+	__m128i v = _mm_xor_si128(_mm_cvtsi32_si128(raw), _mm_set1_epi8((char) 0x80));
+	v = _mm_unpacklo_epi8(zero, v);
+
+	return _mm_unpacklo_epi16(zero, v);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i widen_s16_sse2(const uint8_t* src) {
+	__m128i v = _mm_loadl_epi64((const __m128i*) src);
+	return _mm_unpacklo_epi16(_mm_setzero_si128(), v);
+}
+
+/*
+4 samples are 12 bytes: bytes 0..7 and 6..13 go to the two 64 bit
+halves, each one then holds a sample at byte 0 and one at byte 3. a 32
+bit shift by 8 puts the first in the top of the low lane, a 64 bit shift
+by 16 the second in the top of the high lane, and the masks keep each
+one where it belongs. reads 2 bytes past the 4th sample
+*/
+__attribute__((target("sse2")))
+static inline __m128i widen_s24_sse2(const uint8_t* src) {
+	const __m128i low = _mm_set_epi32(0, -1, 0, -1);
+	const __m128i high = _mm_set_epi32(-256, 0, -256, 0);
+	__m128i v = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*) src),
+		_mm_loadl_epi64((const __m128i*) (src + 6)));
+
+	return _mm_or_si128(_mm_and_si128(_mm_slli_epi32(v, 8), low),
+		_mm_and_si128(_mm_slli_epi64(v, 16), high));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i gain_sat_sse2(__m128i v, __m128 gain) {
+	__m128 f = _mm_mul_ps(_mm_cvtepi32_ps(v), gain);
+
+	f = _mm_min_ps(f, _mm_set1_ps(GAIN_MAX));
+	f = _mm_max_ps(f, _mm_set1_ps(GAIN_MIN));
+
+	return _mm_cvttps_epi32(f);
+}
+
+__attribute__((target("sse2")))
+static void convert_u8_sse2(int32_t* dst, const uint8_t* src, size_t samples) {
+	size_t i = 0;
+
+	for (; i + 4 <= samples; i += 4) {
+		_mm_storeu_si128((__m128i*) (dst + i), widen_u8_sse2(src + i));
+	}
+
+	convert_u8_scalar(dst + i, src + i, samples - i);
+}
+
+__attribute__((target("sse2")))
+static void convert_s16_sse2(int32_t* dst, const uint8_t* src, size_t samples) {
+	size_t i = 0;
+
+	for (; i + 4 <= samples; i += 4) {
+		_mm_storeu_si128((__m128i*) (dst + i), widen_s16_sse2(src + 2 * i));
+	}
+
+	convert_s16_scalar(dst + i, src + 2 * i, samples - i);
+}
+
+__attribute__((target("sse2")))
+static void convert_s24_sse2(int32_t* dst, const uint8_t* src, size_t samples) {
+	size_t i = 0;
+
+	for (; i + 5 <= samples; i += 4) {
+		_mm_storeu_si128((__m128i*) (dst + i), widen_s24_sse2(src + 3 * i));
+	}
+
+	convert_s24_scalar(dst + i, src + 3 * i, samples - i);
+}
+
+__attribute__((target("sse2")))
+static void convert_gain_u8_sse2(int32_t* dst, const uint8_t* src,
+	size_t samples, float gain)
+{
+	const __m128 g = _mm_set1_ps(gain);
+	size_t i = 0;
+
+	for (; i + 4 <= samples; i += 4) {
+		_mm_storeu_si128((__m128i*) (dst + i), gain_sat_sse2(widen_u8_sse2(src + i), g));
+	}
+
+	convert_gain_u8_scalar(dst + i, src + i, samples - i, gain);
+}
+
+__attribute__((target("sse2")))
+static void convert_gain_s16_sse2(int32_t* dst, const uint8_t* src,
+	size_t samples, float gain)
+{
+	const __m128 g = _mm_set1_ps(gain);
+	size_t i = 0;
+
+	for (; i + 4 <= samples; i += 4) {
+		_mm_storeu_si128((__m128i*) (dst + i), gain_sat_sse2(widen_s16_sse2(src + 2 * i), g));
+	}
+
+	convert_gain_s16_scalar(dst + i, src + 2 * i, samples - i, gain);
+}
+
+__attribute__((target("sse2")))
+static void convert_gain_s24_sse2(int32_t* dst, const uint8_t* src,
+	size_t samples, float gain)
+{
+	const __m128 g = _mm_set1_ps(gain);
+	size_t i = 0;
+
+	for (; i + 5 <= samples; i += 4) {
+		_mm_storeu_si128((__m128i*) (dst + i), gain_sat_sse2(widen_s24_sse2(src + 3 * i), g));
+	}
+
+	convert_gain_s24_scalar(dst + i, src + 3 * i, samples - i, gain);
+}
+
+/*
+with ssse3 a byte shuffle puts the 4 samples of a 16 byte load in the
+top of their lanes (-128 writes zero), 3 instructions per 4 samples.
+the load reads 4 bytes past the 4th sample
+*/
+__attribute__((target("ssse3")))
+static inline __m128i widen_s24_ssse3(const uint8_t* src) {
+	const __m128i shuffle = _mm_setr_epi8(
+		-128, 0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11);
+
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) src), shuffle);
+}
+
+__attribute__((target("ssse3")))
+static void convert_s24_ssse3(int32_t* dst, const uint8_t* src, size_t samples) {
+	size_t i = 0;
+
+	for (; i + 6 <= samples; i += 4) {
+		_mm_storeu_si128((__m128i*) (dst + i), widen_s24_ssse3(src + 3 * i));
+	}
+
+	convert_s24_scalar(dst + i, src + 3 * i, samples - i);
+}
+
+__attribute__((target("ssse3")))
+static void convert_gain_s24_ssse3(int32_t* dst, const uint8_t* src,
+	size_t samples, float gain)
+{
+	const __m128 g = _mm_set1_ps(gain);
+	size_t i = 0;
+
+	for (; i + 6 <= samples; i += 4) {
+		_mm_storeu_si128((__m128i*) (dst + i), gain_sat_sse2(widen_s24_ssse3(src + 3 * i), g));
+	}
+
+	convert_gain_s24_scalar(dst + i, src + 3 * i, samples - i, gain);
+}
+
+__attribute__((target("sse2")))
+static void convert_gain_s32_sse2(int32_t* dst, const uint8_t* src,
+	size_t samples, float gain)
+{
+	const __m128 g = _mm_set1_ps(gain);
+	size_t i = 0;
+
+	for (; i + 4 <= samples; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (src + 4 * i));
+		_mm_storeu_si128((__m128i*) (dst + i), gain_sat_sse2(v, g));
+	}
+
+	convert_gain_s32_scalar(dst + i, src + 4 * i, samples - i, gain);
+}
+
+// cmpord is false only for NaN, masking the product with it zeroes them and inf * 0
+__attribute__((target("sse2")))
+static void convert_gain_f32_sse2(int32_t* dst, const uint8_t* src,
+	size_t samples, float gain)
+{
+	const __m128 scale = _mm_set1_ps(gain * F32_SCALE);
+	size_t i = 0;
+
+	for (; i + 4 <= samples; i += 4) {
+		__m128 f = _mm_mul_ps(_mm_loadu_ps((const float*) (src + 4 * i)), scale);
+		f = _mm_and_ps(f, _mm_cmpord_ps(f, f));
+		f = _mm_min_ps(f, _mm_set1_ps(GAIN_MAX));
+		f = _mm_max_ps(f, _mm_set1_ps(GAIN_MIN));
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_cvttps_epi32(f));
+	}
+
+	convert_gain_f32_scalar(dst + i, src + 4 * i, samples - i, gain);
+}
+
+__attribute__((target("sse2")))
+static void convert_f32_sse2(int32_t* dst, const uint8_t* src, size_t samples) {
+	convert_gain_f32_sse2(dst, src, samples, 1.0f);
+}
+
+__attribute__((target("sse2")))
+static void mix_sse2(int32_t* dst, const int32_t* a, const int32_t* b,
+	const float* gain_a, const float* gain_b, size_t samples)
+{
+	size_t i = 0;
+
+	for (; i + 4 <= samples; i += 4) {
+		__m128 fa = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*) (a + i)));
+		__m128 fb = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*) (b + i)));
+		__m128 f = _mm_add_ps(_mm_mul_ps(fa, _mm_loadu_ps(gain_a + i)),
+			_mm_mul_ps(fb, _mm_loadu_ps(gain_b + i)));
+
+		f = _mm_min_ps(f, _mm_set1_ps(GAIN_MAX));
+		f = _mm_max_ps(f, _mm_set1_ps(GAIN_MIN));
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_cvttps_epi32(f));
+	}
+
+	mix_scalar(dst + i, a + i, b + i, gain_a + i, gain_b + i, samples - i);
+}
+
+__attribute__((target("sse2")))
+static void scale_sse2(int32_t* buf, const float* gain, size_t samples) {
+	size_t i = 0;
+
+	for (; i + 4 <= samples; i += 4) {
+		__m128 f = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*) (buf + i)));
+
+		f = _mm_mul_ps(f, _mm_loadu_ps(gain + i));
+		f = _mm_min_ps(f, _mm_set1_ps(GAIN_MAX));
+		f = _mm_max_ps(f, _mm_set1_ps(GAIN_MIN));
+		_mm_storeu_si128((__m128i*) (buf + i), _mm_cvttps_epi32(f));
+	}
+
+	scale_scalar(buf + i, gain + i, samples - i);
+}
+
+// |x| is x without its sign bit, in float where sse2 has a max
+__attribute__((target("sse2")))
+static float peak_sse2(const int32_t* buf, size_t samples) {
+	const __m128 magnitude = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	__m128 peak = _mm_setzero_ps();
+	__m128 odd = _mm_setzero_ps(); // two chains of max, half the latency
+	size_t i = 0;
+
+	for (; i + 8 <= samples; i += 8) {
+		__m128 f = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*) (buf + i)));
+		__m128 g = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*) (buf + i + 4)));
+
+		peak = _mm_max_ps(peak, _mm_and_ps(f, magnitude));
+		odd = _mm_max_ps(odd, _mm_and_ps(g, magnitude));
+	}
+
+	peak = _mm_max_ps(peak, odd);
+	peak = _mm_max_ps(peak, _mm_movehl_ps(peak, peak));
+	peak = _mm_max_ss(peak, _mm_shuffle_ps(peak, peak, 1));
+
+	float tail = peak_scalar(buf + i, samples - i);
+	float head = _mm_cvtss_f32(peak);
+
+	return (tail > head) ? tail : head;
+}
+
+/*	--- AVX2 --- */
+
+// same idea as sse2, 8 samples per helper
+__attribute__((target("avx2")))
+static inline __m256i widen_u8_avx2(const uint8_t* src) {
+	__m128i v = _mm_loadl_epi64((const __m128i*) src);
+	v = _mm_xor_si128(v, _mm_set1_epi8((char) 0x80));
+
+	return _mm256_slli_epi32(_mm256_cvtepi8_epi32(v), 24);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i widen_s16_avx2(const uint8_t* src) {
+	__m128i v = _mm_loadu_si128((const __m128i*) src);
+	return _mm256_slli_epi32(_mm256_cvtepi16_epi32(v), 16);
+}
+
+/*
+8 samples are 24 bytes: dwords 0..2 go to the low 128 bit lane and
+dwords 3..5 to the high one, then a byte shuffle inside each lane puts
+every 3 byte sample in the top of a 32 bit lane (-128 writes zero).
+the 32 byte load reads 8 bytes past the 8th sample
+*/
+__attribute__((target("avx2")))
+static inline __m256i widen_s24_avx2(const uint8_t* src) {
+	const __m256i spread = _mm256_setr_epi32(0, 1, 2, 2, 3, 4, 5, 5);
+	const __m256i shuffle = _mm256_setr_epi8(
+		-128, 0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11,
+		-128, 0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11);
+
+	__m256i v = _mm256_loadu_si256((const __m256i*) src);
+	v = _mm256_permutevar8x32_epi32(v, spread);
+
+	return _mm256_shuffle_epi8(v, shuffle);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i gain_sat_avx2(__m256i v, __m256 gain) {
+	__m256 f = _mm256_mul_ps(_mm256_cvtepi32_ps(v), gain);
+
+	f = _mm256_min_ps(f, _mm256_set1_ps(GAIN_MAX));
+	f = _mm256_max_ps(f, _mm256_set1_ps(GAIN_MIN));
+
+	return _mm256_cvttps_epi32(f);
+}
+
+__attribute__((target("avx2")))
+static void convert_u8_avx2(int32_t* dst, const uint8_t* src, size_t samples) {
+	size_t i = 0;
+
+	for (; i + 8 <= samples; i += 8) {
+		_mm256_storeu_si256((__m256i*) (dst + i), widen_u8_avx2(src + i));
+	}
+
+	convert_u8_scalar(dst + i, src + i, samples - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_s16_avx2(int32_t* dst, const uint8_t* src, size_t samples) {
+	size_t i = 0;
+
+	for (; i + 8 <= samples; i += 8) {
+		_mm256_storeu_si256((__m256i*) (dst + i), widen_s16_avx2(src + 2 * i));
+	}
+
+	convert_s16_scalar(dst + i, src + 2 * i, samples - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_s24_avx2(int32_t* dst, const uint8_t* src, size_t samples) {
+	size_t i = 0;
+
+	for (; i + 11 <= samples; i += 8) {
+		_mm256_storeu_si256((__m256i*) (dst + i), widen_s24_avx2(src + 3 * i));
+	}
+
+	convert_s24_scalar(dst + i, src + 3 * i, samples - i);
+}
+
+__attribute__((target("avx2")))
+static void convert_gain_u8_avx2(int32_t* dst, const uint8_t* src,
+	size_t samples, float gain)
+{
+	const __m256 g = _mm256_set1_ps(gain);
+	size_t i = 0;
+
+	for (; i + 8 <= samples; i += 8) {
+		_mm256_storeu_si256((__m256i*) (dst + i), gain_sat_avx2(widen_u8_avx2(src + i), g));
+	}
+
+	convert_gain_u8_scalar(dst + i, src + i, samples - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void convert_gain_s16_avx2(int32_t* dst, const uint8_t* src,
+	size_t samples, float gain)
+{
+	const __m256 g = _mm256_set1_ps(gain);
+	size_t i = 0;
+
+	for (; i + 8 <= samples; i += 8) {
+		_mm256_storeu_si256((__m256i*) (dst + i), gain_sat_avx2(widen_s16_avx2(src + 2 * i), g));
+	}
+
+	convert_gain_s16_scalar(dst + i, src + 2 * i, samples - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void convert_gain_s24_avx2(int32_t* dst, const uint8_t* src,
+	size_t samples, float gain)
+{
+	const __m256 g = _mm256_set1_ps(gain);
+	size_t i = 0;
+
+	for (; i + 11 <= samples; i += 8) {
+		_mm256_storeu_si256((__m256i*) (dst + i), gain_sat_avx2(widen_s24_avx2(src + 3 * i), g));
+	}
+
+	convert_gain_s24_scalar(dst + i, src + 3 * i, samples - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void convert_gain_s32_avx2(int32_t* dst, const uint8_t* src,
+	size_t samples, float gain)
+{
+	const __m256 g = _mm256_set1_ps(gain);
+	size_t i = 0;
+
+	for (; i + 8 <= samples; i += 8) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) (src + 4 * i));
+		_mm256_storeu_si256((__m256i*) (dst + i), gain_sat_avx2(v, g));
+	}
+
+	convert_gain_s32_scalar(dst + i, src + 4 * i, samples - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void convert_gain_f32_avx2(int32_t* dst, const uint8_t* src,
+	size_t samples, float gain)
+{
+	const __m256 scale = _mm256_set1_ps(gain * F32_SCALE);
+	size_t i = 0;
+
+	for (; i + 8 <= samples; i += 8) {
+		__m256 f = _mm256_mul_ps(_mm256_loadu_ps((const float*) (src + 4 * i)), scale);
+		f = _mm256_and_ps(f, _mm256_cmp_ps(f, f, _CMP_ORD_Q));
+		f = _mm256_min_ps(f, _mm256_set1_ps(GAIN_MAX));
+		f = _mm256_max_ps(f, _mm256_set1_ps(GAIN_MIN));
+		_mm256_storeu_si256((__m256i*) (dst + i), _mm256_cvttps_epi32(f));
+	}
+
+	convert_gain_f32_scalar(dst + i, src + 4 * i, samples - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void convert_f32_avx2(int32_t* dst, const uint8_t* src, size_t samples) {
+	convert_gain_f32_avx2(dst, src, samples, 1.0f);
+}
+
+__attribute__((target("avx2")))
+static void mix_avx2(int32_t* dst, const int32_t* a, const int32_t* b,
+	const float* gain_a, const float* gain_b, size_t samples)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= samples; i += 8) {
+		__m256 fa = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*) (a + i)));
+		__m256 fb = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*) (b + i)));
+		__m256 f = _mm256_add_ps(_mm256_mul_ps(fa, _mm256_loadu_ps(gain_a + i)),
+			_mm256_mul_ps(fb, _mm256_loadu_ps(gain_b + i)));
+
+		f = _mm256_min_ps(f, _mm256_set1_ps(GAIN_MAX));
+		f = _mm256_max_ps(f, _mm256_set1_ps(GAIN_MIN));
+		_mm256_storeu_si256((__m256i*) (dst + i), _mm256_cvttps_epi32(f));
+	}
+
+	mix_scalar(dst + i, a + i, b + i, gain_a + i, gain_b + i, samples - i);
+}
+
+__attribute__((target("avx2")))
+static void scale_avx2(int32_t* buf, const float* gain, size_t samples) {
+	size_t i = 0;
+
+	for (; i + 8 <= samples; i += 8) {
+		__m256 f = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*) (buf + i)));
+
+		f = _mm256_mul_ps(f, _mm256_loadu_ps(gain + i));
+		f = _mm256_min_ps(f, _mm256_set1_ps(GAIN_MAX));
+		f = _mm256_max_ps(f, _mm256_set1_ps(GAIN_MIN));
+		_mm256_storeu_si256((__m256i*) (buf + i), _mm256_cvttps_epi32(f));
+	}
+
+	scale_scalar(buf + i, gain + i, samples - i);
+}
+
+__attribute__((target("avx2")))
+static float peak_avx2(const int32_t* buf, size_t samples) {
+	const __m256 magnitude = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+	__m256 peak = _mm256_setzero_ps();
+	__m256 odd = _mm256_setzero_ps();
+	size_t i = 0;
+
+	for (; i + 16 <= samples; i += 16) {
+		__m256 f = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*) (buf + i)));
+		__m256 g = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*) (buf + i + 8)));
+
+		peak = _mm256_max_ps(peak, _mm256_and_ps(f, magnitude));
+		odd = _mm256_max_ps(odd, _mm256_and_ps(g, magnitude));
+	}
+
+	peak = _mm256_max_ps(peak, odd);
+
+	__m128 half = _mm_max_ps(_mm256_castps256_ps128(peak), _mm256_extractf128_ps(peak, 1));
+
+	half = _mm_max_ps(half, _mm_movehl_ps(half, half));
+	half = _mm_max_ss(half, _mm_shuffle_ps(half, half, 1));
+
+	float tail = peak_scalar(buf + i, samples - i);
+	float head = _mm_cvtss_f32(half);
+
+	return (tail > head) ? tail : head;
+}
+
+#endif
+
+/*	--- DISPATCH --- */
+
+enum cpu_isa cpu_detect_isa(void) {
+#ifdef CONVERT_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		return ISA_AVX2;
+	}
+
+	if (__builtin_cpu_supports("sse2")) {
+		return ISA_SSE2;
+	}
+#endif
+
+	return ISA_SCALAR;
+}
+
+const char* cpu_isa_name(enum cpu_isa isa) {
+	switch (isa) {
+		case ISA_AVX2:
+			return "avx2";
+		case ISA_SSE2:
+			return "sse2";
+		default:
+			return "scalar";
+	}
+}
+
+static enum cpu_isa detected_isa;
+
+static void detect_isa(void) {
+	detected_isa = cpu_detect_isa();
+}
+
+// the loudness workers load formats too, so detected once for all threads
+static enum cpu_isa best_isa(void) {
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, detect_isa);
+
+	return detected_isa;
+}
+
+// float is 32-bit only, no double
+static convert_fn convert_float_kernel_for(uint16_t bits_per_sample, enum cpu_isa isa) {
+	if (bits_per_sample != 32) {
+		return NULL;
+	}
+
+#ifdef CONVERT_X86
+	if (isa == ISA_AVX2) {
+		return convert_f32_avx2;
+	}
+
+	if (isa == ISA_SSE2) {
+		return convert_f32_sse2;
+	}
+#else
+	(void) isa;
+#endif
+
+	return convert_f32_scalar;
+}
+
+static convert_gain_fn convert_gain_float_kernel_for(uint16_t bits_per_sample, enum cpu_isa isa) {
+	if (bits_per_sample != 32) {
+		return NULL;
+	}
+
+#ifdef CONVERT_X86
+	if (isa == ISA_AVX2) {
+		return convert_gain_f32_avx2;
+	}
+
+	if (isa == ISA_SSE2) {
+		return convert_gain_f32_sse2;
+	}
+#else
+	(void) isa;
+#endif
+
+	return convert_gain_f32_scalar;
+}
+
+convert_fn convert_kernel_for(uint16_t audio_format, uint16_t bits_per_sample, enum cpu_isa isa) {
+	if (audio_format == WAV_FORMAT_FLOAT) {
+		return convert_float_kernel_for(bits_per_sample, isa);
+	}
+
+#ifdef CONVERT_X86
+	if (isa == ISA_AVX2) {
+		switch (bits_per_sample) {
+			case 8: return convert_u8_avx2;
+			case 16: return convert_s16_avx2;
+			case 24: return convert_s24_avx2;
+			case 32: return convert_s32;
+		}
+	}
+
+	if (isa == ISA_SSE2) {
+		switch (bits_per_sample) {
+			case 8: return convert_u8_sse2;
+			case 16: return convert_s16_sse2;
+			// ssse3 only helps 24-bit, checked here instead of being a level of its own
+			case 24: return __builtin_cpu_supports("ssse3") ? convert_s24_ssse3 : convert_s24_sse2;
+			case 32: return convert_s32;
+		}
+	}
+#else
+	(void) isa;
+#endif
+
+	switch (bits_per_sample) {
+		case 8: return convert_u8_scalar;
+		case 16: return convert_s16_scalar;
+		case 24: return convert_s24_scalar;
+		case 32: return convert_s32;
+	}
+
+	return NULL;
+}
+
+convert_fn convert_select(uint16_t audio_format, uint16_t bits_per_sample) {
+	return convert_kernel_for(audio_format, bits_per_sample, best_isa());
+}
+
+convert_gain_fn convert_gain_kernel_for(uint16_t audio_format, uint16_t bits_per_sample,
+	enum cpu_isa isa)
+{
+	if (audio_format == WAV_FORMAT_FLOAT) {
+		return convert_gain_float_kernel_for(bits_per_sample, isa);
+	}
+
+#ifdef CONVERT_X86
+	if (isa == ISA_AVX2) {
+		switch (bits_per_sample) {
+			case 8: return convert_gain_u8_avx2;
+			case 16: return convert_gain_s16_avx2;
+			case 24: return convert_gain_s24_avx2;
+			case 32: return convert_gain_s32_avx2;
+		}
+	}
+
+	if (isa == ISA_SSE2) {
+		switch (bits_per_sample) {
+			case 8: return convert_gain_u8_sse2;
+			case 16: return convert_gain_s16_sse2;
+			case 24: return __builtin_cpu_supports("ssse3")
+				? convert_gain_s24_ssse3 : convert_gain_s24_sse2;
+			case 32: return convert_gain_s32_sse2;
+		}
+	}
+#else
+	(void) isa;
+#endif
+
+	switch (bits_per_sample) {
+		case 8: return convert_gain_u8_scalar;
+		case 16: return convert_gain_s16_scalar;
+		case 24: return convert_gain_s24_scalar;
+		case 32: return convert_gain_s32_scalar;
+	}
+
+	return NULL;
+}
+
+convert_gain_fn convert_gain_select(uint16_t audio_format, uint16_t bits_per_sample) {
+	return convert_gain_kernel_for(audio_format, bits_per_sample, best_isa());
+}
+
+mix_fn mix_kernel_for(enum cpu_isa isa) {
+#ifdef CONVERT_X86
+	if (isa == ISA_AVX2) {
+		return mix_avx2;
+	}
+
+	if (isa == ISA_SSE2) {
+		return mix_sse2;
+	}
+#else
+	(void) isa;
+#endif
+
+	return mix_scalar;
+}
+
+mix_fn mix_select(void) {
+	return mix_kernel_for(best_isa());
+}
+
+scale_fn scale_kernel_for(enum cpu_isa isa) {
+#ifdef CONVERT_X86
+	if (isa == ISA_AVX2) {
+		return scale_avx2;
+	}
+
+	if (isa == ISA_SSE2) {
+		return scale_sse2;
+	}
+#else
+	(void) isa;
+#endif
+
+	return scale_scalar;
+}
+
+scale_fn scale_select(void) {
+	return scale_kernel_for(best_isa());
+}
+
+peak_fn peak_kernel_for(enum cpu_isa isa) {
+#ifdef CONVERT_X86
+	if (isa == ISA_AVX2) {
+		return peak_avx2;
+	}
+
+	if (isa == ISA_SSE2) {
+		return peak_sse2;
+	}
+#else
+	(void) isa;
+#endif
+
+	return peak_scalar;
+}
+
+peak_fn peak_select(void) {
+	return peak_kernel_for(best_isa());
+}
+
+int stream_format_init(struct stream_format* fmt, uint16_t audio_format, uint16_t channels,
+	uint16_t bits_per_sample, uint32_t sample_rate)
+{
+	fmt->audio_format = audio_format;
+	fmt->channels = channels;
+	fmt->bits_per_sample = bits_per_sample;
+	fmt->sample_rate = sample_rate;
+	fmt->frame_size = channels * (bits_per_sample / 8);
+	fmt->convert = convert_select(audio_format, bits_per_sample);
+	fmt->convert_gain = convert_gain_select(audio_format, bits_per_sample);
+	fmt->gain = 1.0f;
+
+	if (!fmt->convert || !fmt->convert_gain || fmt->frame_size == 0) {
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,49 @@
+/*
+pcm -> s32 conversion kernels, the s32 mixer and gain
+
+one kernel per input sample format (u8, s16, s24, s32 and f32) and per
+instruction set. the best one for the running cpu is picked once, when a
+track is loaded, and stored in its stream_format, so the inner loops
+don't test the format anymore
+*/
+
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include "types.h"
+
+enum cpu_isa {
+	ISA_SCALAR,
+	ISA_SSE2,
+	ISA_AVX2
+};
+
+enum cpu_isa cpu_detect_isa(void);
+const char* cpu_isa_name(enum cpu_isa isa);
+
+// audio_format is WAV_FORMAT_PCM or WAV_FORMAT_FLOAT, NULL when the format isn't supported
+convert_fn convert_kernel_for(uint16_t audio_format, uint16_t bits_per_sample, enum cpu_isa isa);
+convert_fn convert_select(uint16_t audio_format, uint16_t bits_per_sample);
+
+// convert + gain + saturation in a single pass
+convert_gain_fn convert_gain_kernel_for(uint16_t audio_format, uint16_t bits_per_sample,
+	enum cpu_isa isa);
+convert_gain_fn convert_gain_select(uint16_t audio_format, uint16_t bits_per_sample);
+
+// dst = a * gain_a + b * gain_b, saturated. dst may be a
+mix_fn mix_kernel_for(enum cpu_isa isa);
+mix_fn mix_select(void);
+
+// buf *= gain, saturated (the limiter's last step)
+scale_fn scale_kernel_for(enum cpu_isa isa);
+scale_fn scale_select(void);
+
+// max |sample| (2^31 is full scale), what the limiter checks a block with
+peak_fn peak_kernel_for(enum cpu_isa isa);
+peak_fn peak_select(void);
+
+// fills fmt with the best kernels for this format, -1 if unsupported
+int stream_format_init(struct stream_format* fmt, uint16_t audio_format, uint16_t channels,
+	uint16_t bits_per_sample, uint32_t sample_rate);
+
+#endif
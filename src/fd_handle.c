@@ -3,6 +3,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 ssize_t read_bytes_from_file(int fd, void* buf, size_t size) {
 	size_t total_read = 0;
@@ -56,6 +58,229 @@ static uint32_t le32(const uint8_t* b) {
 		| (uint32_t)b[3] << 24;
 }
 
+static uint64_t le64(const uint8_t* b) {
+	return (uint64_t) le32(b) | (uint64_t) le32(b + 4) << 32;
+}
+
+static void put_le16(uint8_t* b, uint16_t v) {
+	b[0] = v & 0xFF;
+	b[1] = v >> 8;
+}
+
+static void put_le32(uint8_t* b, uint32_t v) {
+	b[0] = v & 0xFF;
+	b[1] = (v >> 8) & 0xFF;
+	b[2] = (v >> 16) & 0xFF;
+	b[3] = v >> 24;
+}
+
+/*
+canonical header of a pcm file: RIFF, a 16 byte fmt and the data chunk
+header, the samples follow right after it. data_size is in bytes
+*/
+void wav_build_header(uint8_t hdr[WAV_CANONICAL_HEADER], uint16_t channels,
+	uint16_t bits_per_sample, uint32_t sample_rate, uint32_t data_size)
+{
+	uint16_t frame_size = channels * (bits_per_sample / 8);
+
+	if (data_size > 0xFFFFFFFF - (WAV_CANONICAL_HEADER - 8)) {
+		data_size = 0xFFFFFFFF - (WAV_CANONICAL_HEADER - 8);
+	}
+
+	memcpy(hdr, "RIFF", 4);
+	put_le32(hdr + 4, WAV_CANONICAL_HEADER - 8 + data_size);
+	memcpy(hdr + 8, "WAVEfmt ", 8);
+	put_le32(hdr + 16, 16);
+	put_le16(hdr + 20, 1); // pcm
+	put_le16(hdr + 22, channels);
+	put_le32(hdr + 24, sample_rate);
+	put_le32(hdr + 28, sample_rate * frame_size);
+	put_le16(hdr + 32, frame_size);
+	put_le16(hdr + 34, bits_per_sample);
+	memcpy(hdr + 36, "data", 4);
+	put_le32(hdr + 40, data_size);
+}
+
+static const char* chunk_ids[CHUNK_TYPES] = {
+	[CHUNK_FMT] = "fmt ",
+	[CHUNK_DATA] = "data",
+	[CHUNK_LIST] = "LIST",
+	[CHUNK_CUE] = "cue ",
+	[CHUNK_SMPL] = "smpl",
+	[CHUNK_FACT] = "fact",
+};
+
+/*
+the sub format of an extensible fmt is a guid whose first two bytes are
+the plain audio_format code, the other 14 are the same for all of them
+*/
+static const uint8_t subformat_guid_tail[14] = {
+	0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+};
+
+// bytes of fmt that parse_fmt reads
+static size_t fmt_needed(uint32_t size) {
+	return (size < WAV_FMT_EXTENSIBLE_SIZE) ? 16 : WAV_FMT_EXTENSIBLE_SIZE;
+}
+
+static int parse_fmt(const uint8_t* p, uint32_t size, struct wav_information* wav) {
+	if (size < 16) {
+		fprintf(stderr, "invalid format_sub_chunk\n");
+		return -1;
+	}
+
+	uint16_t audio_format = le16(p);
+
+	wav->channels = le16(p + 2);
+	wav->sample_rate = le32(p + 4);
+	wav->byte_rate = le32(p + 8);
+	// p + 12 is byte_align
+	wav->bits_per_sample = le16(p + 14);
+	wav->valid_bits = wav->bits_per_sample;
+
+	// cb_size, then valid bits per sample, the channel mask and the sub format
+	if (audio_format == WAV_FORMAT_EXTENSIBLE) {
+		if (size < WAV_FMT_EXTENSIBLE_SIZE || le16(p + 16) < 22
+			|| memcmp(p + 26, subformat_guid_tail, sizeof(subformat_guid_tail)) != 0) {
+			fprintf(stderr, "unsupported extensible sub format\n");
+			return -1;
+		}
+
+		uint16_t valid_bits = le16(p + 18);
+
+		if (valid_bits > wav->bits_per_sample) {
+			fprintf(stderr, "invalid valid bits per sample: %u\n", valid_bits);
+			return -1;
+		}
+
+		// 0 means every bit of the container
+		if (valid_bits > 0) {
+			wav->valid_bits = valid_bits;
+		}
+
+		audio_format = le16(p + 24);
+	}
+
+	// the samples are left aligned in their container, padding bits are zero
+	int pcm = audio_format == WAV_FORMAT_PCM && wav->bits_per_sample % 8 == 0
+		&& wav->bits_per_sample >= 8 && wav->bits_per_sample <= 32;
+	int ieee = audio_format == WAV_FORMAT_FLOAT && wav->bits_per_sample == 32;
+
+	if (!pcm && !ieee) {
+		fprintf(stderr, "unsupported audio format: 0x%04x, %u bits\n",
+			audio_format, wav->bits_per_sample);
+		return -1;
+	}
+
+	wav->audio_format = audio_format;
+	wav->frame_size = wav->channels * (wav->bits_per_sample / 8);
+
+	return 0;
+}
+
+/*
+buf holds len bytes of the file starting at offset base. walks the chunk
+headers from *pos (absolute) while they are inside buf, filling the chunk
+table, and parses fmt on the way. returns 0 once fmt and data are both
+known, 1 with *pos on the first header past buf when something is still
+missing, -1 on a bad fmt or ds64 chunk. whatever metadata sits in buf
+after data is recorded too, it's already in memory.
+an rf64 file has a ds64 chunk first, with the 64-bit size of data: its
+data header says WAV_SIZE_IN_DS64. the ds64 table (64-bit sizes of
+other chunks) isn't read, only data goes past 4 GiB in practice
+*/
+static int walk_chunks(const uint8_t* buf, size_t len, uint64_t base,
+	uint64_t* pos, struct wav_information* wav)
+{
+	while (*pos >= base && *pos - base + 8 <= len) {
+		const uint8_t* hdr = buf + (*pos - base);
+		size_t in_buf = len - (*pos - base) - 8; // payload bytes inside buf
+		uint64_t size = le32(hdr + 4);
+		uint64_t payload = *pos + 8;
+
+		if (memcmp(hdr, "ds64", 4) == 0) {
+			if (in_buf < WAV_DS64_SIZE || size < WAV_DS64_SIZE) {
+				fprintf(stderr, "invalid ds64 chunk\n");
+				return -1;
+			}
+
+			// riff size at + 8, data size at + 16
+			wav->ds64_data_size = le64(hdr + 16);
+		}
+
+		if (size == WAV_SIZE_IN_DS64 && memcmp(hdr, "data", 4) == 0 && wav->ds64_data_size) {
+			size = wav->ds64_data_size;
+		}
+
+		// fmt cut by the end of buf: read again from its header
+		if (memcmp(hdr, "fmt ", 4) == 0 && in_buf < fmt_needed(size) && *pos != base) {
+			return 1;
+		}
+
+		for (int i = 0; i < CHUNK_TYPES; i++) {
+			if (memcmp(hdr, chunk_ids[i], 4) != 0 || wav->chunks[i].offset != 0) {
+				continue;
+			}
+
+			// only the INFO list carries tags (adtl lists belong to cue)
+			if (i == CHUNK_LIST && (in_buf < 4 || memcmp(hdr + 8, "INFO", 4) != 0)) {
+				break;
+			}
+
+			if (i == CHUNK_FMT && (in_buf < fmt_needed(size) || parse_fmt(hdr + 8, size, wav) < 0)) {
+				return -1;
+			}
+
+			wav->chunks[i].offset = payload;
+			wav->chunks[i].size = size;
+			break;
+		}
+
+		// consider chunk padding
+		*pos = payload + size + (size & 1);
+	}
+
+	if (wav->chunks[CHUNK_FMT].offset && wav->chunks[CHUNK_DATA].offset) {
+		return 0;
+	}
+
+	return 1;
+}
+
+static void set_data_chunk(struct wav_information* wav) {
+	wav->data_offset = wav->chunks[CHUNK_DATA].offset;
+	wav->data_size = wav->chunks[CHUNK_DATA].size;
+	wav->frames_played = 0;
+	wav->prefetched = 0;
+	wav->frames_left = wav->frame_size ? wav->data_size / wav->frame_size : 0;
+}
+
+// RF64 (ebu tech 3306) and BW64 (itu bs.2088) are riff with 64-bit sizes
+static int is_riff(const uint8_t* buf) {
+	return memcmp(buf, "RIFF", 4) == 0 || memcmp(buf, "RF64", 4) == 0
+		|| memcmp(buf, "BW64", 4) == 0;
+}
+
+static int check_riff(const uint8_t* buf, size_t len) {
+	if (len < 12 || !is_riff(buf)) {
+		fprintf(stderr, "invalid riff header\n");
+		return -1;
+	}
+
+	if (memcmp(buf + 8, "WAVE", 4) != 0) {
+		fprintf(stderr, "invalid file format\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+reads the first WAV_HEADER_BLOCK bytes and builds the chunk table from
+memory. another block is only read when fmt or data start further out
+(a big LIST or JUNK before data), at the first header that was missing.
+returns the fd positioned at the start of the data chunk
+*/
 int get_wav_information(const char* path, struct wav_information* wav) {
 	int fd = open(path, O_RDONLY);
 
@@ -64,145 +289,235 @@ int get_wav_information(const char* path, struct wav_information* wav) {
 		return -1;
 	}
 
-	uint8_t hdr_riff[12];
-	struct riff_header riff;
+	uint8_t buf[WAV_HEADER_BLOCK];
+	ssize_t len = pread(fd, buf, sizeof(buf), 0);
 
-	if (read_bytes_from_file(fd, hdr_riff, sizeof(riff)) != sizeof(riff)) {
-		fprintf(stderr, "failed to read riff header\n");
+	if (len < 0 || check_riff(buf, len) < 0) {
 		goto fail;
 	}
 
-	memcpy(riff.chunk_id, hdr_riff, 4);
-	riff.chunk_size = le32(hdr_riff + 4);
-	memcpy(riff.format, hdr_riff + 8, 4);
+	memset(wav->chunks, 0, sizeof(wav->chunks));
+	wav->ds64_data_size = 0;
 
-	if (memcmp(riff.chunk_id, "RIFF", 4) != 0) {
-		fprintf(stderr, "invalid riff header\n");
-		goto fail;
+	uint64_t base = 0;
+	uint64_t pos = 12;
+	int ret;
+
+	while ((ret = walk_chunks(buf, len, base, &pos, wav)) == 1) {
+		base = pos;
+		len = pread(fd, buf, sizeof(buf), base);
+
+		if (len < 8) {
+			fprintf(stderr, "data sub chunk not found\n");
+			goto fail;
+		}
 	}
 
-	if (memcmp(riff.format, "WAVE", 4) != 0) {
-		fprintf(stderr, "invalid file format\n");
+	if (ret < 0) {
 		goto fail;
 	}
 
-	uint8_t hdr[8];
-	struct chunk_header fmt;
-	
-	if (read_bytes_from_file(fd, hdr, sizeof(fmt)) != sizeof(fmt)) {
-		fprintf(stderr, "failed to read format sub chunk\n");
+	set_data_chunk(wav);
+
+	if (lseek(fd, wav->data_offset, SEEK_SET) < 0) {
+		perror("lseek");
 		goto fail;
 	}
 
-	memcpy(fmt.id, hdr, 4);
-	fmt.size = le32(hdr + 4);
+	return fd;
 
-	if (memcmp(fmt.id, "fmt ", 4) != 0) {
-		fprintf(stderr, "invalid format_sub_chunk\n");
-		goto fail;
+	fail:
+		close(fd);
+		return -1;
+}
+
+/*
+same as get_wav_information for a header already in memory (the first
+len bytes of the file). returns 1 when fmt or data lie past len, the
+caller has to go back to the file for those
+*/
+int wav_parse_header(const uint8_t* buf, size_t len, struct wav_information* wav) {
+	if (len < 12 || !is_riff(buf) || memcmp(buf + 8, "WAVE", 4) != 0) {
+		return -1;
 	}
 
-	uint32_t bytes_read = 0;
-	uint8_t buf[4];
+	memset(wav->chunks, 0, sizeof(wav->chunks));
+	wav->ds64_data_size = 0;
 
-	if (read_bytes_from_file(fd, buf, 2) != 2) { // audio_format
-		fprintf(stderr, "failed to read audio format\n");
-		goto fail;
+	uint64_t pos = 12;
+	int ret = walk_chunks(buf, len, 0, &pos, wav);
+
+	if (ret == 0) {
+		set_data_chunk(wav);
 	}
 
-	uint16_t audio_format = le16(buf);
+	return ret;
+}
 
-	if (audio_format != 1 && audio_format != 0xFFFE) {
-		fprintf(stderr, "unsupported audio format (not pcm)\n");
-		goto fail;
+/*
+maps the data chunk found by get_wav_information, so the sound engine can
+convert straight from the page cache instead of read()ing every tick.
+mmap wants a page aligned offset, so the mapping starts at the page that
+contains data_offset and wav->data points inside it
+*/
+int wav_map_data(int fd, struct wav_information* wav) {
+	struct stat sb;
+
+	if (fstat(fd, &sb) < 0) {
+		perror("fstat");
+		return -1;
 	}
 
-	bytes_read += 2;
+	// a truncated file would SIGBUS when touching pages after EOF
+	if (wav->data_offset + wav->data_size > (uint64_t) sb.st_size) {
+		if (wav->data_offset >= (uint64_t) sb.st_size) {
+			return -1;
+		}
 
-	if (read_bytes_from_file(fd, buf, 2) != 2) {
-		fprintf(stderr, "failed to read channels\n");
-		goto fail;
+		wav->data_size = sb.st_size - wav->data_offset;
+		wav->frames_left = wav->data_size / wav->frame_size;
+	}
+
+	// too big for the address space (32-bit): read() takes over
+	if (wav->data_size == 0 || wav->data_size > SIZE_MAX / 2) {
+		return -1;
 	}
 
-	wav->channels = le16(buf);
-	bytes_read += 2;
+	long page_size = sysconf(_SC_PAGESIZE);
+	off_t start = wav->data_offset & ~((off_t) page_size - 1);
+	size_t delta = wav->data_offset - start;
+	size_t length = delta + wav->data_size;
 
-	if (read_bytes_from_file(fd, buf, 4) != 4) {
-		fprintf(stderr, "failed to read sample_rate\n");
-		goto fail;
+	void* base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, start);
+
+	if (base == MAP_FAILED) {
+		perror("mmap");
+		return -1;
 	}
 
-	wav->sample_rate = le32(buf);
-	bytes_read += 4;
+	madvise(base, length, MADV_SEQUENTIAL);
 
-	if (read_bytes_from_file(fd, buf, 4) != 4) {
-		fprintf(stderr, "failed to read byte_rate\n");
-		goto fail;
+	wav->map_base = base;
+	wav->map_length = length;
+	wav->data = (const uint8_t*) base + delta;
+	wav->advised = 0;
+	wav->kept_from = wav->kept_to = 0;
+
+	wav_map_advise(wav, 0);
+
+	return 0;
+}
+
+// gives back the pages of [from, to) (offsets in the mapping)
+static void wav_map_release(struct wav_information* wav, size_t from, size_t to) {
+	if (to > from) {
+		madvise((uint8_t*) wav->map_base + from, to - from, MADV_DONTNEED);
 	}
+}
 
-	wav->byte_rate = le32(buf);
-	bytes_read += 4;
+/*
+called with the byte position (inside the data chunk) the reader is at.
+keeps one window requested ahead of it and gives back the pages more
+than a window behind it, so memory stays flat no matter the file size.
+after a seek (advised reset to 0) everything around the old position
+goes, ahead of it too
+*/
+void wav_map_advise(struct wav_information* wav, size_t position) {
+	if (!wav->data) {
+		return;
+	}
 
-	if (lseek(fd, 2,SEEK_CUR) < 0) { // byte_align
-		perror("lseek");
-		goto fail;
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t delta = wav->data - (const uint8_t*) wav->map_base;
+	size_t at = delta + position; // position inside the mapping
+
+	// still more than half a window requested ahead (a seek resets advised)
+	if (position + MAP_WINDOW_SIZE / 2 < wav->advised) {
+		return;
 	}
 
-	bytes_read += 2;
+	size_t from = at & ~((size_t) page_size - 1);
+	size_t len = MAP_WINDOW_SIZE;
 
-	if (read_bytes_from_file(fd, buf, 2) != 2) {
-		fprintf(stderr, "failed to read bits_per_sample\n");
-		goto fail;
+	if (from + len > wav->map_length) {
+		len = wav->map_length - from;
 	}
 
-	wav->bits_per_sample = le16(buf);
-	bytes_read += 2;
+	if (wav->advised == 0) {
+		wav_map_release(wav, wav->kept_from, (wav->kept_to < from) ? wav->kept_to : from);
+		wav_map_release(wav, (wav->kept_from > from + len) ? wav->kept_from : from + len,
+			wav->kept_to);
+		wav->kept_from = from;
+	} else if (from >= MAP_WINDOW_SIZE && from - MAP_WINDOW_SIZE > wav->kept_from) {
+		wav_map_release(wav, wav->kept_from, from - MAP_WINDOW_SIZE);
+		wav->kept_from = from - MAP_WINDOW_SIZE;
+	}
 
-	if (fmt.size > bytes_read) {
-		size_t remaining = fmt.size - bytes_read;
+	madvise((uint8_t*) wav->map_base + from, len, MADV_WILLNEED);
+	wav->advised = from + len - delta;
+	wav->kept_to = from + len;
+}
 
-		if (lseek(fd, remaining, SEEK_CUR) < 0) {
-			perror("lseek");
-			goto fail;
-		}
+void wav_unmap_data(struct wav_information* wav) {
+	if (!wav->map_base) {
+		return;
 	}
 
-	wav->frame_size = wav->channels * (wav->bits_per_sample / 8);
+	munmap(wav->map_base, wav->map_length);
+	wav->map_base = NULL;
+	wav->map_length = 0;
+	wav->data = NULL;
+	wav->advised = 0;
+	wav->kept_from = wav->kept_to = 0;
+}
 
-	struct chunk_header chunk = {0};
+/*
+brings the first bytes of the data chunk into memory ahead of time (the
+next track, for gapless playback). touching one byte per page faults the
+mapping in, without mmap the kernel is asked to read it ahead
+*/
+void wav_prefill(int fd, struct wav_information* wav, size_t bytes) {
+	if (bytes > wav->data_size) {
+		bytes = wav->data_size;
+	}
 
-	while (read_bytes_from_file(fd, hdr, sizeof(struct chunk_header)) == sizeof(struct chunk_header)) {
-		memcpy(chunk.id, hdr, 4);
-		chunk.size = le32(hdr + 4);
+	if (!wav->data) {
+		posix_fadvise(fd, wav->data_offset, bytes, POSIX_FADV_WILLNEED);
+		return;
+	}
 
-		if (memcmp(chunk.id, "data", 4) == 0) {
-			wav->data_size = chunk.size;
-			wav->frames_played = 0;
-			wav->data_offset = lseek(fd, 0, SEEK_CUR);
-			wav->frames_left = wav->data_size / wav->frame_size;
-			return fd;
-		} else {
-			off_t skip = chunk.size;
+	long page_size = sysconf(_SC_PAGESIZE);
+	volatile uint8_t sink = 0;
 
-			// consider chunk padding
-			if (skip & 1) {
-				skip++;
-			}
+	for (size_t i = 0; i < bytes; i += page_size) {
+		sink += wav->data[i];
+	}
 
-			if (lseek(fd, skip, SEEK_CUR) == -1) {
-				perror("lseek");
-				goto fail;
-			}
-		}
+	(void) sink;
+}
+
+/*
+asks the kernel to bring bytes of the data chunk from position on into
+memory, without waiting for them (a seek target, so the read after the
+seek doesn't block on the disk)
+*/
+void wav_prefetch(int fd, const struct wav_information* wav, uint64_t position, size_t bytes) {
+	if (position >= wav->data_size) {
+		return;
 	}
 
-	close(fd);
-	return -1;
+	if (bytes > wav->data_size - position) {
+		bytes = wav->data_size - position;
+	}
 
-	fail:
-		if (fd >= 0) {
-			close(fd);
-		}
+	if (!wav->data) {
+		posix_fadvise(fd, wav->data_offset + position, bytes, POSIX_FADV_WILLNEED);
+		return;
+	}
 
-		return -1;
-}
\ No newline at end of file
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t at = (wav->data - (const uint8_t*) wav->map_base) + (size_t) position;
+	size_t from = at & ~((size_t) page_size - 1);
+
+	madvise((uint8_t*) wav->map_base + from, at - from + bytes, MADV_WILLNEED);
+}
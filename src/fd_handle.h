@@ -5,5 +5,15 @@
 
 ssize_t read_bytes_from_file(int fd, void* buf, size_t size);
 int get_wav_information(const char* path, struct wav_information* wav);
+int wav_parse_header(const uint8_t* buf, size_t len, struct wav_information* wav);
+int wav_map_data(int fd, struct wav_information* wav);
+void wav_map_advise(struct wav_information* wav, size_t position);
+void wav_unmap_data(struct wav_information* wav);
+void wav_prefill(int fd, struct wav_information* wav, size_t bytes);
+void wav_prefetch(int fd, const struct wav_information* wav, uint64_t position, size_t bytes);
+
+#define WAV_CANONICAL_HEADER 44
+void wav_build_header(uint8_t hdr[WAV_CANONICAL_HEADER], uint16_t channels,
+	uint16_t bits_per_sample, uint32_t sample_rate, uint32_t data_size);
 
 #endif
\ No newline at end of file
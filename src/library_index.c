@@ -0,0 +1,284 @@
+#include "library_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+static uint64_t fnv1a(uint64_t hash, const char* s) {
+	while (*s) {
+		hash ^= (uint8_t) *s++;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+/*
+~/.cache/nyplay/<hash>.idx, one file per (directory, recursive) pair,
+the hash is taken from the real path so ./ and its absolute path match
+*/
+static int index_file_path(char* out, size_t out_size, const char* dir, int recursive) {
+	char cache[PATH_MAX_LENGTH];
+	const char* xdg = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+
+	if (xdg && *xdg) {
+		snprintf(cache, sizeof(cache), "%s", xdg);
+	} else if (home && *home) {
+		snprintf(cache, sizeof(cache), "%s/.cache", home);
+	} else {
+		return -1;
+	}
+
+	mkdir(cache, 0755);
+
+	size_t len = strlen(cache);
+	snprintf(cache + len, sizeof(cache) - len, "/nyplay");
+
+	if (mkdir(cache, 0755) < 0 && errno != EEXIST) {
+		return -1;
+	}
+
+	char real[PATH_MAX];
+
+	if (!realpath(dir, real)) {
+		return -1;
+	}
+
+	uint64_t hash = fnv1a(14695981039346656037ULL, real);
+	hash = fnv1a(hash, recursive ? "\n1" : "\n0");
+
+	snprintf(out, out_size, "%s/%016llx.idx", cache, (unsigned long long) hash);
+
+	return 0;
+}
+
+int library_index_open(struct library_index* idx, const char* dir, int recursive) {
+	memset(idx, 0, sizeof(*idx));
+
+	if (index_file_path(idx->path, sizeof(idx->path), dir, recursive) < 0) {
+		idx->path[0] = '\0';
+		return -1;
+	}
+
+	int fd = open(idx->path, O_RDONLY);
+
+	if (fd < 0) {
+		return 0; // first scan of this directory
+	}
+
+	struct stat sb;
+
+	if (fstat(fd, &sb) < 0 || (size_t) sb.st_size < sizeof(struct index_header)) {
+		close(fd);
+		return 0;
+	}
+
+	void* map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		return 0;
+	}
+
+	const struct index_header* hdr = map;
+	size_t needed = sizeof(*hdr)
+		+ (size_t) hdr->count * sizeof(struct index_entry)
+		+ hdr->strings_size;
+
+	if (memcmp(hdr->magic, INDEX_MAGIC, 4) != 0
+		|| hdr->version != INDEX_VERSION
+		|| needed > (size_t) sb.st_size) {
+		munmap(map, sb.st_size); // stale or foreign file, rebuilt on save
+		return 0;
+	}
+
+	idx->map = map;
+	idx->map_length = sb.st_size;
+	idx->count = hdr->count;
+	idx->strings_size = hdr->strings_size;
+	idx->entries = (const struct index_entry*) ((const uint8_t*) map + sizeof(*hdr));
+	idx->strings = (const char*) (idx->entries + idx->count);
+
+	return 0;
+}
+
+void library_index_close(struct library_index* idx) {
+	if (idx->map) {
+		munmap(idx->map, idx->map_length);
+	}
+
+	idx->map = NULL;
+	idx->map_length = 0;
+	idx->entries = NULL;
+	idx->strings = NULL;
+	idx->count = 0;
+}
+
+void track_set_file_info(struct track* t, const struct stat* sb) {
+	t->size = sb->st_size;
+	t->mtime = (int64_t) sb->st_mtim.tv_sec * 1000000000LL + sb->st_mtim.tv_nsec;
+}
+
+static int entry_compare(const struct library_index* idx,
+	const struct index_entry* e, const char* path)
+{
+	if ((uint64_t) e->path_offset + e->path_length > idx->strings_size) {
+		return -1; // corrupted entry, never matches
+	}
+
+	size_t len = strlen(path);
+	size_t min = (len < e->path_length) ? len : e->path_length;
+	int cmp = memcmp(idx->strings + e->path_offset, path, min);
+
+	if (cmp != 0) {
+		return cmp;
+	}
+
+	return (e->path_length > len) - (e->path_length < len);
+}
+
+int library_index_lookup(struct library_index* idx, const char* path,
+	const struct stat* sb, struct track* t)
+{
+	size_t lo = 0;
+	size_t hi = idx->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct index_entry* e = &idx->entries[mid];
+		int cmp = entry_compare(idx, e, path);
+
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else if (cmp > 0) {
+			hi = mid;
+		} else {
+			track_set_file_info(t, sb);
+
+			if (e->size != t->size || e->mtime != t->mtime) {
+				return -1; // file changed, probe it again
+			}
+
+			t->data_offset = e->data_offset;
+			t->data_size = e->data_size;
+			t->sample_rate = e->sample_rate;
+			t->byte_rate = e->byte_rate;
+			t->channels = e->channels;
+			t->bits_per_sample = e->bits_per_sample;
+			t->audio_format = e->audio_format;
+			t->duration = e->duration;
+			atomic_store_explicit(&t->loudness_ready, (e->flags & INDEX_LOUDNESS) != 0,
+				memory_order_relaxed);
+			t->loudness = e->loudness;
+			t->true_peak = e->true_peak;
+
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static int compare_tracks_by_path(const void* a, const void* b) {
+	const struct track* ta = *(const struct track* const*) a;
+	const struct track* tb = *(const struct track* const*) b;
+
+	return strcmp(ta->path, tb->path);
+}
+
+int library_index_save(struct library_index* idx, const struct playlist* pl) {
+	if (idx->path[0] == '\0') {
+		return -1;
+	}
+
+	// every track came from the index and nothing was removed
+	if (idx->map && idx->hits == pl->len && idx->count == pl->len) {
+		return 0;
+	}
+
+	const struct track** sorted = malloc(pl->len * sizeof(*sorted) + 1);
+
+	if (!sorted) {
+		perror("malloc");
+		return -1;
+	}
+
+	struct index_header hdr;
+	memcpy(hdr.magic, INDEX_MAGIC, 4);
+	hdr.version = INDEX_VERSION;
+	hdr.count = pl->len;
+	hdr.strings_size = 0;
+
+	for (size_t i = 0; i < pl->len; i++) {
+		sorted[i] = &pl->items[i];
+		hdr.strings_size += strlen(pl->items[i].path) + 1;
+	}
+
+	qsort(sorted, pl->len, sizeof(*sorted), compare_tracks_by_path);
+
+	char tmp[PATH_MAX_LENGTH + 8];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", idx->path);
+
+	FILE* f = fopen(tmp, "wb");
+
+	if (!f) {
+		free(sorted);
+		return -1;
+	}
+
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	uint32_t offset = 0;
+
+	for (size_t i = 0; i < pl->len; i++) {
+		const struct track* t = sorted[i];
+		struct index_entry e = {0};
+
+		e.path_offset = offset;
+		e.path_length = strlen(t->path);
+		e.size = t->size;
+		e.mtime = t->mtime;
+		e.data_offset = t->data_offset;
+		e.data_size = t->data_size;
+		e.sample_rate = t->sample_rate;
+		e.byte_rate = t->byte_rate;
+		e.channels = t->channels;
+		e.bits_per_sample = t->bits_per_sample;
+		e.audio_format = t->audio_format;
+		e.duration = t->duration;
+
+		if (atomic_load_explicit(&t->loudness_ready, memory_order_acquire)) {
+			e.flags |= INDEX_LOUDNESS;
+			e.loudness = t->loudness;
+			e.true_peak = t->true_peak;
+		}
+
+		fwrite(&e, sizeof(e), 1, f);
+		offset += e.path_length + 1;
+	}
+
+	for (size_t i = 0; i < pl->len; i++) {
+		fwrite(sorted[i]->path, strlen(sorted[i]->path) + 1, 1, f);
+	}
+
+	free(sorted);
+
+	int failed = ferror(f);
+
+	if (fclose(f) != 0 || failed) {
+		unlink(tmp);
+		return -1;
+	}
+
+	// readers either see the old index or the new one, never half of it
+	if (rename(tmp, idx->path) < 0) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
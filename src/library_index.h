@@ -0,0 +1,30 @@
+/*
+persistent library index
+
+create_playlist used to open every .wav and run get_wav_information just
+to get its duration. the index keeps, for every track of a directory,
+its size, mtime and header fields. an entry is trusted while size and
+mtime match the stat list_wavs already did, so a warm start parses no
+header at all. the loudness analysis of a track (loudness.h) is kept
+the same way, so it only runs once per file
+*/
+
+#ifndef LIBRARY_INDEX_H
+#define LIBRARY_INDEX_H
+
+#include "types.h"
+#include <sys/stat.h>
+
+int library_index_open(struct library_index* idx, const char* dir, int recursive);
+void library_index_close(struct library_index* idx);
+
+// fills t from the index if its entry still matches sb, returns 0 on hit
+int library_index_lookup(struct library_index* idx, const char* path,
+	const struct stat* sb, struct track* t);
+
+// rewrites the index file with the tracks of pl
+int library_index_save(struct library_index* idx, const struct playlist* pl);
+
+void track_set_file_info(struct track* t, const struct stat* sb);
+
+#endif
@@ -0,0 +1,222 @@
+#include "limiter.h"
+#include "convert.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// the knee goes from KNEE_LOW (no reduction) to KNEE_HIGH (the ceiling)
+#define KNEE_LOW (LIMITER_CEILING - LIMITER_KNEE / 2)
+#define KNEE_HIGH (LIMITER_CEILING + LIMITER_KNEE / 2)
+
+int limiter_setup(struct limiter* lim, size_t channels, uint32_t sample_rate) {
+	if (channels > lim->gain_channels) {
+		float* gain = realloc(lim->gain, LIMITER_BLOCK * channels * sizeof(float));
+
+		if (!gain) {
+			perror("realloc");
+			return -1;
+		}
+
+		lim->gain = gain;
+		lim->gain_channels = channels;
+	}
+
+	if (channels != lim->channels) {
+		limiter_reset(lim);
+	}
+
+	lim->channels = channels;
+	lim->release = expf(-1000.0f / ((float) LIMITER_RELEASE_MS * sample_rate));
+	lim->scale = scale_select();
+	lim->scale_steady = convert_gain_select(WAV_FORMAT_PCM, 32);
+	lim->peak = peak_select();
+
+	return 0;
+}
+
+void limiter_free(struct limiter* lim) {
+	free(lim->gain);
+	lim->gain = NULL;
+	lim->gain_channels = 0;
+	lim->channels = 0;
+}
+
+void limiter_reset(struct limiter* lim) {
+	lim->level = -1.0f;
+	lim->target = -1.0f;
+	lim->ramp_left = 0;
+	lim->envelope = 1.0f;
+}
+
+void limiter_set_gain(struct limiter* lim, float gain) {
+	if (lim->level < 0.0f) {
+		lim->level = gain;
+		lim->target = gain;
+		return;
+	}
+
+	if (gain == lim->target) {
+		return;
+	}
+
+	// from wherever the last ramp got to
+	lim->target = gain;
+	lim->ramp_left = LIMITER_RAMP_FRAMES;
+	lim->step = (gain - lim->level) / LIMITER_RAMP_FRAMES;
+}
+
+int limiter_engaged(const struct limiter* lim) {
+	return lim->ramp_left > 0 || lim->envelope < 1.0f || lim->level > 1.0f;
+}
+
+/*
+the ramp as of the start of a block, copied out of the limiter: stores
+into lim->gain could alias its floats, the loops would load them again
+for every sample. it's scaled by the headroom the frames were converted
+with
+*/
+struct ramp {
+	float level;
+	float step;
+	float target;
+	size_t left;
+};
+
+static inline struct ramp ramp_of(const struct limiter* lim, float headroom) {
+	return (struct ramp) {
+		lim->level * headroom, lim->step * headroom, lim->target * headroom, lim->ramp_left
+	};
+}
+
+// gain of the k-th frame from now on (k >= 1)
+static inline float ramp_at(struct ramp r, size_t k) {
+	return (k >= r.left) ? r.target : r.level + r.step * k;
+}
+
+static void ramp_advance(struct limiter* lim, size_t frames) {
+	if (frames >= lim->ramp_left) {
+		lim->level = lim->target;
+		lim->ramp_left = 0;
+	} else {
+		lim->level += lim->step * frames;
+		lim->ramp_left -= frames;
+	}
+}
+
+/*
+reduction that brings a frame peaking at peak (1.0 is full scale) under
+the ceiling: none under the knee, a quadratic curve through it (the
+output keeps rising, slower and slower), then the ceiling itself
+*/
+static inline float knee(float peak) {
+	if (peak <= KNEE_LOW) {
+		return 1.0f;
+	}
+
+	if (peak < KNEE_HIGH) {
+		float over = peak - KNEE_LOW;
+		return (peak - over * over / (2 * LIMITER_KNEE)) / peak;
+	}
+
+	return LIMITER_CEILING / peak;
+}
+
+static inline uint32_t frame_peak(const int32_t* frame, size_t channels) {
+	uint32_t peak = 0;
+
+	for (size_t c = 0; c < channels; c++) {
+		uint32_t v = (frame[c] < 0) ? -(uint32_t) frame[c] : (uint32_t) frame[c];
+		peak = (v > peak) ? v : peak;
+	}
+
+	return peak;
+}
+
+// the block only needs the ramp
+static void fill_ramp(float* gain, struct ramp r, size_t frames, size_t channels) {
+	for (size_t i = 0; i < frames; i++) {
+		float g = ramp_at(r, i + 1);
+
+		for (size_t c = 0; c < channels; c++) {
+			gain[i * channels + c] = g;
+		}
+	}
+}
+
+/*
+per block: the peak of every frame, up to LIMITER_LOOKAHEAD frames past
+the block. when none of them reaches the knee at the highest gain of the
+ramp (and nothing is being released) the block only gets the ramp.
+else each frame gets the reduction it needs at its own gain; walking it
+backwards the reduction can't rise by more than 1 / LIMITER_LOOKAHEAD
+per frame, so a peak is prepared for by a linear ramp before it (its
+frame still gets all it needs). walking forwards the envelope follows it
+down at once and goes back up with the release. the per sample gains go
+through the simd scale kernel
+*/
+void limiter_process(struct limiter* lim, int32_t* buf, size_t frames,
+	const int32_t* ahead, size_t ahead_frames, float headroom)
+{
+	size_t channels = lim->channels;
+	float* reduction = lim->reduction;
+	float* gain = lim->gain;
+
+	for (size_t done = 0; done < frames;) {
+		struct ramp r = ramp_of(lim, headroom);
+		size_t n = (frames - done < LIMITER_BLOCK) ? frames - done : LIMITER_BLOCK;
+		size_t span = frames - done + ahead_frames;
+
+		span = (span < n + LIMITER_LOOKAHEAD) ? span : n + LIMITER_LOOKAHEAD;
+
+		size_t in_buf = (frames - done < span) ? frames - done : span;
+		float max = lim->peak(buf + done * channels, in_buf * channels);
+		float max_ahead = lim->peak(ahead, (span - in_buf) * channels);
+		float highest = (r.level > r.target) ? r.level : r.target;
+
+		max = (max_ahead > max) ? max_ahead : max;
+
+		if (lim->envelope == 1.0f && max * highest / 2147483648.0f <= KNEE_LOW) {
+			if (r.left == 0) { // nothing to limit at a steady gain, a single pass
+				lim->scale_steady(buf + done * channels, (const uint8_t*) (buf + done * channels),
+					n * channels, r.target);
+				done += n;
+				continue;
+			}
+
+			fill_ramp(gain, r, n, channels);
+		} else {
+			for (size_t i = 0; i < span; i++) {
+				const int32_t* frame = (i < in_buf)
+					? buf + (done + i) * channels : ahead + (done + i - frames) * channels;
+
+				reduction[i] = knee(frame_peak(frame, channels) * ramp_at(r, i + 1) / 2147483648.0f);
+			}
+
+			for (size_t i = span - 1; i > 0; i--) {
+				float rise = reduction[i] + 1.0f / LIMITER_LOOKAHEAD;
+				reduction[i - 1] = (reduction[i - 1] < rise) ? reduction[i - 1] : rise;
+			}
+
+			float envelope = lim->envelope;
+			float release = lim->release;
+
+			for (size_t i = 0; i < n; i++) {
+				envelope = 1.0f - (1.0f - envelope) * release;
+				envelope = (envelope < reduction[i]) ? envelope : reduction[i];
+
+				float g = ramp_at(r, i + 1) * envelope;
+
+				for (size_t c = 0; c < channels; c++) {
+					gain[i * channels + c] = g;
+				}
+			}
+
+			// close enough to no reduction, the fused kernels can take over again
+			lim->envelope = (envelope > 0.9999f) ? 1.0f : envelope;
+		}
+
+		lim->scale(buf + done * channels, gain, n * channels);
+		ramp_advance(lim, n);
+		done += n;
+	}
+}
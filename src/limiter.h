@@ -0,0 +1,44 @@
+/*
+gain and limiting of the s32 frames
+
+the player's gain (volume times the loudness gain of the track) is
+applied per frame, and a change of it is ramped over LIMITER_RAMP_FRAMES
+instead of jumping, so pressing w or s doesn't zipper. above unity the
+frames can go past full scale: instead of saturating them the limiter
+brings each frame under LIMITER_CEILING with a soft knee. it looks
+LIMITER_LOOKAHEAD frames ahead (the frames still in the ring, so there's
+no added latency), the reduction ramps down before a peak and is
+released over LIMITER_RELEASE_MS after it.
+while the gain is steady at or under unity and nothing is being reduced
+the fused convert kernels do everything and the limiter costs nothing
+*/
+
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#include "types.h"
+
+// -1 when gain can't be allocated, the limiter is reset when channels change
+int limiter_setup(struct limiter* lim, size_t channels, uint32_t sample_rate);
+void limiter_free(struct limiter* lim);
+
+// the next gain is applied as it is, not ramped to
+void limiter_reset(struct limiter* lim);
+
+// gain the frames go to from now on, over a ramp when it changes
+void limiter_set_gain(struct limiter* lim, float gain);
+
+// 1 when the frames have to go through limiter_process
+int limiter_engaged(const struct limiter* lim);
+
+/*
+buf holds frames converted at 1 / headroom gain, ahead the ahead_frames
+that come after them (fewer than LIMITER_LOOKAHEAD at the end of a
+track). headroom is 1 for integer pcm, a float source is converted
+further down so its samples past full scale aren't clipped before the
+knee sees them
+*/
+void limiter_process(struct limiter* lim, int32_t* buf, size_t frames,
+	const int32_t* ahead, size_t ahead_frames, float headroom);
+
+#endif
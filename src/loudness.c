@@ -0,0 +1,673 @@
+#define _GNU_SOURCE // SCHED_IDLE
+#include "loudness.h"
+#include "fd_handle.h"
+#include "library_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LOUDNESS_X86 1
+#include <immintrin.h>
+#endif
+
+// ioprio_set(2) has no glibc wrapper nor header
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+#define S32_SCALE 2147483648.0f
+
+/*
+the 4x oversampling interpolator of bs.1770-4 annex 2: 48 taps split in
+4 phases of 12. phase p gives the sample p/4 of a period after the input
+*/
+static const float true_peak_coefs[4][TRUE_PEAK_TAPS] = {
+	{ 0.0017089843750f, 0.0109863281250f, -0.0196533203125f, 0.0332031250000f,
+	-0.0594482421875f, 0.1373291015625f, 0.9721679687500f, -0.1022949218750f,
+	0.0476074218750f, -0.0266113281250f, 0.0148925781250f, -0.0083007812500f },
+	{ -0.0291748046875f, 0.0292968750000f, -0.0517578125000f, 0.0891113281250f,
+	-0.1665039062500f, 0.4650878906250f, 0.7797851562500f, -0.2003173828125f,
+	0.1015625000000f, -0.0582275390625f, 0.0330810546875f, -0.0189208984375f },
+	{ -0.0189208984375f, 0.0330810546875f, -0.0582275390625f, 0.1015625000000f,
+	-0.2003173828125f, 0.7797851562500f, 0.4650878906250f, -0.1665039062500f,
+	0.0891113281250f, -0.0517578125000f, 0.0292968750000f, -0.0291748046875f },
+	{ -0.0083007812500f, 0.0148925781250f, -0.0266113281250f, 0.0476074218750f,
+	-0.1022949218750f, 0.9721679687500f, 0.1373291015625f, -0.0594482421875f,
+	0.0332031250000f, -0.0196533203125f, 0.0109863281250f, 0.0017089843750f },
+};
+
+/*	--- K-WEIGHTING --- */
+
+/*
+the two filters of bs.1770 for any rate (the standard only lists 48 kHz
+coefficients): a +4 dB shelf above about 1.5 kHz for the head, then a
+high pass at 38 Hz. same analog prototypes as libebur128, bilinear
+transform at sample_rate
+*/
+void kweight_init(struct kweight* kw, uint32_t sample_rate, size_t channels) {
+	memset(kw, 0, sizeof(*kw));
+	kw->channels = channels;
+
+	double f0 = 1681.974450955533;
+	double gain_db = 3.999843853973347;
+	double q = 0.7071752369554196;
+	double k = tan(M_PI * f0 / sample_rate);
+	double vh = pow(10.0, gain_db / 20.0);
+	double vb = pow(vh, 0.4996667741545416);
+	double a0 = 1.0 + k / q + k * k;
+
+	kw->b[0][0] = (vh + vb * k / q + k * k) / a0;
+	kw->b[0][1] = 2.0 * (k * k - vh) / a0;
+	kw->b[0][2] = (vh - vb * k / q + k * k) / a0;
+	kw->a[0][0] = 1.0;
+	kw->a[0][1] = 2.0 * (k * k - 1.0) / a0;
+	kw->a[0][2] = (1.0 - k / q + k * k) / a0;
+
+	f0 = 38.13547087602444;
+	q = 0.5003270373238773;
+	k = tan(M_PI * f0 / sample_rate);
+	a0 = 1.0 + k / q + k * k;
+
+	kw->b[1][0] = 1.0;
+	kw->b[1][1] = -2.0;
+	kw->b[1][2] = 1.0;
+	kw->a[1][0] = 1.0;
+	kw->a[1][1] = 2.0 * (k * k - 1.0) / a0;
+	kw->a[1][2] = (1.0 - k / q + k * k) / a0;
+}
+
+// both biquads on one channel, returns the energy of what comes out
+static double kweight_channel(struct kweight* kw, size_t c, const float* x, size_t n) {
+	const double (*b)[3] = kw->b;
+	const double (*a)[3] = kw->a;
+	double s1 = kw->s1[0][c], s2 = kw->s2[0][c];
+	double t1 = kw->s1[1][c], t2 = kw->s2[1][c];
+	double sum = 0.0;
+
+	for (size_t i = 0; i < n; i++) {
+		double in = x[i];
+		double y = b[0][0] * in + s1;
+		s1 = b[0][1] * in - a[0][1] * y + s2;
+		s2 = b[0][2] * in - a[0][2] * y;
+
+		double z = b[1][0] * y + t1;
+		t1 = b[1][1] * y - a[1][1] * z + t2;
+		t2 = b[1][2] * y - a[1][2] * z;
+
+		sum += z * z;
+	}
+
+	kw->s1[0][c] = s1;
+	kw->s2[0][c] = s2;
+	kw->s1[1][c] = t1;
+	kw->s2[1][c] = t2;
+
+	return sum;
+}
+
+static void kweight_scalar(struct kweight* kw, const float* const* x, size_t n, double* energy) {
+	for (size_t c = 0; c < kw->channels; c++) {
+		energy[c] += kweight_channel(kw, c, x[c], n);
+	}
+}
+
+#ifdef LOUDNESS_X86
+/*
+an iir can't be vectorized along time, so two channels go through the
+filters side by side, one per double lane. an odd channel left over
+takes the scalar path
+*/
+__attribute__((target("sse2")))
+static void kweight_sse2(struct kweight* kw, const float* const* x, size_t n, double* energy) {
+	__m128d b00 = _mm_set1_pd(kw->b[0][0]), b01 = _mm_set1_pd(kw->b[0][1]);
+	__m128d b02 = _mm_set1_pd(kw->b[0][2]), a01 = _mm_set1_pd(kw->a[0][1]);
+	__m128d a02 = _mm_set1_pd(kw->a[0][2]), b10 = _mm_set1_pd(kw->b[1][0]);
+	__m128d b11 = _mm_set1_pd(kw->b[1][1]), b12 = _mm_set1_pd(kw->b[1][2]);
+	__m128d a11 = _mm_set1_pd(kw->a[1][1]), a12 = _mm_set1_pd(kw->a[1][2]);
+	size_t c = 0;
+
+	for (; c + 2 <= kw->channels; c += 2) {
+		const float* x0 = x[c];
+		const float* x1 = x[c + 1];
+		__m128d s1 = _mm_loadu_pd(&kw->s1[0][c]), s2 = _mm_loadu_pd(&kw->s2[0][c]);
+		__m128d t1 = _mm_loadu_pd(&kw->s1[1][c]), t2 = _mm_loadu_pd(&kw->s2[1][c]);
+		__m128d sum = _mm_setzero_pd();
+
+		for (size_t i = 0; i < n; i++) {
+			__m128d in = _mm_set_pd(x1[i], x0[i]);
+			__m128d y = _mm_add_pd(_mm_mul_pd(b00, in), s1);
+			s1 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b01, in), _mm_mul_pd(a01, y)), s2);
+			s2 = _mm_sub_pd(_mm_mul_pd(b02, in), _mm_mul_pd(a02, y));
+
+			__m128d z = _mm_add_pd(_mm_mul_pd(b10, y), t1);
+			t1 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b11, y), _mm_mul_pd(a11, z)), t2);
+			t2 = _mm_sub_pd(_mm_mul_pd(b12, y), _mm_mul_pd(a12, z));
+
+			sum = _mm_add_pd(sum, _mm_mul_pd(z, z));
+		}
+
+		_mm_storeu_pd(&kw->s1[0][c], s1);
+		_mm_storeu_pd(&kw->s2[0][c], s2);
+		_mm_storeu_pd(&kw->s1[1][c], t1);
+		_mm_storeu_pd(&kw->s2[1][c], t2);
+
+		double lanes[2];
+		_mm_storeu_pd(lanes, sum);
+		energy[c] += lanes[0];
+		energy[c + 1] += lanes[1];
+	}
+
+	if (c < kw->channels) {
+		energy[c] += kweight_channel(kw, c, x[c], n);
+	}
+}
+#endif
+
+kweight_fn kweight_kernel_for(enum cpu_isa isa) {
+#ifdef LOUDNESS_X86
+	if (isa == ISA_AVX2 || isa == ISA_SSE2) {
+		return kweight_sse2;
+	}
+#else
+	(void) isa;
+#endif
+
+	return kweight_scalar;
+}
+
+/*	--- TRUE PEAK --- */
+
+/*
+x holds TRUE_PEAK_TAPS - 1 samples of history and then n new ones.
+returns the largest magnitude of the 4n interpolated samples
+*/
+static float true_peak_scalar(const float* x, size_t n) {
+	float peak = 0.0f;
+
+	for (size_t i = 0; i < n; i++) {
+		for (int p = 0; p < 4; p++) {
+			float acc = 0.0f;
+
+			for (int k = 0; k < TRUE_PEAK_TAPS; k++) {
+				acc += true_peak_coefs[p][k] * x[i + TRUE_PEAK_TAPS - 1 - k];
+			}
+
+			peak = fmaxf(peak, fabsf(acc));
+		}
+	}
+
+	return peak;
+}
+
+#ifdef LOUDNESS_X86
+// 4 outputs of every phase at once, each tap loaded once for the 4 phases
+__attribute__((target("sse2")))
+static float true_peak_sse2(const float* x, size_t n) {
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	__m128 peak = _mm_setzero_ps();
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+		__m128 acc2 = _mm_setzero_ps(), acc3 = _mm_setzero_ps();
+
+		for (int k = 0; k < TRUE_PEAK_TAPS; k++) {
+			__m128 v = _mm_loadu_ps(x + i + TRUE_PEAK_TAPS - 1 - k);
+			acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_set1_ps(true_peak_coefs[0][k]), v));
+			acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_set1_ps(true_peak_coefs[1][k]), v));
+			acc2 = _mm_add_ps(acc2, _mm_mul_ps(_mm_set1_ps(true_peak_coefs[2][k]), v));
+			acc3 = _mm_add_ps(acc3, _mm_mul_ps(_mm_set1_ps(true_peak_coefs[3][k]), v));
+		}
+
+		peak = _mm_max_ps(peak, _mm_andnot_ps(sign, acc0));
+		peak = _mm_max_ps(peak, _mm_andnot_ps(sign, acc1));
+		peak = _mm_max_ps(peak, _mm_andnot_ps(sign, acc2));
+		peak = _mm_max_ps(peak, _mm_andnot_ps(sign, acc3));
+	}
+
+	peak = _mm_max_ps(peak, _mm_movehl_ps(peak, peak));
+	peak = _mm_max_ss(peak, _mm_shuffle_ps(peak, peak, 1));
+
+	return fmaxf(_mm_cvtss_f32(peak), true_peak_scalar(x + i, n - i));
+}
+
+__attribute__((target("avx2,fma")))
+static float true_peak_avx2(const float* x, size_t n) {
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	__m256 peak = _mm256_setzero_ps();
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+		__m256 acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+
+		for (int k = 0; k < TRUE_PEAK_TAPS; k++) {
+			__m256 v = _mm256_loadu_ps(x + i + TRUE_PEAK_TAPS - 1 - k);
+			acc0 = _mm256_fmadd_ps(_mm256_set1_ps(true_peak_coefs[0][k]), v, acc0);
+			acc1 = _mm256_fmadd_ps(_mm256_set1_ps(true_peak_coefs[1][k]), v, acc1);
+			acc2 = _mm256_fmadd_ps(_mm256_set1_ps(true_peak_coefs[2][k]), v, acc2);
+			acc3 = _mm256_fmadd_ps(_mm256_set1_ps(true_peak_coefs[3][k]), v, acc3);
+		}
+
+		peak = _mm256_max_ps(peak, _mm256_andnot_ps(sign, acc0));
+		peak = _mm256_max_ps(peak, _mm256_andnot_ps(sign, acc1));
+		peak = _mm256_max_ps(peak, _mm256_andnot_ps(sign, acc2));
+		peak = _mm256_max_ps(peak, _mm256_andnot_ps(sign, acc3));
+	}
+
+	__m128 half = _mm_max_ps(_mm256_castps256_ps128(peak), _mm256_extractf128_ps(peak, 1));
+	half = _mm_max_ps(half, _mm_movehl_ps(half, half));
+	half = _mm_max_ss(half, _mm_shuffle_ps(half, half, 1));
+
+	return fmaxf(_mm_cvtss_f32(half), true_peak_scalar(x + i, n - i));
+}
+#endif
+
+true_peak_fn true_peak_kernel_for(enum cpu_isa isa) {
+#ifdef LOUDNESS_X86
+	if (isa == ISA_AVX2 && __builtin_cpu_supports("fma")) {
+		return true_peak_avx2;
+	}
+
+	if (isa == ISA_AVX2 || isa == ISA_SSE2) {
+		return true_peak_sse2;
+	}
+#else
+	(void) isa;
+#endif
+
+	return true_peak_scalar;
+}
+
+/*	--- MEASURE --- */
+
+// bs.1770 channel weights: surrounds count 1.41 (+1.5 dB), the lfe not at all
+static double channel_weight(size_t channels, size_t c) {
+	if (channels == 6) { // L R C LFE Ls Rs
+		return (c == 3) ? 0.0 : (c >= 4) ? 1.41 : 1.0;
+	}
+
+	if (channels == 5) { // L R C Ls Rs
+		return (c >= 3) ? 1.41 : 1.0;
+	}
+
+	return 1.0;
+}
+
+struct measure {
+	struct kweight kw;
+	kweight_fn kweight;
+	true_peak_fn true_peak;
+	size_t channels;
+	size_t step; // frames in 100 ms
+	size_t step_fill;
+	double step_energy;
+	double steps[4]; // the last 4 steps, a 400 ms block
+	size_t nsteps;
+	double* blocks; // mean square of every block
+	size_t nblocks;
+	size_t cap;
+	float peak;
+};
+
+static int measure_push_block(struct measure* m, double z) {
+	if (m->nblocks == m->cap) {
+		size_t cap = m->cap ? m->cap * 2 : 1024;
+		double* blocks = realloc(m->blocks, cap * sizeof(*blocks));
+
+		if (!blocks) {
+			perror("realloc");
+			return -1;
+		}
+
+		m->blocks = blocks;
+		m->cap = cap;
+	}
+
+	m->blocks[m->nblocks++] = z;
+
+	return 0;
+}
+
+// x[c] + TRUE_PEAK_TAPS - 1 are n new frames, planar
+static int measure_frames(struct measure* m, float* const* x, size_t n) {
+	double energy[LOUDNESS_MAX_CHANNELS];
+	const float* at[LOUDNESS_MAX_CHANNELS];
+
+	for (size_t c = 0; c < m->channels; c++) {
+		m->peak = fmaxf(m->peak, m->true_peak(x[c], n));
+	}
+
+	// cut at every 100 ms step, 4 steps make a block and blocks overlap by 3
+	for (size_t done = 0; done < n;) {
+		size_t len = m->step - m->step_fill;
+		len = (len < n - done) ? len : n - done;
+
+		for (size_t c = 0; c < m->channels; c++) {
+			energy[c] = 0.0;
+			at[c] = x[c] + TRUE_PEAK_TAPS - 1 + done;
+		}
+
+		m->kweight(&m->kw, at, len, energy);
+
+		for (size_t c = 0; c < m->channels; c++) {
+			m->step_energy += channel_weight(m->channels, c) * energy[c];
+		}
+
+		m->step_fill += len;
+		done += len;
+
+		if (m->step_fill < m->step) {
+			continue;
+		}
+
+		m->steps[m->nsteps++ % 4] = m->step_energy;
+		m->step_energy = 0.0;
+		m->step_fill = 0;
+
+		if (m->nsteps >= 4) {
+			double z = (m->steps[0] + m->steps[1] + m->steps[2] + m->steps[3]) / (4.0 * m->step);
+
+			if (measure_push_block(m, z) < 0) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static double block_loudness(double z) {
+	return -0.691 + 10.0 * log10(z);
+}
+
+// mean square of the blocks above threshold, 0 if none
+static double gated_mean(const struct measure* m, double threshold) {
+	double sum = 0.0;
+	size_t count = 0;
+
+	for (size_t i = 0; i < m->nblocks; i++) {
+		if (m->blocks[i] > threshold) {
+			sum += m->blocks[i];
+			count++;
+		}
+	}
+
+	return count ? sum / count : 0.0;
+}
+
+static float measure_integrated(const struct measure* m) {
+	// -70 LUFS as a mean square, then 10 LU (a factor 10) under what passed
+	double absolute = pow(10.0, (-70.0 + 0.691) / 10.0);
+	double mean = gated_mean(m, absolute);
+
+	if (mean == 0.0) {
+		return -INFINITY; // silence, or shorter than a block
+	}
+
+	double relative = mean / 10.0;
+	mean = gated_mean(m, (relative > absolute) ? relative : absolute);
+
+	return (float) block_loudness(mean);
+}
+
+int loudness_measure(const char* path, float* loudness, float* true_peak, const _Atomic int* stop) {
+	struct wav_information wav = {0};
+	struct stream_format fmt;
+	struct measure m = {0};
+	int fd = get_wav_information(path, &wav);
+
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (wav.channels == 0 || wav.channels > LOUDNESS_MAX_CHANNELS || wav.sample_rate < 10
+		|| stream_format_init(&fmt, wav.audio_format, wav.channels, wav.bits_per_sample, wav.sample_rate) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	size_t channels = wav.channels;
+	size_t planar_len = LOUDNESS_CHUNK_FRAMES + TRUE_PEAK_TAPS - 1;
+	uint8_t* raw = malloc((size_t) LOUDNESS_CHUNK_FRAMES * fmt.frame_size);
+	int32_t* s32 = malloc((size_t) LOUDNESS_CHUNK_FRAMES * channels * sizeof(int32_t));
+	float* planar = calloc(planar_len * channels, sizeof(float));
+	float* x[LOUDNESS_MAX_CHANNELS];
+	int ret = -1;
+
+	if (!raw || !s32 || !planar) {
+		perror("malloc");
+		goto done;
+	}
+
+	enum cpu_isa isa = cpu_detect_isa();
+	kweight_init(&m.kw, wav.sample_rate, channels);
+	m.kweight = kweight_kernel_for(isa);
+	m.true_peak = true_peak_kernel_for(isa);
+	m.channels = channels;
+	m.step = (wav.sample_rate + 5) / 10;
+
+	for (size_t c = 0; c < channels; c++) {
+		x[c] = planar + c * planar_len;
+	}
+
+	uint64_t offset = wav.data_offset;
+	uint64_t left = wav.data_size - wav.data_size % fmt.frame_size;
+
+	// read once from start to end, and not kept in the page cache afterwards
+	posix_fadvise(fd, offset, left, POSIX_FADV_SEQUENTIAL);
+
+	while (left > 0) {
+		// a long file at idle priority mustn't hold up quitting
+		if (stop && atomic_load_explicit(stop, memory_order_relaxed)) {
+			goto done;
+		}
+
+		size_t want = (size_t) LOUDNESS_CHUNK_FRAMES * fmt.frame_size;
+		want = (want < left) ? want : left;
+
+		ssize_t got = pread(fd, raw, want, offset);
+
+		if (got < 0) {
+			perror("pread");
+			goto done;
+		}
+
+		size_t frames = got / fmt.frame_size;
+
+		if (frames == 0) {
+			break; // the file is shorter than its data chunk says
+		}
+
+		fmt.convert(s32, raw, frames * channels);
+
+		for (size_t c = 0; c < channels; c++) {
+			float* dst = x[c] + TRUE_PEAK_TAPS - 1;
+
+			for (size_t i = 0; i < frames; i++) {
+				dst[i] = s32[i * channels + c] / S32_SCALE;
+			}
+		}
+
+		if (measure_frames(&m, x, frames) < 0) {
+			goto done;
+		}
+
+		// the interpolator's history for the next chunk
+		for (size_t c = 0; c < channels; c++) {
+			memmove(x[c], x[c] + frames, (TRUE_PEAK_TAPS - 1) * sizeof(float));
+		}
+
+		posix_fadvise(fd, offset, frames * fmt.frame_size, POSIX_FADV_DONTNEED);
+		offset += frames * fmt.frame_size;
+		left -= frames * fmt.frame_size;
+	}
+
+	*loudness = measure_integrated(&m);
+	*true_peak = (m.peak > 0.0f) ? 20.0f * log10f(m.peak) : -INFINITY;
+	ret = 0;
+
+	done:
+		free(raw);
+		free(s32);
+		free(planar);
+		free(m.blocks);
+		close(fd);
+		return ret;
+}
+
+float loudness_gain(const struct track* t) {
+	if (!atomic_load_explicit(&t->loudness_ready, memory_order_acquire)
+		|| !isfinite(t->loudness))
+	{
+		return 1.0f;
+	}
+
+	float db = LOUDNESS_TARGET - t->loudness;
+
+	// a quiet track with loud peaks is only raised until they reach the ceiling
+	if (isfinite(t->true_peak) && t->true_peak + db > LOUDNESS_CEILING) {
+		db = LOUDNESS_CEILING - t->true_peak;
+	}
+
+	return powf(10.0f, db / 20.0f);
+}
+
+/*	--- BACKGROUND POOL --- */
+
+// only runs when a cpu and the disk have nothing else to do
+static void lower_priority(void) {
+	struct sched_param param = {0};
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+	// who = 0 is the calling thread
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+
+#ifdef LOUDNESS_X86
+	// the filters ring down to denormals in silence, flush them to zero (ftz, daz)
+	_mm_setcsr(_mm_getcsr() | 0x8040);
+#endif
+}
+
+static void* loudness_worker_main(void* arg) {
+	struct loudness_pool* pool = (struct loudness_pool*) arg;
+	size_t i;
+
+	lower_priority();
+
+	while (!atomic_load(&pool->stop)
+		&& (i = atomic_fetch_add(&pool->next, 1)) < pool->todo_len)
+	{
+		struct track* t = &pool->playlist->items[pool->todo[i]];
+		float loudness, true_peak;
+
+		if (loudness_measure(t->path, &loudness, &true_peak, &pool->stop) < 0) {
+			continue; // tried again at the next start
+		}
+
+		t->loudness = loudness;
+		t->true_peak = true_peak;
+		atomic_store_explicit(&t->loudness_ready, 1, memory_order_release);
+		atomic_fetch_add(&pool->done, 1);
+	}
+
+	// the last one out saves the index, nobody else writes the playlist anymore
+	if (atomic_fetch_sub(&pool->running, 1) == 1 && !atomic_load(&pool->stop)
+		&& atomic_load(&pool->done) > 0)
+	{
+		library_index_save(pool->library, pool->playlist);
+		pool->saved = 1;
+	}
+
+	return NULL;
+}
+
+int loudness_start(struct loudness_pool* pool, struct playlist* pl,
+	struct library_index* idx, int threads)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->playlist = pl;
+	pool->library = idx;
+	atomic_init(&pool->next, 0);
+	atomic_init(&pool->done, 0);
+	atomic_init(&pool->running, 0);
+	atomic_init(&pool->stop, 0);
+
+	pool->todo = malloc((pl->len ? pl->len : 1) * sizeof(*pool->todo));
+
+	if (!pool->todo) {
+		perror("malloc");
+		return -1;
+	}
+
+	for (size_t i = 0; i < pl->len; i++) {
+		if (!atomic_load_explicit(&pl->items[i].loudness_ready, memory_order_relaxed)) {
+			pool->todo[pool->todo_len++] = i;
+		}
+	}
+
+	if (pool->todo_len == 0) {
+		return 0;
+	}
+
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	if ((size_t) threads > pool->todo_len) {
+		threads = pool->todo_len;
+	}
+
+	pool->threads = calloc(threads, sizeof(*pool->threads));
+
+	if (!pool->threads) {
+		perror("calloc");
+		return -1;
+	}
+
+	// counted before any of them can finish
+	atomic_store(&pool->running, threads);
+
+	for (int i = 0; i < threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, loudness_worker_main, pool) != 0) {
+			atomic_fetch_sub(&pool->running, threads - i);
+			break;
+		}
+
+		pool->nthreads++;
+	}
+
+	return 0;
+}
+
+void loudness_stop(struct loudness_pool* pool) {
+	atomic_store(&pool->stop, 1);
+
+	for (int i = 0; i < pool->nthreads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	if (!pool->saved && atomic_load(&pool->done) > 0) {
+		library_index_save(pool->library, pool->playlist);
+	}
+
+	free(pool->threads);
+	free(pool->todo);
+	pool->threads = NULL;
+	pool->todo = NULL;
+	pool->nthreads = 0;
+	pool->todo_len = 0;
+}
+
+size_t loudness_done(const struct loudness_pool* pool) {
+	return atomic_load((_Atomic size_t*) &pool->done);
+}
+
+size_t loudness_queued(const struct loudness_pool* pool) {
+	return pool->todo_len;
+}
@@ -0,0 +1,46 @@
+/*
+ebu r128 loudness of the library
+
+every track gets its integrated loudness (bs.1770-4: k-weighting, 400 ms
+blocks every 100 ms, an absolute gate at -70 LUFS and a relative one
+10 LU under what passed it) and its true peak (4x oversampled).
+the tracks the index doesn't know yet are analyzed after the scan by a
+pool of threads at idle cpu and io priority, so playing never waits for
+it, and the results are saved in the library index: a track is only
+analyzed again when it changes. the gain that brings a track to
+LOUDNESS_TARGET travels in its stream_format, the audio thread applies
+it with the track's own frames
+*/
+
+#ifndef LOUDNESS_H
+#define LOUDNESS_H
+
+#include "types.h"
+#include "convert.h"
+
+/*
+integrated loudness (LUFS) and true peak (dBTP) of a file, -1 if it can't
+be read or stop (can be NULL) got set before the end
+*/
+int loudness_measure(const char* path, float* loudness, float* true_peak, const _Atomic int* stop);
+
+// linear gain that normalizes t, 1.0 while it isn't analyzed
+float loudness_gain(const struct track* t);
+
+// analyzes the tracks of pl that have no loudness yet, in the background
+int loudness_start(struct loudness_pool* pool, struct playlist* pl,
+	struct library_index* idx, int threads);
+
+// stops the workers, what they found so far goes into the index
+void loudness_stop(struct loudness_pool* pool);
+
+// tracks analyzed since loudness_start and tracks it was started with
+size_t loudness_done(const struct loudness_pool* pool);
+size_t loudness_queued(const struct loudness_pool* pool);
+
+// kernels for isa (benchmarks pin one)
+void kweight_init(struct kweight* kw, uint32_t sample_rate, size_t channels);
+kweight_fn kweight_kernel_for(enum cpu_isa isa);
+true_peak_fn true_peak_kernel_for(enum cpu_isa isa);
+
+#endif
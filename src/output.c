@@ -0,0 +1,536 @@
+#include "output.h"
+#include "fd_handle.h"
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+static size_t format_bytes(snd_pcm_format_t format) {
+	switch (format) {
+		case SND_PCM_FORMAT_U8:
+			return 1;
+		case SND_PCM_FORMAT_S16_LE:
+			return 2;
+		case SND_PCM_FORMAT_S24_3LE:
+			return 3;
+		default:
+			return 4;
+	}
+}
+
+/*	--- ALSA --- */
+
+static int alsa_open(struct output* out) {
+	if (snd_pcm_open(&out->pcm, "default", SND_PCM_STREAM_PLAYBACK, 0) < 0) {
+		out->pcm = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int alsa_supports(struct output* out, snd_pcm_format_t format) {
+	snd_pcm_hw_params_t* hw;
+	snd_pcm_hw_params_alloca(&hw);
+
+	if (format == SND_PCM_FORMAT_UNKNOWN || snd_pcm_hw_params_any(out->pcm, hw) < 0) {
+		return 0;
+	}
+
+	return snd_pcm_hw_params_test_format(out->pcm, hw, format) == 0;
+}
+
+/*
+same setup snd_pcm_set_params does (500ms buffer, start once full), but
+with SND_PCM_ACCESS_MMAP_INTERLEAVED. fails on devices and plugins that
+can't be mmaped, and when the rate would need resampling
+*/
+static int alsa_configure_mmap(snd_pcm_t* pcm, snd_pcm_format_t format,
+	unsigned int channels, unsigned int rate)
+{
+	snd_pcm_hw_params_t* hw;
+	snd_pcm_sw_params_t* sw;
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_sw_params_alloca(&sw);
+
+	unsigned int actual_rate = rate;
+	unsigned int buffer_time = OUTPUT_BUFFER_US;
+	snd_pcm_uframes_t buffer_size;
+	snd_pcm_uframes_t period_size;
+
+	if (snd_pcm_hw_params_any(pcm, hw) < 0
+		|| snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0
+		|| snd_pcm_hw_params_set_format(pcm, hw, format) < 0
+		|| snd_pcm_hw_params_set_channels(pcm, hw, channels) < 0
+		|| snd_pcm_hw_params_set_rate_near(pcm, hw, &actual_rate, NULL) < 0
+		|| actual_rate != rate
+		|| snd_pcm_hw_params_set_buffer_time_near(pcm, hw, &buffer_time, NULL) < 0
+		|| snd_pcm_hw_params(pcm, hw) < 0) {
+		return -1;
+	}
+
+	if (snd_pcm_hw_params_get_buffer_size(hw, &buffer_size) < 0
+		|| snd_pcm_hw_params_get_period_size(hw, &period_size, NULL) < 0
+		|| period_size == 0) {
+		return -1;
+	}
+
+	if (snd_pcm_sw_params_current(pcm, sw) < 0
+		|| snd_pcm_sw_params_set_start_threshold(pcm, sw,
+			(buffer_size / period_size) * period_size) < 0
+		|| snd_pcm_sw_params_set_avail_min(pcm, sw, period_size) < 0
+		|| snd_pcm_sw_params(pcm, sw) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int alsa_configure(struct output* out, struct audio_device* dev,
+	snd_pcm_format_t format, unsigned int channels, unsigned int rate)
+{
+	dev->mmap = 0;
+
+	if (alsa_configure_mmap(out->pcm, format, channels, rate) == 0) {
+		dev->mmap = 1;
+	} else if (snd_pcm_set_params(out->pcm, format, SND_PCM_ACCESS_RW_INTERLEAVED,
+		channels, rate, 1, OUTPUT_BUFFER_US) < 0) {
+		return -1;
+	}
+
+	snd_pcm_hw_params_t* hw;
+	snd_pcm_hw_params_alloca(&hw);
+
+	snd_pcm_uframes_t buffer_size;
+	snd_pcm_uframes_t period_size;
+
+	dev->can_pause = snd_pcm_hw_params_current(out->pcm, hw) == 0
+		&& snd_pcm_hw_params_can_pause(hw);
+	out->buffer_frames = (snd_pcm_get_params(out->pcm, &buffer_size, &period_size) == 0)
+		? buffer_size : 0;
+	out->frame_bytes = format_bytes(format) * channels;
+	out->rate = rate;
+
+	return 0;
+}
+
+static int alsa_write(struct output* out, const void* buf, size_t frames) {
+	size_t offset = 0;
+
+	while (frames > 0) {
+		snd_pcm_sframes_t written = snd_pcm_writei(out->pcm,
+			(const uint8_t*) buf + offset * out->frame_bytes, frames);
+
+		if (written < 0) {
+			if (written == -EPIPE) {
+				stats_xrun(out->stats);
+				snd_pcm_prepare(out->pcm);
+				continue;
+			}
+
+			return -1;
+		}
+
+		frames -= written;
+		offset += written;
+	}
+
+	return 0;
+}
+
+static long alsa_delay(struct output* out) {
+	snd_pcm_sframes_t delay;
+
+	if (snd_pcm_delay(out->pcm, &delay) < 0) {
+		return 0;
+	}
+
+	return delay;
+}
+
+static long alsa_rewind(struct output* out, size_t frames) {
+	snd_pcm_sframes_t rewindable = snd_pcm_rewindable(out->pcm);
+
+	if (rewindable <= 0) {
+		return 0;
+	}
+
+	if ((size_t) rewindable < frames) {
+		frames = rewindable;
+	}
+
+	snd_pcm_sframes_t rewound = snd_pcm_rewind(out->pcm, frames);
+
+	return (rewound > 0) ? rewound : 0;
+}
+
+static void alsa_drain(struct output* out) {
+	snd_pcm_drain(out->pcm);
+	snd_pcm_prepare(out->pcm);
+}
+
+static void alsa_drop(struct output* out) {
+	snd_pcm_drop(out->pcm);
+	snd_pcm_prepare(out->pcm);
+}
+
+static void alsa_pause(struct output* out, int pause) {
+	snd_pcm_state_t state = snd_pcm_state(out->pcm);
+
+	if ((pause && state == SND_PCM_STATE_RUNNING)
+		|| (!pause && state == SND_PCM_STATE_PAUSED)) {
+		snd_pcm_pause(out->pcm, pause);
+	}
+}
+
+static void alsa_close(struct output* out) {
+	snd_pcm_close(out->pcm);
+	out->pcm = NULL;
+}
+
+static const struct output_ops alsa_ops = {
+	.name = "alsa",
+	.open = alsa_open,
+	.supports = alsa_supports,
+	.configure = alsa_configure,
+	.write = alsa_write,
+	.delay = alsa_delay,
+	.rewind = alsa_rewind,
+	.drain = alsa_drain,
+	.drop = alsa_drop,
+	.pause = alsa_pause,
+	.close = alsa_close
+};
+
+/*	--- NULL --- */
+
+static int64_t elapsed_ns(const struct timespec* from) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (int64_t) (now.tv_sec - from->tv_sec) * 1000000000
+		+ (now.tv_nsec - from->tv_nsec);
+}
+
+static void sleep_ns(int64_t ns) {
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000
+	};
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+
+	}
+}
+
+static int null_open(struct output* out) {
+	(void) out;
+	return 0;
+}
+
+static int null_supports(struct output* out, snd_pcm_format_t format) {
+	(void) out;
+	return format != SND_PCM_FORMAT_UNKNOWN;
+}
+
+static int null_configure(struct output* out, struct audio_device* dev,
+	snd_pcm_format_t format, unsigned int channels, unsigned int rate)
+{
+	out->frame_bytes = format_bytes(format) * channels;
+	out->buffer_frames = out->throttle ? (size_t) rate * OUTPUT_BUFFER_US / 1000000 : 0;
+	out->rate = rate;
+	out->frames = 0;
+	dev->mmap = 0;
+	dev->can_pause = 1;
+
+	return 0;
+}
+
+// how far the frames written are ahead of the clock, in ns
+static int64_t null_ahead_ns(struct output* out) {
+	int64_t queued = (int64_t) (out->frames * 1000000000 / out->rate);
+
+	return queued - elapsed_ns(&out->start);
+}
+
+/*
+the clock starts with the first frame. like a card with a full buffer,
+a throttled write only returns once the frames ahead of the clock fit in
+OUTPUT_BUFFER_US again. a clock that got past every frame written is an
+underrun, it starts over from this write
+*/
+static int null_write(struct output* out, const void* buf, size_t frames) {
+	(void) buf;
+
+	if (out->throttle && out->frames > 0 && null_ahead_ns(out) < 0) {
+		stats_xrun(out->stats);
+		out->frames = 0;
+	}
+
+	if (out->frames == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &out->start);
+	}
+
+	out->frames += frames;
+
+	if (!out->throttle) {
+		return 0;
+	}
+
+	int64_t wait = null_ahead_ns(out) - (int64_t) OUTPUT_BUFFER_US * 1000;
+
+	if (wait > 0) {
+		sleep_ns(wait);
+	}
+
+	return 0;
+}
+
+static long null_delay(struct output* out) {
+	if (!out->throttle || out->frames == 0) {
+		return 0;
+	}
+
+	int64_t ahead = null_ahead_ns(out);
+
+	return (ahead > 0) ? (long) (ahead * out->rate / 1000000000) : 0;
+}
+
+// only what the clock didn't reach yet can be taken back
+static long null_rewind(struct output* out, size_t frames) {
+	long delay = null_delay(out);
+
+	if ((size_t) delay < frames) {
+		frames = delay;
+	}
+
+	out->frames -= frames;
+
+	return frames;
+}
+
+static void null_drain(struct output* out) {
+	if (out->throttle && out->frames > 0) {
+		int64_t ahead = null_ahead_ns(out);
+
+		if (ahead > 0) {
+			sleep_ns(ahead);
+		}
+	}
+
+	out->frames = 0;
+}
+
+static void null_drop(struct output* out) {
+	out->frames = 0;
+}
+
+// the clock stands still while paused
+static void null_pause(struct output* out, int pause) {
+	if (out->frames == 0) {
+		return;
+	}
+
+	if (pause) {
+		clock_gettime(CLOCK_MONOTONIC, &out->paused_at);
+		return;
+	}
+
+	int64_t paused = elapsed_ns(&out->paused_at);
+	int64_t start = (int64_t) out->start.tv_sec * 1000000000 + out->start.tv_nsec + paused;
+
+	out->start.tv_sec = start / 1000000000;
+	out->start.tv_nsec = start % 1000000000;
+}
+
+static void null_close(struct output* out) {
+	out->frames = 0;
+}
+
+static const struct output_ops null_ops = {
+	.name = "null",
+	.open = null_open,
+	.supports = null_supports,
+	.configure = null_configure,
+	.write = null_write,
+	.delay = null_delay,
+	.rewind = null_rewind,
+	.drain = null_drain,
+	.drop = null_drop,
+	.pause = null_pause,
+	.close = null_close
+};
+
+/*	--- WAV FILE --- */
+
+// the sizes are written once the file is done
+static void wav_sink_header(const struct output* out, uint8_t* hdr) {
+	uint64_t data = out->frames * out->frame_bytes;
+	uint16_t bits = (out->format == SND_PCM_FORMAT_U8) ? 8 : format_bytes(out->format) * 8;
+
+	wav_build_header(hdr, out->channels, bits, out->rate,
+		data > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t) data);
+}
+
+static void wav_sink_finish(struct output* out) {
+	if (out->fd < 0) {
+		return;
+	}
+
+	uint8_t hdr[WAV_CANONICAL_HEADER];
+	wav_sink_header(out, hdr);
+
+	if (pwrite(out->fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		perror("pwrite");
+	}
+
+	close(out->fd);
+	out->fd = -1;
+}
+
+static int wav_sink_open(struct output* out) {
+	out->fd = -1;
+	out->files = 0;
+	return 0;
+}
+
+static int wav_sink_supports(struct output* out, snd_pcm_format_t format) {
+	(void) out;
+
+	return format == SND_PCM_FORMAT_U8 || format == SND_PCM_FORMAT_S16_LE
+		|| format == SND_PCM_FORMAT_S24_3LE || format == SND_PCM_FORMAT_S32_LE;
+}
+
+/*
+a wav file has one format, so every configure starts a new file: the
+first one is path itself, the next ones path-1.wav, path-2.wav...
+*/
+static int wav_sink_configure(struct output* out, struct audio_device* dev,
+	snd_pcm_format_t format, unsigned int channels, unsigned int rate)
+{
+	char name[PATH_MAX_LENGTH];
+
+	wav_sink_finish(out);
+
+	if (out->files == 0) {
+		snprintf(name, sizeof(name), "%s", out->path);
+	} else {
+		size_t len = strlen(out->path);
+		int stem = (len > 4 && strcasecmp(out->path + len - 4, ".wav") == 0) ? len - 4 : len;
+
+		snprintf(name, sizeof(name), "%.*s-%u.wav", stem, out->path, out->files);
+	}
+
+	out->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (out->fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	out->files++;
+	out->frame_bytes = format_bytes(format) * channels;
+	out->buffer_frames = 0;
+	out->format = format;
+	out->channels = channels;
+	out->rate = rate;
+	out->frames = 0;
+
+	uint8_t hdr[WAV_CANONICAL_HEADER];
+	wav_sink_header(out, hdr);
+
+	if (write(out->fd, hdr, sizeof(hdr)) != sizeof(hdr)) {
+		perror("write");
+		return -1;
+	}
+
+	dev->mmap = 0;
+	dev->can_pause = 0;
+
+	return 0;
+}
+
+static int wav_sink_write(struct output* out, const void* buf, size_t frames) {
+	size_t len = frames * out->frame_bytes;
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = write(out->fd, (const uint8_t*) buf + done, len - done);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			perror("write");
+			return -1;
+		}
+
+		done += n;
+	}
+
+	out->frames += frames;
+
+	return 0;
+}
+
+static long wav_sink_delay(struct output* out) {
+	(void) out;
+	return 0;
+}
+
+// a file can't take frames back, drain and drop are the same
+static long wav_sink_rewind(struct output* out, size_t frames) {
+	(void) out;
+	(void) frames;
+	return 0;
+}
+
+static void wav_sink_stop(struct output* out) {
+	(void) out;
+}
+
+static void wav_sink_pause(struct output* out, int pause) {
+	(void) out;
+	(void) pause;
+}
+
+static const struct output_ops wav_ops = {
+	.name = "wav",
+	.open = wav_sink_open,
+	.supports = wav_sink_supports,
+	.configure = wav_sink_configure,
+	.write = wav_sink_write,
+	.delay = wav_sink_delay,
+	.rewind = wav_sink_rewind,
+	.drain = wav_sink_stop,
+	.drop = wav_sink_stop,
+	.pause = wav_sink_pause,
+	.close = wav_sink_finish
+};
+
+/*	--- SELECTION --- */
+
+int output_select(struct output* out, const char* spec) {
+	memset(out, 0, sizeof(*out));
+	out->fd = -1;
+
+	if (!spec || strcmp(spec, "alsa") == 0) {
+		out->ops = &alsa_ops;
+	} else if (strcmp(spec, "null") == 0) {
+		out->ops = &null_ops;
+		out->throttle = 1;
+	} else if (strcmp(spec, "null-fast") == 0) {
+		out->ops = &null_ops;
+	} else if (strncmp(spec, "wav:", 4) == 0 && spec[4]) {
+		out->ops = &wav_ops;
+		snprintf(out->path, sizeof(out->path), "%s", spec + 4);
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,45 @@
+/*
+output backends
+
+the audio thread hands its frames to an output instead of calling
+snd_pcm_* itself. alsa is the sound card, null throws the frames away
+(at the device rate like a real card, or as fast as they come) and wav
+writes them into files, so the whole pipeline runs and can be measured
+on a machine without a sound card.
+mmap access is alsa only: when configure sets dev->mmap the audio thread
+writes into the buffer of out->pcm itself and write is never called
+*/
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include "types.h"
+
+#define OUTPUT_BUFFER_US 500000 // device buffer, the null sink models the same
+
+struct output_ops {
+	const char* name;
+	int (*open)(struct output* out);
+	int (*supports)(struct output* out, snd_pcm_format_t format);
+	// sets the format and fills dev->mmap and dev->can_pause
+	int (*configure)(struct output* out, struct audio_device* dev,
+		snd_pcm_format_t format, unsigned int channels, unsigned int rate);
+	// blocks like snd_pcm_writei until every frame was taken
+	int (*write)(struct output* out, const void* buf, size_t frames);
+	long (*delay)(struct output* out); // frames written but not heard yet
+	// takes back up to frames of the newest frames not heard yet, returns how many
+	long (*rewind)(struct output* out, size_t frames);
+	// both stop the stream and leave it ready for the next write
+	void (*drain)(struct output* out);
+	void (*drop)(struct output* out);
+	void (*pause)(struct output* out, int pause);
+	void (*close)(struct output* out);
+};
+
+/*
+picks the backend from spec: "alsa", "null" (real time), "null-fast"
+(unthrottled) or "wav:FILE". nothing is opened yet, -1 when unknown
+*/
+int output_select(struct output* out, const char* spec);
+
+#endif
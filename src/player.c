@@ -8,11 +8,15 @@ from the .wav that is actualy playing, which is not a great ideia
 for efficiency, but the ideia is to get used to this world, then 
 get things a little bit faster later using dynamic reading with mmap
 
+(update: the data chunk is now mmaped, see wav_map_data in fd_handle.c.
+samples are converted straight from the mapping and read() is only used
+as a fallback when mmap fails)
+
 
 
 HOW TO COMPILE:
 
-gcc -o player player.c fd_handle.c sound_engine.c types.c cli_interface.c -lasound
+gcc -pthread -o player player.c fd_handle.c sound_engine.c types.c cli_interface.c convert.c library_index.c scanner.c probe.c resampler.c screen.c output.c stats.c loudness.c limiter.c -lasound -lm
 
 ALSA is the default sound layer on modern linux
 it exposes audio devices in /dev/snd/, but it's not
@@ -108,6 +112,11 @@ snd_strerror(int err) -> converts ALSA error codes to human readable format
 #include "fd_handle.h"
 #include "sound_engine.h"
 #include "cli_interface.h"
+#include "library_index.h"
+#include "scanner.h"
+#include "screen.h"
+#include "output.h"
+#include "loudness.h"
 #include <string.h>
 
 volatile sig_atomic_t should_exit = 0;
@@ -117,51 +126,23 @@ void handle_signal(int sig) {
 	should_exit = 1;
 }
 
-void add_track(const char* path, const char* fullname, void* userdata) {
-	struct player_state* st = (struct player_state*) userdata;
-
-	if (!st) {
-		return;
-	}
-
-	struct track t;
-	t.path = strdup(path);
-	t.name = strdup(fullname);
-
-	struct wav_information wav = {0};
-
-	int file = get_wav_information(path, &wav);
-
-	if (file < 0) {
-		fprintf(stderr, "reading wav failed\n");
-		return;
-	}
-
-	close(file);
-
-	size_t total_frames = wav.data_size / wav.frame_size;
-	double duration = (double) total_frames / wav.sample_rate;
-	t.duration = duration;
-
-	if (playlist_push(&st->playlist, t) < 0) {
-		if (st->playlist.len > 0) {
-			playlist_free(&st->playlist);
-
-			free(t.path);
-			free(t.name);
-		}
-	}
-}
-
 void create_playlist(const char* path, int recursive, struct player_state* st) {
 	playlist_init(&st->playlist);
-	list_wavs(path, recursive, add_track, st);
+
+	library_index_open(&st->library, path, recursive);
+	scan_library(path, recursive, st->scan_threads, &st->library, &st->playlist);
+	library_index_save(&st->library, &st->playlist);
+	library_index_close(&st->library);
+
+	// the new tracks get their loudness while the player is already usable
+	loudness_start(&st->loudness, &st->playlist, &st->library, st->scan_threads);
 }
 
 int init
 (
 	const char* path,
 	int recursive, 
+	int threads,
 	struct player_state *st
 ) 
 {
@@ -173,29 +154,37 @@ int init
 	st->running = 1;
 	snprintf(st->dir_path, PATH_MAX_LENGTH, "%s", path);
 	st->recursive = recursive;
+	st->scan_threads = threads;
 	st->playlist_loop = 0;
 	st->track_loop = 0;
 	st->played = 0;
 	st->mode = COMMAND;
 	st->state = STOPPED;
 	st->player_gain = 1.0; // default
+	st->normalize = 1;
+	st->resample_quality = RESAMPLE_MEDIUM;
 	st->played = 0;
 	st->playlist_random = 0;
 
 	create_playlist(st->dir_path, recursive, st);
 	st->current_track = 0;
 
-	st->pcm = NULL;
+	st->fd = -1;
+	st->preload.fd = -1;
 
 	return 0;
 }
 
 void print_usage(const char* program_name) {
-	printf("usage: %s [PATH] [RECURSIVE]\n\n", program_name);
+	printf("usage: %s [PATH] [RECURSIVE] [THREADS] [OUTPUT]\n\n", program_name);
 	printf("if [PATH] (relative or global) is omitted, then the directory\n");
 	printf("that will be used by the player will be the current directory ./\n");
 	printf("[RECURSIVE] must be 1 if you want the program to read the\n");
 	printf("directory recursively (default) or 0 otherwise\n");	
+	printf("[THREADS] is the number of threads used to scan the library,\n");
+	printf("one per cpu by default\n");
+	printf("[OUTPUT] is where the audio goes: alsa (default), null (no sound\n");
+	printf("card, real time), null-fast (as fast as possible) or wav:FILE\n");
 }
 
 int main(int argc, const char* argv[]) {
@@ -209,6 +198,8 @@ int main(int argc, const char* argv[]) {
 	// --- READING .WAV ---
 	char path[PATH_MAX_LENGTH];
 	int recursive = 1;
+	int threads = scan_default_threads();
+	const char* output = "alsa";
 
 	if (argc == 1) {
 		snprintf(path, PATH_MAX_LENGTH, "%s", ".");
@@ -219,9 +210,22 @@ int main(int argc, const char* argv[]) {
 		}
 
 		snprintf(path, PATH_MAX_LENGTH, "%s", argv[1]);
-	} else if (argc == 3) {
+	} else if (argc >= 3 && argc <= 5) {
 		snprintf(path, PATH_MAX_LENGTH, "%s", argv[1]);
 		recursive = atoi(argv[2]);
+
+		if (argc >= 4) {
+			threads = atoi(argv[3]);
+
+			if (threads < 1) {
+				print_usage(argv[0]);
+				return -1;
+			}
+		}
+
+		if (argc == 5) {
+			output = argv[4];
+		}
 	} else {
 		print_usage(argv[0]);
 		return -1;
@@ -230,7 +234,15 @@ int main(int argc, const char* argv[]) {
 	struct player_state st = {0};
 	st.show_commands = 1;
 
-	int ret = init(path, recursive, &st);
+	if (output_select(&st.output, output) < 0) {
+		fprintf(stderr, "unknown output: %s\n", output);
+		print_usage(argv[0]);
+		return -1;
+	}
+
+	st.output.stats = &st.stats;
+
+	int ret = init(path, recursive, threads, &st);
 
 	if (ret < 0) {
 		fprintf(stderr, "reading dir failed\n");
@@ -242,6 +254,9 @@ int main(int argc, const char* argv[]) {
 		player_loop(&st, &should_exit);
 	}
 
+	audio_close(&st);
+	loudness_stop(&st.loudness);
+	screen_free(&st.screen);
 	playlist_free(&st.playlist);
 
 	return 0;
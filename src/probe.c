@@ -0,0 +1,434 @@
+#include "probe.h"
+#include "fd_handle.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+no liburing here, the rings are set up by hand: io_uring_setup gives the
+sizes and offsets, the submission ring, the sqe array and the completion
+ring are mmaped from the ring fd. the kernel moves sq head and cq tail,
+we move sq tail and cq head
+*/
+struct uring {
+	int fd;
+	unsigned entries;
+
+	void* sq_ptr;
+	size_t sq_length;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	struct io_uring_sqe* sqes;
+	size_t sqes_length;
+
+	void* cq_ptr;
+	size_t cq_length;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_cqe* cqes;
+
+	unsigned queued; // sqes written since the last submit
+};
+
+static void uring_free(struct uring* r) {
+	if (r->sqes) {
+		munmap(r->sqes, r->sqes_length);
+	}
+
+	if (r->cq_ptr && r->cq_ptr != r->sq_ptr) {
+		munmap(r->cq_ptr, r->cq_length);
+	}
+
+	if (r->sq_ptr) {
+		munmap(r->sq_ptr, r->sq_length);
+	}
+
+	if (r->fd >= 0) {
+		close(r->fd);
+	}
+}
+
+static int uring_init(struct uring* r, unsigned entries) {
+	memset(r, 0, sizeof(*r));
+
+	struct io_uring_params p = {0};
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+
+	if (r->fd < 0) {
+		return -1;
+	}
+
+	r->entries = p.sq_entries;
+	r->sq_length = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_length = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	// both rings share one mapping on anything newer than 5.4
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_length > r->sq_length) {
+			r->sq_length = r->cq_length;
+		}
+
+		r->cq_length = r->sq_length;
+	}
+
+	r->sq_ptr = mmap(NULL, r->sq_length, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+
+	if (r->sq_ptr == MAP_FAILED) {
+		r->sq_ptr = NULL;
+		goto fail;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_length, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+
+		if (r->cq_ptr == MAP_FAILED) {
+			r->cq_ptr = NULL;
+			goto fail;
+		}
+	}
+
+	r->sqes_length = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_length, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto fail;
+	}
+
+	uint8_t* sq = r->sq_ptr;
+	r->sq_head = (unsigned*) (sq + p.sq_off.head);
+	r->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+	r->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*) (sq + p.sq_off.array);
+
+	uint8_t* cq = r->cq_ptr;
+	r->cq_head = (unsigned*) (cq + p.cq_off.head);
+	r->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+	r->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+	return 0;
+
+	fail:
+		uring_free(r);
+		return -1;
+}
+
+// next free sqe, zeroed. only called with fewer than entries queued
+static struct io_uring_sqe* uring_get_sqe(struct uring* r) {
+	unsigned tail = *r->sq_tail + r->queued;
+	unsigned index = tail & *r->sq_mask;
+	struct io_uring_sqe* sqe = &r->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[index] = index;
+	r->queued++;
+
+	return sqe;
+}
+
+/*
+submits the queued sqes and waits for all of them. res[user_data] gets
+each result, negative errno like the syscall it replaces
+*/
+// the completions posted so far, res[user_data] = result
+static unsigned uring_reap(struct uring* r, int* res) {
+	unsigned head = *r->cq_head;
+	unsigned tail = atomic_load_explicit((_Atomic unsigned*) r->cq_tail,
+		memory_order_acquire);
+	unsigned completed = 0;
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+		res[cqe->user_data] = cqe->res;
+		completed++;
+	}
+
+	atomic_store_explicit((_Atomic unsigned*) r->cq_head, head,
+		memory_order_release);
+
+	return completed;
+}
+
+static int uring_submit_and_wait(struct uring* r, int* res) {
+	unsigned count = r->queued;
+
+	if (count == 0) {
+		return 0;
+	}
+
+	atomic_store_explicit((_Atomic unsigned*) r->sq_tail, *r->sq_tail + count,
+		memory_order_release);
+	r->queued = 0;
+
+	unsigned submitted = 0;
+	unsigned completed = 0;
+
+	while (completed < count) {
+		unsigned to_submit = count - submitted;
+		int ret = syscall(__NR_io_uring_enter, r->fd, to_submit, 1,
+			IORING_ENTER_GETEVENTS, NULL, 0);
+
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			uring_reap(r, res); // what did complete is still handed back (opened fds)
+			return -1;
+		}
+
+		submitted += ret;
+		completed += uring_reap(r, res);
+	}
+
+	return 0;
+}
+
+/*	--- PARSING --- */
+
+// parses buf for req, going back to the file when the data chunk is further out
+static void probe_finish(struct probe_request* req, const uint8_t* buf, ssize_t len) {
+	if (len < 0) {
+		req->status = -1;
+		return;
+	}
+
+	int ret = wav_parse_header(buf, len, &req->wav);
+
+	// a short read was the whole file, there's nothing further out
+	if (ret == 1 && len < PROBE_HEADER_SIZE) {
+		ret = -1;
+	}
+
+	if (ret == 1) {
+		// big metadata chunks before data, rare enough for the slow path
+		memset(&req->wav, 0, sizeof(req->wav));
+		int fd = get_wav_information(req->path, &req->wav);
+
+		if (fd >= 0) {
+			close(fd);
+			ret = 0;
+		}
+	}
+
+	if (ret == 0 && (req->wav.frame_size == 0 || req->wav.sample_rate == 0)) {
+		ret = -1;
+	}
+
+	req->status = (ret == 0) ? 0 : -1;
+}
+
+static void probe_one(struct probe_request* req, uint8_t* buf) {
+	int fd = open(req->path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		req->status = -1;
+		return;
+	}
+
+	ssize_t len = pread(fd, buf, PROBE_HEADER_SIZE, 0);
+	close(fd);
+
+	probe_finish(req, buf, len);
+}
+
+/*	--- IO_URING --- */
+
+// one window of at most entries files: all opens, then all reads
+static int probe_window(struct uring* r, struct probe_request* reqs, size_t n,
+	uint8_t* bufs, int* res, int* fds)
+{
+	for (size_t i = 0; i < n; i++) {
+		struct io_uring_sqe* sqe = uring_get_sqe(r);
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t) reqs[i].path;
+		sqe->open_flags = O_RDONLY | O_CLOEXEC;
+		sqe->user_data = i;
+		fds[i] = -1;
+	}
+
+	if (uring_submit_and_wait(r, fds) < 0) {
+		// the caller falls back to the thread pool, it can't close these
+		for (size_t i = 0; i < n; i++) {
+			if (fds[i] >= 0) {
+				close(fds[i]);
+			}
+		}
+
+		return -1;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		res[i] = -EBADF;
+
+		if (fds[i] < 0) {
+			continue;
+		}
+
+		struct io_uring_sqe* sqe = uring_get_sqe(r);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fds[i];
+		sqe->addr = (uintptr_t) (bufs + i * PROBE_HEADER_SIZE);
+		sqe->len = PROBE_HEADER_SIZE;
+		sqe->off = 0;
+		sqe->user_data = i;
+	}
+
+	int failed = uring_submit_and_wait(r, res);
+
+	for (size_t i = 0; i < n; i++) {
+		if (fds[i] >= 0) {
+			close(fds[i]); // a plain close, batching it saves next to nothing
+		}
+	}
+
+	if (failed < 0) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		// kernels before 5.6 know neither openat nor read, retry those the old way
+		if (fds[i] == -EINVAL || res[i] == -EINVAL) {
+			probe_one(&reqs[i], bufs + i * PROBE_HEADER_SIZE);
+		} else if (fds[i] < 0) {
+			reqs[i].status = -1;
+		} else {
+			probe_finish(&reqs[i], bufs + i * PROBE_HEADER_SIZE, res[i]);
+		}
+	}
+
+	return 0;
+}
+
+static int probe_uring(struct probe_request* reqs, size_t n) {
+	struct uring r;
+	unsigned depth = (n < PROBE_QUEUE_DEPTH) ? n : PROBE_QUEUE_DEPTH;
+
+	if (uring_init(&r, depth) < 0) {
+		return -1;
+	}
+
+	depth = (r.entries < depth) ? r.entries : depth;
+
+	uint8_t* bufs = malloc((size_t) depth * PROBE_HEADER_SIZE);
+	int* res = malloc(depth * sizeof(*res));
+	int* fds = malloc(depth * sizeof(*fds));
+	int ret = 0;
+
+	if (!bufs || !res || !fds) {
+		perror("malloc");
+		ret = -1;
+	}
+
+	for (size_t i = 0; ret == 0 && i < n; i += depth) {
+		size_t len = (n - i < depth) ? n - i : depth;
+		ret = probe_window(&r, reqs + i, len, bufs, res, fds);
+	}
+
+	free(bufs);
+	free(res);
+	free(fds);
+	uring_free(&r);
+
+	return ret;
+}
+
+/*	--- THREAD POOL FALLBACK --- */
+
+struct probe_pool {
+	struct probe_request* reqs;
+	size_t n;
+	_Atomic size_t next;
+};
+
+static void* probe_worker_main(void* arg) {
+	struct probe_pool* pool = (struct probe_pool*) arg;
+	uint8_t* buf = malloc(PROBE_HEADER_SIZE);
+
+	if (!buf) {
+		return NULL;
+	}
+
+	size_t i;
+
+	while ((i = atomic_fetch_add(&pool->next, 1)) < pool->n) {
+		probe_one(&pool->reqs[i], buf);
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+static void probe_threads(struct probe_request* reqs, size_t n, int threads) {
+	struct probe_pool pool;
+	pool.reqs = reqs;
+	pool.n = n;
+	atomic_init(&pool.next, 0);
+
+	if (threads < 1) {
+		threads = 1;
+	}
+
+	if ((size_t) threads > n) {
+		threads = n;
+	}
+
+	pthread_t* tids = calloc(threads, sizeof(*tids));
+	int started = 0;
+
+	for (int i = 1; tids && i < threads; i++) {
+		if (pthread_create(&tids[i], NULL, probe_worker_main, &pool) != 0) {
+			break;
+		}
+
+		started = i;
+	}
+
+	// the caller works too, and alone picks up everything if no thread started
+	probe_worker_main(&pool);
+
+	for (int i = 1; i <= started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	free(tids);
+}
+
+int probe_batch(struct probe_request* reqs, size_t n, int threads) {
+	if (n == 0) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		memset(&reqs[i].wav, 0, sizeof(reqs[i].wav));
+		reqs[i].status = -1;
+	}
+
+	if (probe_uring(reqs, n) < 0) {
+		probe_threads(reqs, n, threads);
+	}
+
+	int parsed = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		parsed += (reqs[i].status == 0);
+	}
+
+	return parsed;
+}
@@ -0,0 +1,24 @@
+/*
+batch header probing
+
+get_wav_information costs about a dozen syscalls per file (open, small
+reads, lseeks), each one a full round trip on slow storage. probe_batch
+takes a whole list of files: the opens and then the reads of the first
+PROBE_HEADER_SIZE bytes are each submitted at once through io_uring, and
+the headers are parsed from memory with wav_parse_header.
+when io_uring isn't there (old kernel, seccomp) a pool of threads does
+open + pread + close for one file at a time instead
+*/
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#include "types.h"
+
+#define PROBE_QUEUE_DEPTH 256 // files in flight per io_uring batch
+#define PROBE_HEADER_SIZE WAV_HEADER_BLOCK // bytes read from the start of every file
+
+// fills reqs[i].wav and reqs[i].status, returns the number of files parsed
+int probe_batch(struct probe_request* reqs, size_t n, int threads);
+
+#endif
@@ -0,0 +1,314 @@
+#include "resampler.h"
+#include "convert.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RESAMPLE_X86 1
+#include <immintrin.h>
+#endif
+
+// same bounds as the gain kernels in convert.c
+#define SAMPLE_MAX 2147483520.0f
+#define SAMPLE_MIN -2147483648.0f
+#define S32_SCALE 2147483648.0f
+
+/*
+taps per branch, kaiser beta and passband edge (fraction of the lower
+nyquist) of every tier. more taps buy a steeper transition band, beta
+trades it for stopband rejection (about 60, 80, 100 dB)
+*/
+static const struct {
+	const char* name;
+	uint32_t taps;
+	double beta;
+	double rolloff;
+} tiers[] = {
+	[RESAMPLE_OFF] = {"off", 0, 0.0, 0.0},
+	[RESAMPLE_FAST] = {"fast", 16, 6.0, 0.85},
+	[RESAMPLE_MEDIUM] = {"medium", 32, 8.0, 0.91},
+	[RESAMPLE_BEST] = {"best", 64, 10.0, 0.95},
+};
+
+#define TIERS (sizeof(tiers) / sizeof(tiers[0]))
+
+/*	--- DOT PRODUCT KERNELS --- */
+
+static float dot_scalar(const float* a, const float* b, size_t n) {
+	float acc = 0.0f;
+
+	for (size_t i = 0; i < n; i++) {
+		acc += a[i] * b[i];
+	}
+
+	return acc;
+}
+
+#ifdef RESAMPLE_X86
+// taps is always a multiple of 16, no tail loops
+__attribute__((target("sse2")))
+static float dot_sse2(const float* a, const float* b, size_t n) {
+	__m128 acc0 = _mm_setzero_ps();
+	__m128 acc1 = _mm_setzero_ps();
+
+	for (size_t i = 0; i < n; i += 8) {
+		acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+		acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+	}
+
+	__m128 acc = _mm_add_ps(acc0, acc1);
+	acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+	acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+
+	return _mm_cvtss_f32(acc);
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float* a, const float* b, size_t n) {
+	__m256 acc0 = _mm256_setzero_ps();
+	__m256 acc1 = _mm256_setzero_ps();
+
+	for (size_t i = 0; i < n; i += 16) {
+		acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+		acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+	}
+
+	__m256 acc = _mm256_add_ps(acc0, acc1);
+	__m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+
+	return _mm_cvtss_f32(sum);
+}
+#endif
+
+dot_fn resample_dot_for(enum cpu_isa isa) {
+#ifdef RESAMPLE_X86
+	// every cpu with avx2 so far has fma too, checked anyway
+	if (isa == ISA_AVX2 && __builtin_cpu_supports("fma")) {
+		return dot_avx2;
+	}
+
+	if (isa == ISA_AVX2 || isa == ISA_SSE2) {
+		return dot_sse2;
+	}
+#else
+	(void) isa;
+#endif
+
+	return dot_scalar;
+}
+
+/*	--- FILTER DESIGN --- */
+
+static uint32_t gcd(uint32_t a, uint32_t b) {
+	while (b) {
+		uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+// modified bessel function of the first kind, order 0 (power series)
+static double bessel_i0(double x) {
+	double sum = 1.0;
+	double term = 1.0;
+	double q = x * x / 4.0;
+
+	for (int k = 1; k < 64 && term > sum * 1e-12; k++) {
+		term *= q / ((double) k * k);
+		sum += term;
+	}
+
+	return sum;
+}
+
+/*
+the prototype lowpass runs at in_rate * up, so its cutoff (cycles per
+sample) is the lower nyquist divided by that. coefficient k*up + p goes
+to branch p, stored reversed so the dot product walks the history
+forward. every branch is normalized to unity dc gain on its own, which
+also hides the gain lost to the zeros inserted by upsampling
+*/
+static void design_filter(struct resampler* rs, double beta, double rolloff) {
+	uint32_t length = rs->up * rs->taps;
+	double ratio = (rs->up < rs->down) ? (double) rs->up / rs->down : 1.0;
+	double cutoff = 0.5 * rolloff * ratio / rs->up;
+	double center = (length - 1) / 2.0;
+	double norm = bessel_i0(beta);
+
+	for (uint32_t p = 0; p < rs->up; p++) {
+		float* row = rs->filter + (size_t) p * rs->taps;
+		double sum = 0.0;
+
+		for (uint32_t k = 0; k < rs->taps; k++) {
+			uint32_t i = k * rs->up + p;
+			double t = i - center;
+			double x = 2.0 * cutoff * t;
+			double sinc = (t == 0.0) ? 1.0 : sin(M_PI * x) / (M_PI * x);
+			double r = 2.0 * t / (length - 1);
+			double window = bessel_i0(beta * sqrt(fmax(0.0, 1.0 - r * r))) / norm;
+			double h = sinc * window;
+
+			row[rs->taps - 1 - k] = (float) h;
+			sum += h;
+		}
+
+		for (uint32_t k = 0; k < rs->taps; k++) {
+			row[k] = (float) (row[k] / sum);
+		}
+	}
+}
+
+/*	--- PUBLIC --- */
+
+int resampler_init(struct resampler* rs, uint32_t in_rate, uint32_t out_rate,
+	uint16_t channels, enum resample_quality quality)
+{
+	memset(rs, 0, sizeof(*rs));
+
+	if (quality == RESAMPLE_OFF || quality >= TIERS || !in_rate || !out_rate || !channels) {
+		return -1;
+	}
+
+	uint32_t g = gcd(in_rate, out_rate);
+
+	rs->in_rate = in_rate;
+	rs->out_rate = out_rate;
+	rs->up = out_rate / g;
+	rs->down = in_rate / g;
+	rs->taps = tiers[quality].taps;
+	rs->channels = channels;
+	rs->quality = quality;
+
+	if (rs->up > RESAMPLE_MAX_UP) {
+		fprintf(stderr, "can't resample %u to %u hz\n", in_rate, out_rate);
+		return -1;
+	}
+
+	// room for the filter length plus two blocks, process compacts it every call
+	rs->cap = rs->taps + 2 * FRAMES_PER_TICK;
+	rs->filter = malloc((size_t) rs->up * rs->taps * sizeof(float));
+	rs->history = malloc(rs->cap * channels * sizeof(float));
+
+	if (!rs->filter || !rs->history) {
+		perror("malloc");
+		resampler_free(rs);
+		return -1;
+	}
+
+	design_filter(rs, tiers[quality].beta, tiers[quality].rolloff);
+	rs->dot = resample_dot_for(cpu_detect_isa());
+	resampler_reset(rs);
+
+	return 0;
+}
+
+void resampler_free(struct resampler* rs) {
+	free(rs->filter);
+	free(rs->history);
+	rs->filter = NULL;
+	rs->history = NULL;
+}
+
+// the history starts as taps - 1 samples of silence
+void resampler_reset(struct resampler* rs) {
+	if (!rs->history) {
+		return;
+	}
+
+	memset(rs->history, 0, rs->cap * rs->channels * sizeof(float));
+	rs->fill = rs->taps - 1;
+	rs->pos = rs->taps - 1;
+	rs->phase = 0;
+}
+
+size_t resampler_block(const struct resampler* rs, size_t max_out) {
+	// one output of slack, the phase can round either way
+	size_t in = (max_out > 1) ? (max_out - 1) * rs->down / rs->up : 0;
+
+	if (in < 1) {
+		in = 1;
+	}
+
+	return (in > FRAMES_PER_TICK) ? FRAMES_PER_TICK : in;
+}
+
+/*
+output n uses branch (n * down) % up on the input samples up to
+(n * down) / up, which is what phase and pos step through. an output is
+only made once its newest input sample is in the history, the rest of
+the block waits there for the next call
+*/
+size_t resampler_process(struct resampler* rs, const int32_t* in, size_t in_frames,
+	int32_t* out, size_t max_out)
+{
+	uint16_t channels = rs->channels;
+	size_t keep = rs->taps - 1;
+	size_t oldest = ((rs->pos < rs->fill) ? rs->pos : rs->fill) - keep;
+
+	if (oldest > 0) {
+		for (uint16_t c = 0; c < channels; c++) {
+			float* plane = rs->history + c * rs->cap;
+			memmove(plane, plane + oldest, (rs->fill - oldest) * sizeof(float));
+		}
+
+		rs->fill -= oldest;
+		rs->pos -= oldest;
+	}
+
+	if (in_frames > rs->cap - rs->fill) {
+		in_frames = rs->cap - rs->fill;
+	}
+
+	for (uint16_t c = 0; c < channels; c++) {
+		float* plane = rs->history + c * rs->cap + rs->fill;
+
+		for (size_t i = 0; i < in_frames; i++) {
+			plane[i] = (float) in[i * channels + c] * (1.0f / S32_SCALE);
+		}
+	}
+
+	rs->fill += in_frames;
+
+	size_t n = 0;
+
+	while (rs->pos < rs->fill && n < max_out) {
+		const float* row = rs->filter + (size_t) rs->phase * rs->taps;
+
+		for (uint16_t c = 0; c < channels; c++) {
+			const float* x = rs->history + c * rs->cap + rs->pos - keep;
+			float y = rs->dot(row, x, rs->taps) * S32_SCALE;
+
+			y = (y > SAMPLE_MAX) ? SAMPLE_MAX : y;
+			y = (y < SAMPLE_MIN) ? SAMPLE_MIN : y;
+			out[n * channels + c] = (int32_t) y;
+		}
+
+		n++;
+		rs->phase += rs->down;
+		rs->pos += rs->phase / rs->up;
+		rs->phase %= rs->up;
+	}
+
+	return n;
+}
+
+const char* resample_quality_name(enum resample_quality quality) {
+	return (quality < TIERS) ? tiers[quality].name : "?";
+}
+
+int resample_quality_parse(const char* name, enum resample_quality* quality) {
+	for (size_t i = 0; i < TIERS; i++) {
+		if (strcmp(name, tiers[i].name) == 0) {
+			*quality = (enum resample_quality) i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
@@ -0,0 +1,41 @@
+/*
+band-limited polyphase sample rate converter
+
+the device keeps one rate for the whole session and tracks at another
+rate go through here instead of reconfiguring it (ALSA's plug resampler
+is low quality and would run inside the device write). the ratio is
+reduced to out_rate / in_rate = up / down, a kaiser windowed sinc is
+designed for it and split into up branches of taps coefficients; every
+output sample is one dot product of a branch with the last taps input
+samples of a channel, which is the part that is vectorized
+*/
+
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include "types.h"
+#include "convert.h"
+
+#define RESAMPLE_MAX_UP 1024 // more branches than this and the ratio is refused
+
+int resampler_init(struct resampler* rs, uint32_t in_rate, uint32_t out_rate,
+	uint16_t channels, enum resample_quality quality);
+void resampler_free(struct resampler* rs);
+
+// forgets the input seen so far (seek, skip)
+void resampler_reset(struct resampler* rs);
+
+// input frames that produce at most max_out output frames
+size_t resampler_block(const struct resampler* rs, size_t max_out);
+
+// s32 interleaved in, s32 interleaved out, returns the frames written to out
+size_t resampler_process(struct resampler* rs, const int32_t* in, size_t in_frames,
+	int32_t* out, size_t max_out);
+
+// dot product kernel of the resampler for isa (benchmarks pin one)
+dot_fn resample_dot_for(enum cpu_isa isa);
+
+const char* resample_quality_name(enum resample_quality quality);
+int resample_quality_parse(const char* name, enum resample_quality* quality);
+
+#endif
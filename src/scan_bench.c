@@ -0,0 +1,601 @@
+/*
+library scan benchmark (make bench-scan)
+
+gen writes a synthetic library: a tree of directories 0 to 4 levels deep
+with valid wav files of mixed formats and chunk layouts (plain, LIST or
+fact + LIST before data, a JUNK chunk pushing data past the first header
+block) and a cover image here and there. the data chunks are holes, so
+thousands of long tracks take almost no disk.
+
+run times the startup path of the player (index open, scan_library,
+index save) on such a tree, cold and warm, without and with a library
+index. every scan runs in a child process: its peak rss is its own and
+the index lives in a private cache directory. the syscalls are counted
+in a second, traced run of the same case (io_uring work doesn't show up
+there, which is the point of it). dropping the page cache needs root,
+without it the file data is evicted with fadvise and the case is called
+cold-data since dentries and inodes stay cached
+*/
+
+#include "types.h"
+#include "scanner.h"
+#include "library_index.h"
+#include "fd_handle.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+
+#define GEN_MAX_DEPTH 4
+#define GEN_FANOUT 8 // subdirectories per level
+#define GEN_JUNK_SIZE 5000 // pushes data past WAV_HEADER_BLOCK
+#define SCAN_WARM_RUNS 3 // best of, cold runs happen once
+#define SCAN_NO_TRACE 3 // exit status of a child that couldn't be traced
+
+static const uint16_t gen_bits[] = { 8, 16, 24 };
+static const uint16_t gen_channels[] = { 1, 2, 2, 2, 6 };
+static const uint32_t gen_rates[] = { 44100, 48000, 88200, 96000 };
+
+enum gen_layout {
+	LAYOUT_PLAIN,
+	LAYOUT_LIST,
+	LAYOUT_FACT_LIST,
+	LAYOUT_JUNK,
+	LAYOUT_COUNT
+};
+
+struct scan_case {
+	const char* name;
+	int cold;
+	int index; // an up to date index exists before the scan
+};
+
+static const struct scan_case scan_cases[] = {
+	{ "cold", 1, 0 }, // first launch after boot
+	{ "warm", 0, 0 },
+	{ "warm-index", 0, 1 }, // usual launch
+	{ "cold-index", 1, 1 },
+};
+
+struct scan_result { // sent by the child through a pipe
+	int found;
+	size_t hits;
+	int64_t ns;
+};
+
+static uint32_t rng_state;
+
+static uint32_t rng(void) {
+	uint32_t x = rng_state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return rng_state = x;
+}
+
+static int64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*	--- GENERATOR --- */
+
+static void put_u32(uint8_t* b, uint32_t v) {
+	b[0] = v & 0xFF;
+	b[1] = (v >> 8) & 0xFF;
+	b[2] = (v >> 16) & 0xFF;
+	b[3] = v >> 24;
+}
+
+// appends a chunk (and its pad byte when size is odd)
+static size_t put_chunk(uint8_t* buf, size_t len, const char* id, const void* payload, uint32_t size) {
+	memcpy(buf + len, id, 4);
+	put_u32(buf + len + 4, size);
+	memcpy(buf + len + 8, payload, size);
+	len += 8 + size;
+
+	if (size & 1) {
+		buf[len++] = 0;
+	}
+
+	return len;
+}
+
+// a header with layout's chunks between fmt and data, returns its length
+static size_t gen_header(uint8_t* buf, enum gen_layout layout, uint16_t channels,
+	uint16_t bits, uint32_t rate, uint32_t data_size)
+{
+	static const uint8_t junk[GEN_JUNK_SIZE];
+	uint8_t canonical[WAV_CANONICAL_HEADER];
+	uint8_t payload[64];
+	size_t len = 36; // RIFF and fmt
+
+	wav_build_header(canonical, channels, bits, rate, data_size);
+	memcpy(buf, canonical, len);
+
+	if (layout == LAYOUT_FACT_LIST) {
+		put_u32(payload, data_size / (channels * (bits / 8)));
+		len = put_chunk(buf, len, "fact", payload, 4);
+	}
+
+	if (layout == LAYOUT_LIST || layout == LAYOUT_FACT_LIST) {
+		int n = snprintf((char*) payload, sizeof(payload), "INFOINAM%c%c%c%cgenerated %u",
+			0, 0, 0, 0, rng() % 1000);
+
+		put_u32(payload + 8, n - 12); // odd half the time, padded
+		len = put_chunk(buf, len, "LIST", payload, n);
+	}
+
+	if (layout == LAYOUT_JUNK) {
+		len = put_chunk(buf, len, "JUNK", junk, sizeof(junk));
+	}
+
+	memcpy(buf + len, canonical + 36, 8);
+	len += 8;
+	put_u32(buf + 4, len - 8 + data_size + (data_size & 1));
+
+	return len;
+}
+
+static int gen_dir(const char* path) {
+	if (mkdir(path, 0755) < 0) {
+		return (errno == EEXIST) ? 0 : -1;
+	}
+
+	// what sits next to the tracks in a real library
+	char cover[PATH_MAX_LENGTH + 16];
+	snprintf(cover, sizeof(cover), "%s/folder.jpg", path);
+
+	int fd = open(cover, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd >= 0) {
+		ftruncate(fd, 20000);
+		close(fd);
+	}
+
+	return 0;
+}
+
+static int gen_file(const char* path) {
+	uint8_t hdr[WAV_CANONICAL_HEADER + GEN_JUNK_SIZE + 128];
+	uint16_t bits = gen_bits[rng() % (sizeof(gen_bits) / sizeof(*gen_bits))];
+	uint16_t channels = gen_channels[rng() % (sizeof(gen_channels) / sizeof(*gen_channels))];
+	uint32_t rate = gen_rates[rng() % (sizeof(gen_rates) / sizeof(*gen_rates))];
+	uint32_t seconds = 30 + rng() % 390;
+	uint32_t data_size = seconds * rate * channels * (bits / 8);
+	size_t len = gen_header(hdr, rng() % LAYOUT_COUNT, channels, bits, rate, data_size);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	// the samples are a hole, read back as silence
+	if (write(fd, hdr, len) != (ssize_t) len
+		|| ftruncate(fd, len + data_size + (data_size & 1)) < 0)
+	{
+		perror("write");
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+static int generate(const char* root, long files, uint32_t seed) {
+	char path[PATH_MAX_LENGTH];
+	long made = 0;
+
+	rng_state = seed ? seed : 1;
+
+	if (mkdir(root, 0755) < 0 && errno != EEXIST) {
+		perror("mkdir");
+		return -1;
+	}
+
+	for (; made < files; made++) {
+		int depth = rng() % (GEN_MAX_DEPTH + 1);
+		size_t len = snprintf(path, sizeof(path), "%s", root);
+
+		for (int d = 0; d < depth && len < sizeof(path) - 64; d++) {
+			len += snprintf(path + len, sizeof(path) - len, "/d%u", rng() % GEN_FANOUT);
+
+			if (gen_dir(path) < 0) {
+				perror("mkdir");
+				return -1;
+			}
+		}
+
+		snprintf(path + len, sizeof(path) - len, "/%06ld track.wav", made);
+
+		if (gen_file(path) < 0) {
+			return -1;
+		}
+	}
+
+	printf("%ld files generated in %s\n", made, root);
+
+	return 0;
+}
+
+/*	--- CACHE --- */
+
+static int remove_tree(const char* path) {
+	DIR* dir = opendir(path);
+
+	if (!dir) {
+		return unlink(path);
+	}
+
+	struct dirent* ent;
+
+	while ((ent = readdir(dir))) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+
+		char child[PATH_MAX_LENGTH];
+		snprintf(child, sizeof(child), "%s/%s", path, ent->d_name);
+		remove_tree(child);
+	}
+
+	closedir(dir);
+
+	return rmdir(path);
+}
+
+static void evict_tree(const char* path) {
+	DIR* dir = opendir(path);
+
+	if (!dir) {
+		int fd = open(path, O_RDONLY);
+
+		if (fd >= 0) {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+			close(fd);
+		}
+
+		return;
+	}
+
+	struct dirent* ent;
+
+	while ((ent = readdir(dir))) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+
+		char child[PATH_MAX_LENGTH];
+		snprintf(child, sizeof(child), "%s/%s", path, ent->d_name);
+		evict_tree(child);
+	}
+
+	closedir(dir);
+}
+
+// 1 when the whole page cache was dropped, 0 when only the data of the tree
+static int drop_caches(const char* root, const char* cache) {
+	sync();
+
+	int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+
+	if (fd >= 0) {
+		int ok = write(fd, "3", 1) == 1;
+		close(fd);
+
+		if (ok) {
+			return 1;
+		}
+	}
+
+	evict_tree(root);
+	evict_tree(cache);
+
+	return 0;
+}
+
+/*	--- RUNS --- */
+
+// the startup path of the player, in the child
+static void child_scan(const char* root, int threads, int out) {
+	struct library_index idx;
+	struct playlist pl;
+	struct scan_result res = {0};
+
+	playlist_init(&pl);
+
+	int64_t start = now_ns();
+
+	library_index_open(&idx, root, 1);
+	res.found = scan_library(root, 1, threads, &idx, &pl);
+	library_index_save(&idx, &pl);
+	library_index_close(&idx);
+
+	res.ns = now_ns() - start;
+	res.hits = idx.hits;
+
+	write(out, &res, sizeof(res));
+	playlist_free(&pl);
+}
+
+// counts the syscall stops of the child and of the threads it creates
+static long trace_syscalls(pid_t pid) {
+	int status;
+	long stops = 0;
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) {
+		return -1; // exited, PTRACE_TRACEME was refused
+	}
+
+	ptrace(PTRACE_SETOPTIONS, pid, 0,
+		PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+	ptrace(PTRACE_SYSCALL, pid, 0, 0);
+
+	for (;;) {
+		pid_t w = waitpid(-1, &status, __WALL);
+
+		if (w < 0) {
+			break; // no traced thread left
+		}
+
+		if (!WIFSTOPPED(status)) {
+			continue;
+		}
+
+		int sig = WSTOPSIG(status);
+
+		if (sig == (SIGTRAP | 0x80)) {
+			stops++;
+			sig = 0;
+		} else if (sig == SIGTRAP || sig == SIGSTOP) {
+			sig = 0; // clone event, or a new thread starting
+		}
+
+		ptrace(PTRACE_SYSCALL, w, 0, sig);
+	}
+
+	return stops / 2; // one stop on entry, one on exit
+}
+
+/*
+one scan in a child, timed or traced. fills res and the peak rss of the
+child, *syscalls is -1 when tracing isn't allowed here
+*/
+static int run_child(const char* root, int threads, int trace,
+	struct scan_result* res, long* rss_kb, long* syscalls)
+{
+	int fds[2];
+
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		return -1;
+	}
+
+	fflush(stdout);
+
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		perror("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		close(fds[0]);
+
+		if (trace) {
+			if (ptrace(PTRACE_TRACEME, 0, 0, 0) < 0) {
+				_exit(SCAN_NO_TRACE);
+			}
+
+			raise(SIGSTOP);
+		}
+
+		child_scan(root, threads, fds[1]);
+		_exit(0);
+	}
+
+	close(fds[1]);
+
+	if (trace) {
+		*syscalls = trace_syscalls(pid);
+	}
+
+	ssize_t n = read(fds[0], res, sizeof(*res));
+	close(fds[0]);
+
+	int status;
+	struct rusage ru = {0}; // a traced child was already reaped
+
+	if (wait4(pid, &status, 0, &ru) < 0 && errno != ECHILD) {
+		perror("wait4");
+		return -1;
+	}
+
+	*rss_kb = ru.ru_maxrss;
+
+	return (n == sizeof(*res)) ? 0 : -1;
+}
+
+// the index exists (and is up to date) or not, as the case needs
+static int prepare(const struct scan_case* sc, const char* root, const char* cache,
+	int threads, int* dropped)
+{
+	char dir[PATH_MAX_LENGTH];
+	snprintf(dir, sizeof(dir), "%s/nyplay", cache);
+	remove_tree(dir);
+
+	if (sc->index) {
+		struct scan_result res;
+		long rss, syscalls;
+
+		if (run_child(root, threads, 0, &res, &rss, &syscalls) < 0) {
+			return -1;
+		}
+	}
+
+	if (sc->cold) {
+		*dropped = drop_caches(root, cache);
+	} else {
+		// one untimed pass so everything the scan reads is cached
+		struct scan_result res;
+		long rss, syscalls;
+
+		if (!sc->index) {
+			run_child(root, threads, 0, &res, &rss, &syscalls);
+			remove_tree(dir);
+		}
+	}
+
+	return 0;
+}
+
+static void report(const struct scan_case* sc, int dropped, int threads, const struct scan_result* res,
+	long rss_kb, long syscalls, int json)
+{
+	const char* cache = sc->cold ? (dropped ? "cold" : "cold-data") : "warm";
+	double ms = res->ns / 1e6;
+	double files_per_s = res->found > 0 ? res->found / (res->ns / 1e9) : 0;
+	double per_file = (res->found > 0 && syscalls >= 0) ? (double) syscalls / res->found : -1;
+
+	if (json) {
+		printf("{\"case\":\"%s\",\"cache\":\"%s\",\"index\":%d,\"threads\":%d,\"files\":%d,"
+			"\"index_hits\":%zu,\"ms\":%.3f,\"files_per_s\":%.0f,\"syscalls_per_file\":",
+			sc->name, cache, sc->index, threads, res->found, res->hits, ms, files_per_s);
+
+		if (per_file >= 0) {
+			printf("%.2f", per_file);
+		} else {
+			printf("null");
+		}
+
+		printf(",\"peak_rss_kb\":%ld}\n", rss_kb);
+		return;
+	}
+
+	char sys[32] = "-";
+
+	if (per_file >= 0) {
+		snprintf(sys, sizeof(sys), "%.2f", per_file);
+	}
+
+	printf("%-11s %-9s %8d %8zu %10.1f %10.0f %9s %9ld\n", sc->name, cache,
+		res->found, res->hits, ms, files_per_s, sys, rss_kb);
+}
+
+static int run(const char* root, int threads, int json) {
+	char cache[PATH_MAX_LENGTH - 32];
+	const char* tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+
+	snprintf(cache, sizeof(cache), "%s/nyplay-scan-XXXXXX", tmp);
+
+	if (!mkdtemp(cache)) {
+		perror("mkdtemp");
+		return -1;
+	}
+
+	// the child's library index goes here instead of ~/.cache
+	setenv("XDG_CACHE_HOME", cache, 1);
+
+	if (!json) {
+		printf("%s, %d threads\n\n", root, threads);
+		printf("%-11s %-9s %8s %8s %10s %10s %9s %9s\n", "case", "cache",
+			"files", "hits", "ms", "files/s", "sys/file", "rss KiB");
+	}
+
+	int ret = 0;
+
+	for (size_t i = 0; i < sizeof(scan_cases) / sizeof(*scan_cases) && ret == 0; i++) {
+		const struct scan_case* sc = &scan_cases[i];
+		struct scan_result best = {0};
+		struct scan_result res;
+		long best_rss = 0;
+		long rss, syscalls = -1;
+		int dropped = 0;
+
+		for (int r = 0; r < (sc->cold ? 1 : SCAN_WARM_RUNS); r++) {
+			if (prepare(sc, root, cache, threads, &dropped) < 0
+				|| run_child(root, threads, 0, &res, &rss, &syscalls) < 0)
+			{
+				ret = -1;
+				break;
+			}
+
+			if (r == 0 || res.ns < best.ns) {
+				best = res;
+			}
+
+			if (rss > best_rss) {
+				best_rss = rss;
+			}
+		}
+
+		if (ret < 0) {
+			fprintf(stderr, "%s: scan failed\n", sc->name);
+			break;
+		}
+
+		// same preconditions again, traced this time
+		if (prepare(sc, root, cache, threads, &dropped) == 0) {
+			run_child(root, threads, 1, &res, &rss, &syscalls);
+		}
+
+		report(sc, dropped, threads, &best, best_rss, syscalls, json);
+	}
+
+	remove_tree(cache);
+
+	return ret;
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr, "usage: %s gen DIR FILES [SEED]\n", prog);
+	fprintf(stderr, "       %s run DIR [THREADS] [table|json]\n", prog);
+}
+
+int main(int argc, const char* argv[]) {
+	if (argc >= 4 && argc <= 5 && strcmp(argv[1], "gen") == 0) {
+		long files = atol(argv[3]);
+
+		if (files < 1) {
+			usage(argv[0]);
+			return 1;
+		}
+
+		return generate(argv[2], files, argc == 5 ? strtoul(argv[4], NULL, 10) : 1) < 0;
+	}
+
+	if (argc >= 3 && argc <= 5 && strcmp(argv[1], "run") == 0) {
+		int threads = (argc >= 4) ? atoi(argv[3]) : scan_default_threads();
+		int json = (argc == 5) && strcmp(argv[4], "json") == 0;
+
+		if (threads < 1 || (argc == 5 && !json && strcmp(argv[4], "table") != 0)) {
+			usage(argv[0]);
+			return 1;
+		}
+
+		return run(argv[2], threads, json) < 0;
+	}
+
+	usage(argv[0]);
+
+	return 1;
+}
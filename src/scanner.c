@@ -0,0 +1,479 @@
+#include "scanner.h"
+#include "fd_handle.h"
+#include "library_index.h"
+#include "cli_interface.h"
+#include "probe.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+struct scan_job {
+	char* path;
+	char* name;
+	struct stat sb;
+	int is_dir;
+};
+
+/*
+items[head, tail) are the queued jobs. the owner works on the tail (depth
+first, keeps its cache warm), thieves take from the head (the oldest jobs,
+usually whole directories, so a steal is worth it)
+*/
+struct scan_deque {
+	pthread_mutex_t lock;
+	struct scan_job* items;
+	size_t head;
+	size_t tail;
+	size_t cap;
+};
+
+struct scan_pool;
+
+struct scan_worker {
+	pthread_t thread;
+	size_t id;
+	struct scan_pool* pool;
+	struct scan_deque deque;
+	struct playlist results; // tracks taken from the index
+	struct playlist misses; // tracks whose header still has to be probed
+};
+
+struct scan_pool {
+	struct scan_worker* workers;
+	size_t nworkers;
+	int recursive;
+	struct library_index* idx;
+	_Atomic size_t pending; // jobs pushed and not finished yet
+	_Atomic size_t queued; // jobs sitting in a deque, nobody took them yet
+
+	// idle workers sleep here until a job is pushed or pending gets to 0
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	_Atomic size_t sleeping;
+};
+
+int scan_default_threads(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1) {
+		return 1;
+	}
+
+	return (n > SCAN_MAX_THREADS) ? SCAN_MAX_THREADS : (int) n;
+}
+
+// header fields of a freshly probed file
+static void track_from_wav(struct track* t, const struct wav_information* wav) {
+	size_t total_frames = wav->data_size / wav->frame_size;
+	t->duration = (double) total_frames / wav->sample_rate;
+
+	t->data_offset = wav->data_offset;
+	t->data_size = wav->data_size;
+	t->sample_rate = wav->sample_rate;
+	t->byte_rate = wav->byte_rate;
+	t->channels = wav->channels;
+	t->bits_per_sample = wav->bits_per_sample;
+	t->audio_format = wav->audio_format;
+}
+
+/*	--- DEQUE --- */
+
+static int deque_init(struct scan_deque* dq) {
+	dq->items = NULL;
+	dq->head = 0;
+	dq->tail = 0;
+	dq->cap = 0;
+
+	return pthread_mutex_init(&dq->lock, NULL) == 0 ? 0 : -1;
+}
+
+static void deque_free(struct scan_deque* dq) {
+	for (size_t i = dq->head; i < dq->tail; i++) {
+		free(dq->items[i].path);
+		free(dq->items[i].name);
+	}
+
+	free(dq->items);
+	pthread_mutex_destroy(&dq->lock);
+}
+
+static int deque_push(struct scan_deque* dq, struct scan_job job) {
+	pthread_mutex_lock(&dq->lock);
+
+	if (dq->tail == dq->cap) {
+		// slide the live part back to the start before growing
+		size_t len = dq->tail - dq->head;
+		memmove(dq->items, dq->items + dq->head, len * sizeof(*dq->items));
+		dq->head = 0;
+		dq->tail = len;
+
+		if (len * 2 >= dq->cap) {
+			size_t new_cap = dq->cap ? dq->cap * 2 : 64;
+			struct scan_job* items = realloc(dq->items, new_cap * sizeof(*items));
+
+			if (!items) {
+				pthread_mutex_unlock(&dq->lock);
+				return -1;
+			}
+
+			dq->items = items;
+			dq->cap = new_cap;
+		}
+	}
+
+	dq->items[dq->tail++] = job;
+	pthread_mutex_unlock(&dq->lock);
+
+	return 0;
+}
+
+static int deque_pop_back(struct scan_deque* dq, struct scan_job* job) {
+	int found = 0;
+	pthread_mutex_lock(&dq->lock);
+
+	if (dq->tail > dq->head) {
+		*job = dq->items[--dq->tail];
+		found = 1;
+	}
+
+	pthread_mutex_unlock(&dq->lock);
+
+	return found;
+}
+
+static int deque_steal_front(struct scan_deque* dq, struct scan_job* job) {
+	int found = 0;
+
+	// a busy victim is skipped instead of waited for
+	if (pthread_mutex_trylock(&dq->lock) != 0) {
+		return 0;
+	}
+
+	if (dq->tail > dq->head) {
+		*job = dq->items[dq->head++];
+		found = 1;
+	}
+
+	pthread_mutex_unlock(&dq->lock);
+
+	return found;
+}
+
+/*	--- WORKERS --- */
+
+static void push_job(struct scan_worker* w, const char* path, const char* name,
+	const struct stat* sb, int is_dir)
+{
+	struct scan_job job = {0};
+	job.path = strdup(path);
+	job.name = name ? strdup(name) : NULL;
+	job.sb = *sb;
+	job.is_dir = is_dir;
+
+	if (!job.path || (name && !job.name)) {
+		free(job.path);
+		free(job.name);
+		return;
+	}
+
+	struct scan_pool* pool = w->pool;
+
+	atomic_fetch_add(&pool->pending, 1);
+
+	if (deque_push(&w->deque, job) < 0) {
+		atomic_fetch_sub(&pool->pending, 1);
+		free(job.path);
+		free(job.name);
+		return;
+	}
+
+	/*
+	both seq_cst: either this sees the sleeper, or the sleeper sees the
+	job when it checks queued before waiting
+	*/
+	atomic_fetch_add(&pool->queued, 1);
+
+	if (atomic_load(&pool->sleeping) > 0) {
+		pthread_mutex_lock(&pool->idle_lock);
+		pthread_cond_signal(&pool->idle_cond);
+		pthread_mutex_unlock(&pool->idle_lock);
+	}
+}
+
+static void scan_dir(struct scan_worker* w, const char* path) {
+	DIR* dir = opendir(path);
+
+	if (!dir) {
+		return;
+	}
+
+	struct dirent* ent;
+
+	while ((ent = readdir(dir))) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+
+		char fullpath[PATH_MAX_LENGTH];
+		snprintf(fullpath, sizeof(fullpath), "%s/%s", path, ent->d_name);
+
+		struct stat sb;
+
+		if (stat(fullpath, &sb) != 0) {
+			continue;
+		}
+
+		if (S_ISDIR(sb.st_mode) && w->pool->recursive) {
+			push_job(w, fullpath, NULL, &sb, 1);
+		} else if (S_ISREG(sb.st_mode) && is_wav(ent->d_name)) {
+			push_job(w, fullpath, ent->d_name, &sb, 0);
+		}
+	}
+
+	closedir(dir);
+}
+
+static void run_job(struct scan_worker* w, struct scan_job* job) {
+	if (job->is_dir) {
+		scan_dir(w, job->path);
+	} else {
+		struct track t = {0};
+		struct library_index* idx = w->pool->idx;
+
+		// unchanged since the last scan: no need to open the file
+		int hit = idx && library_index_lookup(idx, job->path, &job->sb, &t) == 0;
+
+		if (!hit) {
+			track_set_file_info(&t, &job->sb);
+		}
+
+		t.path = job->path;
+		t.name = job->name;
+
+		if (playlist_push(hit ? &w->results : &w->misses, t) == 0) {
+			job->path = NULL; // owned by the track now
+			job->name = NULL;
+		}
+	}
+
+	free(job->path);
+	free(job->name);
+}
+
+static int find_job(struct scan_worker* w, struct scan_job* job) {
+	struct scan_pool* pool = w->pool;
+
+	if (deque_pop_back(&w->deque, job)) {
+		atomic_fetch_sub(&pool->queued, 1);
+		return 1;
+	}
+
+	for (size_t i = 1; i < pool->nworkers; i++) {
+		struct scan_worker* victim = &pool->workers[(w->id + i) % pool->nworkers];
+
+		if (deque_steal_front(&victim->deque, job)) {
+			atomic_fetch_sub(&pool->queued, 1);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void* scan_worker_main(void* arg) {
+	struct scan_worker* w = (struct scan_worker*) arg;
+	struct scan_pool* pool = w->pool;
+	struct scan_job job;
+
+	while (1) {
+		if (find_job(w, &job)) {
+			run_job(w, &job);
+
+			// the last job is done, everyone still waiting can leave
+			if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+				pthread_mutex_lock(&pool->idle_lock);
+				pthread_cond_broadcast(&pool->idle_cond);
+				pthread_mutex_unlock(&pool->idle_lock);
+			}
+
+			continue;
+		}
+
+		/*
+		nothing to steal: wait for a push instead of spinning, one worker
+		walking a deep directory would keep all the others at 100%
+		*/
+		pthread_mutex_lock(&pool->idle_lock);
+		atomic_fetch_add(&pool->sleeping, 1);
+
+		while (atomic_load(&pool->queued) == 0 && atomic_load(&pool->pending) > 0) {
+			pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+		}
+
+		atomic_fetch_sub(&pool->sleeping, 1);
+		pthread_mutex_unlock(&pool->idle_lock);
+
+		// nothing queued anywhere and nobody running a job that could add more
+		if (atomic_load(&pool->pending) == 0) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int compare_tracks(const void* a, const void* b) {
+	const struct track* ta = (const struct track*) a;
+	const struct track* tb = (const struct track*) b;
+
+	return strcmp(ta->path, tb->path);
+}
+
+int scan_library(const char* path, int recursive, int threads,
+	struct library_index* idx, struct playlist* pl)
+{
+	if (threads < 1) {
+		threads = 1;
+	} else if (threads > SCAN_MAX_THREADS) {
+		threads = SCAN_MAX_THREADS;
+	}
+
+	struct stat sb;
+
+	if (stat(path, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+		return -1;
+	}
+
+	struct scan_pool pool = {0};
+	pool.nworkers = threads;
+	pool.recursive = recursive;
+	pool.idx = idx;
+	atomic_init(&pool.pending, 0);
+	atomic_init(&pool.queued, 0);
+	atomic_init(&pool.sleeping, 0);
+	pool.workers = calloc(threads, sizeof(*pool.workers));
+
+	if (!pool.workers) {
+		perror("calloc");
+		return -1;
+	}
+
+	if (pthread_mutex_init(&pool.idle_lock, NULL) != 0
+		|| pthread_cond_init(&pool.idle_cond, NULL) != 0) {
+		fprintf(stderr, "failed to create the scan pool\n");
+		free(pool.workers);
+		return -1;
+	}
+
+	for (size_t i = 0; i < pool.nworkers; i++) {
+		pool.workers[i].id = i;
+		pool.workers[i].pool = &pool;
+		playlist_init(&pool.workers[i].results);
+		playlist_init(&pool.workers[i].misses);
+		deque_init(&pool.workers[i].deque);
+	}
+
+	push_job(&pool.workers[0], path, NULL, &sb, 1);
+
+	// the calling thread is worker 0
+	size_t started = 1;
+
+	for (; started < pool.nworkers; started++) {
+		struct scan_worker* w = &pool.workers[started];
+
+		if (pthread_create(&w->thread, NULL, scan_worker_main, w) != 0) {
+			break;
+		}
+	}
+
+	pool.nworkers = started; // fewer threads if some couldn't be created
+	scan_worker_main(&pool.workers[0]);
+
+	for (size_t i = 1; i < started; i++) {
+		pthread_join(pool.workers[i].thread, NULL);
+	}
+
+	size_t hits = 0;
+	size_t nmisses = 0;
+
+	for (int i = 0; i < threads; i++) {
+		hits += pool.workers[i].results.len;
+		nmisses += pool.workers[i].misses.len;
+	}
+
+	// every file the index couldn't answer, probed in one batch
+	struct probe_request* reqs = calloc(nmisses ? nmisses : 1, sizeof(*reqs));
+	struct track* missed = calloc(nmisses ? nmisses : 1, sizeof(*missed));
+
+	if (reqs && missed) {
+		size_t k = 0;
+
+		for (int i = 0; i < threads; i++) {
+			struct playlist* m = &pool.workers[i].misses;
+
+			for (size_t j = 0; j < m->len; j++, k++) {
+				missed[k] = m->items[j];
+				reqs[k].path = missed[k].path;
+			}
+
+			m->len = 0;
+		}
+
+		probe_batch(reqs, nmisses, threads);
+	} else {
+		perror("calloc");
+		nmisses = 0;
+	}
+
+	int found = 0;
+
+	for (int i = 0; i < threads; i++) {
+		struct scan_worker* w = &pool.workers[i];
+
+		for (size_t j = 0; j < w->results.len; j++) {
+			if (playlist_push(pl, w->results.items[j]) < 0) {
+				free(w->results.items[j].path);
+				free(w->results.items[j].name);
+				continue;
+			}
+
+			found++;
+		}
+
+		free(w->results.items);
+		playlist_free(&w->misses); // empty unless the probe arrays failed
+		deque_free(&w->deque);
+	}
+
+	for (size_t i = 0; i < nmisses; i++) {
+		if (reqs[i].status == 0) {
+			track_from_wav(&missed[i], &reqs[i].wav);
+
+			if (playlist_push(pl, missed[i]) == 0) {
+				found++;
+				continue;
+			}
+		} else {
+			fprintf(stderr, "reading wav failed: %s\n", missed[i].path);
+		}
+
+		free(missed[i].path);
+		free(missed[i].name);
+	}
+
+	free(reqs);
+	free(missed);
+	free(pool.workers);
+	pthread_mutex_destroy(&pool.idle_lock);
+	pthread_cond_destroy(&pool.idle_cond);
+
+	if (idx) {
+		idx->hits += hits;
+	}
+
+	qsort(pl->items, pl->len, sizeof(*pl->items), compare_tracks);
+
+	return found;
+}
@@ -0,0 +1,26 @@
+/*
+parallel library scanner
+
+directory traversal and header probing are jobs spread over a pool of
+worker threads. every worker owns a deque: it pushes and pops its own
+jobs at the back and, when it runs dry, steals from the front of the
+others. files the library index can't answer are probed afterwards in
+one probe_batch. results are merged into the playlist sorted by path, so
+the order doesn't depend on the number of threads or on timing
+*/
+
+#ifndef SCANNER_H
+#define SCANNER_H
+
+#include "types.h"
+
+#define SCAN_MAX_THREADS 64
+
+// default thread count: one per online cpu
+int scan_default_threads(void);
+
+// scans path into pl, returns the number of tracks found or -1
+int scan_library(const char* path, int recursive, int threads,
+	struct library_index* idx, struct playlist* pl);
+
+#endif
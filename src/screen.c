@@ -0,0 +1,277 @@
+#include "screen.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+// sgr parameters of every style, applied after a reset
+static const char* style_sgr[] = {
+	[STYLE_PLAIN] = "",
+	[STYLE_LABEL] = "4;37",
+	[STYLE_TRACK] = "36",
+	[STYLE_ON] = "34",
+	[STYLE_OFF] = "31",
+	[STYLE_BAR] = "33",
+	[STYLE_KEY] = "35",
+};
+
+// unchanged cells rewritten instead of moving the cursor over them
+#define SCREEN_SKIP_MAX 4
+
+static const struct screen_cell blank = { .ch = " ", .len = 1, .style = STYLE_PLAIN };
+
+static int cell_equal(const struct screen_cell* a, const struct screen_cell* b) {
+	return a->len == b->len && a->style == b->style && memcmp(a->ch, b->ch, a->len) == 0;
+}
+
+static void fill_blank(struct screen_cell cells[SCREEN_ROWS][SCREEN_COLS]) {
+	for (int r = 0; r < SCREEN_ROWS; r++) {
+		for (int c = 0; c < SCREEN_COLS; c++) {
+			cells[r][c] = blank;
+		}
+	}
+}
+
+void screen_invalidate(struct screen* scr) {
+	struct winsize ws;
+
+	scr->cols = SCREEN_COLS;
+
+	// the last column is left alone, writing there can wrap the line
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 1
+		&& ws.ws_col - 1 < SCREEN_COLS) {
+		scr->cols = ws.ws_col - 1;
+	}
+
+	scr->valid = 0;
+}
+
+void screen_begin(struct screen* scr) {
+	if (scr->cols == 0) {
+		screen_invalidate(scr);
+	}
+
+	fill_blank(scr->cells);
+	scr->row = 0;
+	scr->col = 0;
+	scr->style = STYLE_PLAIN;
+}
+
+void screen_style(struct screen* scr, enum screen_style style) {
+	scr->style = style;
+}
+
+void screen_puts(struct screen* scr, const char* text) {
+	for (const unsigned char* p = (const unsigned char*) text; *p; p++) {
+		if (*p == '\n') {
+			scr->row++;
+			scr->col = 0;
+			continue;
+		}
+
+		if (scr->row >= SCREEN_ROWS) {
+			return;
+		}
+
+		// continuation bytes belong to the glyph in the previous cell
+		if ((*p & 0xC0) == 0x80 && scr->col > 0 && scr->col <= scr->cols) {
+			struct screen_cell* prev = &scr->cells[scr->row][scr->col - 1];
+
+			if (prev->len < sizeof(prev->ch)) {
+				prev->ch[prev->len++] = *p;
+			}
+
+			continue;
+		}
+
+		if (scr->col < scr->cols) {
+			struct screen_cell* cell = &scr->cells[scr->row][scr->col];
+			cell->ch[0] = *p;
+			cell->len = 1;
+			cell->style = scr->style;
+		}
+
+		scr->col++; // past cols the line is cut, not wrapped
+	}
+}
+
+void screen_printf(struct screen* scr, const char* fmt, ...) {
+	char buf[SCREEN_COLS * 4 + 1];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	screen_puts(scr, buf);
+}
+
+/*	--- FLUSH --- */
+
+static int out_append(struct screen* scr, const char* bytes, size_t len) {
+	if (scr->out_len + len > scr->out_cap) {
+		size_t cap = scr->out_cap ? scr->out_cap : 4096;
+
+		while (cap < scr->out_len + len) {
+			cap *= 2;
+		}
+
+		char* out = realloc(scr->out, cap);
+
+		if (!out) {
+			perror("realloc");
+			return -1;
+		}
+
+		scr->out = out;
+		scr->out_cap = cap;
+	}
+
+	memcpy(scr->out + scr->out_len, bytes, len);
+	scr->out_len += len;
+
+	return 0;
+}
+
+static int out_format(struct screen* scr, const char* fmt, int a, int b) {
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), fmt, a, b);
+
+	return out_append(scr, buf, len);
+}
+
+static int out_style(struct screen* scr, uint8_t style) {
+	if (style == STYLE_PLAIN) {
+		return out_append(scr, "\033[0m", 4);
+	}
+
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "\033[0;%sm", style_sgr[style]);
+
+	return out_append(scr, buf, len);
+}
+
+static int row_blank_from(const struct screen_cell* row, int from, int cols) {
+	for (int c = from; c < cols; c++) {
+		if (!cell_equal(&row[c], &blank)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+walks the rows and emits the cells that differ from shown. the terminal
+cursor and color are tracked so a move or an sgr is only sent when the
+next cell needs it, short runs of unchanged cells are written over and
+a line that ends blank is cut with an erase to end of line
+*/
+ssize_t screen_flush(struct screen* scr) {
+	int cur_row = -1;
+	int cur_col = -1;
+	int cur_style = -1;
+
+	scr->out_len = 0;
+
+	if (!scr->valid) {
+		fill_blank(scr->shown);
+
+		if (out_append(scr, "\033[0m\033[H\033[J", 10) < 0) {
+			return -1;
+		}
+
+		cur_row = 0;
+		cur_col = 0;
+		cur_style = STYLE_PLAIN;
+	}
+
+	for (int r = 0; r < SCREEN_ROWS; r++) {
+		struct screen_cell* row = scr->cells[r];
+		struct screen_cell* shown = scr->shown[r];
+
+		for (int c = 0; c < scr->cols; c++) {
+			if (cell_equal(&row[c], &shown[c])) {
+				continue;
+			}
+
+			if (cur_row == r && cur_col < c && c - cur_col <= SCREEN_SKIP_MAX) {
+				c = cur_col; // cheaper to write the unchanged cells again
+			} else if (cur_row != r || cur_col != c) {
+				if (out_format(scr, "\033[%d;%dH", r + 1, c + 1) < 0) {
+					return -1;
+				}
+
+				cur_row = r;
+				cur_col = c;
+			}
+
+			if (row_blank_from(row, c, scr->cols)) {
+				if ((cur_style != STYLE_PLAIN && out_style(scr, STYLE_PLAIN) < 0)
+					|| out_append(scr, "\033[K", 3) < 0) {
+					return -1;
+				}
+
+				cur_style = STYLE_PLAIN;
+				memcpy(&shown[c], &row[c], (scr->cols - c) * sizeof(*row));
+				break;
+			}
+
+			if (row[c].style != cur_style) {
+				if (out_style(scr, row[c].style) < 0) {
+					return -1;
+				}
+
+				cur_style = row[c].style;
+			}
+
+			if (out_append(scr, row[c].ch, row[c].len) < 0) {
+				return -1;
+			}
+
+			shown[c] = row[c];
+			cur_col++;
+		}
+	}
+
+	if (scr->out_len == 0) {
+		return 0;
+	}
+
+	if (cur_style != STYLE_PLAIN && out_style(scr, STYLE_PLAIN) < 0) {
+		return -1;
+	}
+
+	// whatever printf left in stdio has to reach the terminal first
+	fflush(stdout);
+
+	size_t done = 0;
+
+	while (done < scr->out_len) {
+		ssize_t n = write(STDOUT_FILENO, scr->out + done, scr->out_len - done);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			scr->valid = 0;
+			return -1;
+		}
+
+		done += n;
+	}
+
+	scr->valid = 1;
+
+	return done;
+}
+
+void screen_free(struct screen* scr) {
+	free(scr->out);
+	scr->out = NULL;
+	scr->out_len = 0;
+	scr->out_cap = 0;
+}
@@ -0,0 +1,29 @@
+/*
+retained terminal renderer for the player ui
+
+the ui is drawn into a grid of cells instead of straight to stdout.
+screen_flush compares it with the grid the terminal already shows and
+sends only the cells that changed (cursor moves, colors and text) in one
+write(). a frame that looks the same as the last one costs nothing
+*/
+
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include "types.h"
+
+// next flush clears the terminal and draws everything (something else wrote to it)
+void screen_invalidate(struct screen* scr);
+
+// empty frame, drawing starts at the top left
+void screen_begin(struct screen* scr);
+void screen_style(struct screen* scr, enum screen_style style);
+void screen_puts(struct screen* scr, const char* text);
+void screen_printf(struct screen* scr, const char* fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+// returns the bytes written, 0 when nothing changed and -1 on error
+ssize_t screen_flush(struct screen* scr);
+void screen_free(struct screen* scr);
+
+#endif
@@ -1,115 +1,1552 @@
 #include "types.h"
 #include "sound_engine.h"
-#include <limits.h>
+#include "fd_handle.h"
+#include "resampler.h"
+#include "output.h"
+#include "stats.h"
+#include "convert.h"
+#include "limiter.h"
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
-static inline int32_t clamp_s32(int64_t v) {
-	if (v > INT32_MAX) {
-		return INT32_MAX;
+#define AUDIO_MAX_POLL_FDS 16 // wake_fd + the pcm's own descriptors
+
+/*
+frames still in the ring. each run is counted in the frame size it was
+queued in: the ring can still hold a crossfade in s32, or the end of the
+previous track, after the reader moved on to another format
+*/
+static uint64_t audio_queued_frames(struct audio_thread* at) {
+	size_t tail = atomic_load_explicit(&at->ring.tail, memory_order_acquire);
+	size_t head = audio_ring_position(&at->ring);
+	uint64_t queued = 0;
+
+	for (size_t i = 0; i < at->queued_len; i++) {
+		size_t start = at->queued[i].position;
+		size_t end = (i + 1 < at->queued_len) ? at->queued[i + 1].position : head;
+
+		// positions behind tail (unsigned difference wrapped) were already played
+		if (start - tail > head - tail) {
+			start = tail;
+		}
+
+		if (end - tail > head - tail) {
+			continue;
+		}
+
+		queued += (end - start) / at->queued[i].frame_size;
+	}
+
+	return queued;
+}
+
+/*
+frame of the current track being heard: the reader is ahead of it by
+what the ring and the device still hold. a crossfade queues a frame of
+s32 per frame of the track
+*/
+uint64_t audio_heard_frames(struct player_state* st) {
+	uint64_t queued = audio_queued_frames(&st->audio);
+
+	queued += atomic_load_explicit(&st->audio.delay_ns, memory_order_relaxed)
+		* st->wav.sample_rate / 1000000000;
+
+	return (queued < st->wav.frames_played) ? st->wav.frames_played - queued : 0;
+}
+
+/*
+asks for the audio around both seek targets (SEEK_STEP_S away from what
+is heard), so the read after a seek finds it in memory instead of
+waiting on the disk. called again every half prefetch window, the
+target of a seek is always inside what was asked for
+*/
+static void seek_prefetch(struct player_state* st) {
+	struct wav_information* wav = &st->wav;
+	uint64_t heard = audio_heard_frames(st);
+	uint64_t step = (uint64_t) SEEK_STEP_S * wav->sample_rate;
+	size_t bytes = (size_t) wav->byte_rate * SEEK_PREFETCH_MS / 1000;
+
+	wav_prefetch(st->fd, wav, (heard + step) * wav->frame_size, bytes);
+	wav_prefetch(st->fd, wav, (heard > step ? heard - step : 0) * wav->frame_size, bytes);
+	wav->prefetched = wav->frames_played;
+}
+
+// moves the reader offset frames away from what is heard
+int apply_offset(struct player_state* st, int64_t offset) {
+	int64_t new_frame_pos = (int64_t) audio_heard_frames(st) + offset;
+	int64_t total_frames = (int64_t) st->wav.data_size / st->wav.frame_size;
+
+	if (new_frame_pos < 0) {
+		new_frame_pos = 0;
+	} else if (new_frame_pos > total_frames) {
+		new_frame_pos = total_frames;
+	}
+
+	if (st->wav.data) { // mmap reader: seeking is just moving frames_played
+		st->wav.advised = 0;
+		wav_map_advise(&st->wav, new_frame_pos * st->wav.frame_size);
+	} else {
+		off_t byte_offset = st->wav.data_offset + (uint64_t) new_frame_pos * st->wav.frame_size;
+
+		if (lseek(st->fd, byte_offset, SEEK_SET) == -1) {
+			perror("lseek");
+			return -1;
+		}
+	}
+
+	st->wav.frames_played = new_frame_pos;
+
+	st->wav.frames_left = total_frames - st->wav.frames_played;
+	seek_prefetch(st);
+
+	return 0;
+}
+
+/*
+single pass from the file's samples to what the device gets: the fused
+kernel converts, applies gain and saturates, unity gain only converts
+*/
+void convert_frames(const struct stream_format* fmt, int32_t* dst,
+	const uint8_t* src, size_t frames, float gain)
+{
+	size_t samples = frames * fmt->channels;
+
+	if (gain == 1.0f) {
+		fmt->convert(dst, src, samples);
+	} else {
+		fmt->convert_gain(dst, src, samples, gain);
+	}
+}
+
+/*	--- DEVICE --- */
+
+// gain is the only processing there is, anything else needs S32 too
+static int audio_needs_processing(float gain) {
+	return gain != 1.0f;
+}
+
+// what the device would get without any conversion, float always goes through the saturating conversion
+static snd_pcm_format_t native_pcm_format(const struct stream_format* fmt) {
+	if (fmt->audio_format != WAV_FORMAT_PCM) {
+		return SND_PCM_FORMAT_UNKNOWN;
+	}
+
+	switch (fmt->bits_per_sample) {
+		case 8:
+			return SND_PCM_FORMAT_U8;
+		case 16:
+			return SND_PCM_FORMAT_S16_LE;
+		case 24:
+			return SND_PCM_FORMAT_S24_3LE;
+		case 32:
+			return SND_PCM_FORMAT_S32_LE;
+		default:
+			return SND_PCM_FORMAT_UNKNOWN;
+	}
+}
+
+/*
+the seek buffers follow the device format: history holds as much as the
+device buffer (none when it can't be rewound anyway), fade
+SEEK_XFADE_MS of frames and faded a period. whatever they held belongs
+to the old format, it's dropped
+*/
+static int audio_seek_buffers(struct audio_thread* at, const struct output* out,
+	unsigned int channels, unsigned int rate)
+{
+	size_t history_cap = out->buffer_frames * out->frame_bytes;
+	size_t xfade = (size_t) rate * SEEK_XFADE_MS / 1000;
+	uint8_t* history = realloc(at->history, history_cap ? history_cap : 1);
+	int32_t* fade = realloc(at->fade, xfade * channels * sizeof(int32_t));
+	uint8_t* faded = realloc(at->faded, FRAMES_PER_TICK * channels * sizeof(int32_t));
+
+	if (history) {
+		at->history = history;
+	}
+
+	if (fade) {
+		at->fade = fade;
+	}
+
+	if (faded) {
+		at->faded = faded;
+	}
+
+	at->history_cap = history ? history_cap : 0;
+	at->history_frame_bytes = out->frame_bytes;
+	at->history_end = 0;
+	at->history_len = 0;
+	at->fade_len = 0;
+	at->fade_frames = 0;
+	at->fade_pos = 0;
+	at->faded_len = 0;
+	at->faded_pos = 0;
+
+	if (!history || !fade || !faded) {
+		perror("realloc");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void audio_seek_buffers_free(struct audio_thread* at) {
+	free(at->history);
+	free(at->fade);
+	free(at->faded);
+	at->history = NULL;
+	at->fade = NULL;
+	at->faded = NULL;
+	at->history_cap = 0;
+	at->history_len = 0;
+}
+
+/*
+the output is opened on the first play and kept until audio_close. hw_params
+are only set again when they can't carry fmt: other channels or another
+rate, or a passthrough format that isn't the track's (S32 carries every
+track, so a track change never needs it). passthrough asks for the
+track's own sample format when the device takes it, which skips the
+conversion. before changing hw_params the stream has to be stopped: it's
+drained, or dropped after a skip
+*/
+static int audio_device_configure(struct player_state* st,
+	const struct stream_format* fmt, int passthrough, int drain)
+{
+	struct audio_device* dev = &st->device;
+	struct output* out = &st->output;
+	snd_pcm_format_t native = native_pcm_format(fmt);
+
+	if (!out->opened) {
+		if (out->ops->open(out) < 0) {
+			return -1;
+		}
+
+		out->opened = 1;
+		dev->channels = 0;
+		dev->rate = 0;
+	}
+
+	if (dev->channels == fmt->channels && dev->rate == fmt->sample_rate) {
+		if (!dev->passthrough || (passthrough && dev->format == native)) {
+			return 0;
+		}
+	}
+
+	if (dev->channels != 0) {
+		if (drain) {
+			out->ops->drain(out);
+		} else {
+			out->ops->drop(out);
+		}
+	}
+
+	dev->channels = 0;
+	dev->rate = 0;
+	dev->passthrough = 0;
+	dev->format = SND_PCM_FORMAT_S32_LE;
+
+	if (passthrough && native != SND_PCM_FORMAT_UNKNOWN && out->ops->supports(out, native)
+		&& out->ops->configure(out, dev, native, fmt->channels, fmt->sample_rate) == 0) {
+		dev->passthrough = 1;
+		dev->format = native;
+	} else if (out->ops->configure(out, dev, SND_PCM_FORMAT_S32_LE,
+		fmt->channels, fmt->sample_rate) < 0) {
+		return -1;
+	}
+
+	dev->channels = fmt->channels;
+	dev->rate = fmt->sample_rate;
+
+	return audio_seek_buffers(&st->audio, out, fmt->channels, fmt->sample_rate);
+}
+
+/*
+pausing keeps what is in the device buffer for the resume. devices that
+can't pause just run dry, the underrun is recovered on the next write
+*/
+static void audio_device_pause(struct player_state* st, int pause) {
+	if (st->device.can_pause) {
+		st->output.ops->pause(&st->output, pause);
+	}
+}
+
+// out_rate 0 turns resampling off. a resampler with the same parameters is kept
+static int audio_resampler_setup(struct audio_thread* at, const struct stream_format* fmt,
+	uint32_t out_rate, enum resample_quality quality)
+{
+	struct resampler* rs = &at->resampler;
+
+	if (at->resampling && out_rate && rs->in_rate == fmt->sample_rate
+		&& rs->out_rate == out_rate && rs->channels == fmt->channels
+		&& rs->quality == quality) {
+		return 0;
+	}
+
+	if (at->resampling) {
+		resampler_free(rs);
+		at->resampling = 0;
+	}
+
+	if (out_rate == 0) {
+		return 0;
+	}
+
+	if (resampler_init(rs, fmt->sample_rate, out_rate, fmt->channels, quality) < 0) {
+		return -1;
+	}
+
+	int32_t* resampled = realloc(at->resampled,
+		FRAMES_PER_TICK * fmt->channels * sizeof(int32_t));
+
+	if (!resampled) {
+		perror("realloc");
+		resampler_free(rs);
+		return -1;
+	}
+
+	at->resampled = resampled;
+	at->resampled_len = 0;
+	at->resampled_pos = 0;
+	at->resample_block = resampler_block(rs, FRAMES_PER_TICK);
+	at->resampling = 1;
+
+	return 0;
+}
+
+static void audio_resampler_release(struct audio_thread* at) {
+	if (at->resampling) {
+		resampler_free(&at->resampler);
+		at->resampling = 0;
+	}
+
+	free(at->resampled);
+	at->resampled = NULL;
+	at->resampled_len = 0;
+	at->resampled_pos = 0;
+}
+
+/*
+picks what the device runs at for fmt. when resampling is on, a track
+with the device's channels at another rate keeps the device as it is and
+goes through the resampler (always S32), anything else gets hw_params
+for the track itself
+*/
+static int audio_route(struct player_state* st, const struct stream_format* fmt,
+	float gain, enum resample_quality quality, unsigned int crossfade_ms, int drain)
+{
+	struct stream_format device_fmt = *fmt;
+	uint32_t rate = st->device.rate;
+	int resample = quality != RESAMPLE_OFF && st->output.opened
+		&& st->device.channels == fmt->channels && rate != 0 && rate != fmt->sample_rate;
+
+	if (resample && audio_resampler_setup(&st->audio, fmt, rate, quality) == 0) {
+		device_fmt.sample_rate = rate;
+	} else {
+		audio_resampler_setup(&st->audio, fmt, 0, RESAMPLE_OFF);
+		resample = 0;
+	}
+
+	// a crossfade queues s32, with passthrough the device would be reconfigured in the middle of it
+	return audio_device_configure(st, &device_fmt,
+		!resample && !audio_needs_processing(gain * fmt->gain) && crossfade_ms == 0, drain);
+}
+
+/*	--- AUDIO THREAD --- */
+
+/*
+commands are applied between two periods, so the worst case latency of
+a volume change, seek or pause is one period plus what is already queued
+inside the device
+*/
+
+int audio_send_command(struct player_state* st, const struct audio_command* cmd) {
+	if (!st->audio.started) {
+		return -1;
+	}
+
+	struct timespec ts = {
+		.tv_sec = 0,
+		.tv_nsec = 1000 * 1000
+	};
+
+	// the queue only fills up if the audio thread is stuck on the device
+	while (command_queue_push(&st->audio.commands, cmd) < 0) {
+		nanosleep(&ts, NULL);
+	}
+
+	eventfd_write(st->audio.wake_fd, 1);
+
+	return 0;
+}
+
+/*	--- WAKEUPS --- */
+
+/*
+nobody sleeps on a timer: the audio thread waits in poll on wake_fd (and
+the pcm's descriptors when the device is full), the main thread on
+space_fd, stdin and the ui timer. want_data and want_space say someone
+is asleep, so the other side only pays for an eventfd write then. the
+fences order the flag against the ring position on both sides, else
+both could miss each other and sleep forever
+*/
+
+// producer side, after frames were queued
+static void audio_notify_data(struct audio_thread* at) {
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (atomic_exchange(&at->want_data, 0)) {
+		eventfd_write(at->wake_fd, 1);
+	}
+}
+
+// consumer side, wakes the main thread once half of the ring is free
+static void audio_notify_space(struct audio_thread* at) {
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (!atomic_load_explicit(&at->want_space, memory_order_relaxed)
+		|| audio_ring_writable(&at->ring) < at->ring.size / 2) {
+		return;
+	}
+
+	if (atomic_exchange(&at->want_space, 0)) {
+		eventfd_write(at->space_fd, 1);
+	}
+}
+
+/*
+called by the main thread with the ring full, before sleeping on
+space_fd. returns 0 when half the ring is free already, there's nothing
+to wait for then
+*/
+int audio_want_space(struct player_state* st) {
+	struct audio_thread* at = &st->audio;
+
+	atomic_store(&at->want_space, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (audio_ring_writable(&at->ring) >= at->ring.size / 2) {
+		atomic_store(&at->want_space, 0);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+the audio thread sleeps until a command comes, or frames with want_data
+set, or (device) until the pcm has room again
+*/
+static void audio_wait(struct player_state* st, int device) {
+	struct audio_thread* at = &st->audio;
+	struct pollfd fds[AUDIO_MAX_POLL_FDS];
+	int count = 0;
+
+	fds[0].fd = at->wake_fd;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+
+	if (device) {
+		count = snd_pcm_poll_descriptors(st->output.pcm, fds + 1, AUDIO_MAX_POLL_FDS - 1);
+		count = (count < 0) ? 0 : count;
+	}
+
+	if (poll(fds, count + 1, -1) <= 0) {
+		return;
+	}
+
+	if (fds[0].revents & POLLIN) {
+		eventfd_t value;
+		eventfd_read(at->wake_fd, &value);
+	}
+
+	if (count > 0) {
+		// some plugins (dmix) need this to acknowledge the wakeup
+		unsigned short revents;
+		snd_pcm_poll_descriptors_revents(st->output.pcm, fds + 1, count, &revents);
+	}
+}
+
+// waits for frames, unless they came in between
+static void audio_wait_data(struct player_state* st) {
+	struct audio_thread* at = &st->audio;
+
+	atomic_store(&at->want_data, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	if (audio_ring_readable(&at->ring) < at->format.frame_size) {
+		audio_wait(st, 0);
+	}
+
+	atomic_store(&at->want_data, 0);
+}
+
+/*
+a RW write blocks until the device has room for all of it, and commands
+wait for the write. so the thread waits for the room itself, on wake_fd
+too, and a seek or a pause doesn't wait behind a period. a stream that
+isn't running yet fills up first (mmap waits in audio_mmap_begin).
+returns 1 when it waited
+*/
+static int audio_wait_room(struct player_state* st) {
+	struct output* out = &st->output;
+
+	if (st->device.mmap || out->buffer_frames == 0
+		|| (out->pcm && snd_pcm_state(out->pcm) != SND_PCM_STATE_RUNNING)) {
+		return 0;
+	}
+
+	long delay = out->ops->delay(out);
+
+	if (delay < 0 || (size_t) delay + FRAMES_PER_TICK <= out->buffer_frames) {
+		return 0;
+	}
+
+	size_t missing = delay + FRAMES_PER_TICK - out->buffer_frames;
+	struct pollfd fd = {
+		.fd = st->audio.wake_fd,
+		.events = POLLIN
+	};
+
+	if (poll(&fd, 1, missing * 1000 / out->rate + 1) > 0) {
+		eventfd_t value;
+		eventfd_read(st->audio.wake_fd, &value);
+	}
+
+	return 1;
+}
+
+int audio_set_gain(struct player_state* st, float gain) {
+	struct audio_command cmd = {
+		.type = AUDIO_CMD_GAIN,
+		.gain = gain
+	};
+
+	return audio_send_command(st, &cmd);
+}
+
+int audio_set_paused(struct player_state* st, int paused) {
+	struct audio_command cmd = {
+		.type = paused ? AUDIO_CMD_PAUSE : AUDIO_CMD_RESUME
+	};
+
+	return audio_send_command(st, &cmd);
+}
+
+// drop the frames decoded so far (seek, track change)
+int audio_flush(struct player_state* st) {
+	struct audio_command cmd = {
+		.type = AUDIO_CMD_FLUSH,
+		.position = audio_ring_position(&st->audio.ring)
+	};
+
+	return audio_send_command(st, &cmd);
+}
+
+/*
+moves the reader offset frames away from what is heard and drops the
+old position everywhere, the device buffer included. time starts at the
+key press, the audio thread counts until the first new frame is heard
+*/
+int audio_seek(struct player_state* st, int64_t offset) {
+	uint64_t start = stats_now_ns();
+
+	if (apply_offset(st, offset) < 0) {
+		return -1;
+	}
+
+	struct audio_command cmd = {
+		.type = AUDIO_CMD_SEEK,
+		.position = audio_ring_position(&st->audio.ring),
+		.time = start
+	};
+
+	return audio_send_command(st, &cmd);
+}
+
+// the frames queued from now on are in the format of wav (track change)
+int audio_set_format(struct player_state* st, const struct stream_format* fmt) {
+	struct audio_thread* at = &st->audio;
+	struct audio_command cmd = {
+		.type = AUDIO_CMD_FORMAT,
+		.position = audio_ring_position(&at->ring),
+		.format = *fmt,
+		.resample_quality = st->resample_quality,
+		.crossfade_ms = st->crossfade_ms
+	};
+
+	// the runs the audio thread is done with, the one at tail is kept
+	size_t tail = atomic_load_explicit(&at->ring.tail, memory_order_acquire);
+	size_t done = 0;
+
+	while (done + 1 < at->queued_len
+		&& at->queued[done + 1].position - tail > cmd.position - tail)
+	{
+		done++;
+	}
+
+	while (done + 1 < at->queued_len && at->queued[done + 1].position == tail) {
+		done++;
+	}
+
+	if (done == 0 && at->queued_len == COMMAND_QUEUE_SIZE) {
+		done = 1; // only miscounts until the oldest run is played
+	}
+
+	at->queued_len -= done;
+	memmove(at->queued, at->queued + done, at->queued_len * sizeof(at->queued[0]));
+	at->queued[at->queued_len++] = (struct ring_format) {cmd.position, fmt->frame_size};
+
+	return audio_send_command(st, &cmd);
+}
+
+static int audio_use_format(struct audio_thread* at, const struct stream_format* fmt) {
+	if (fmt->channels > at->period_channels) {
+		int32_t* period = realloc(at->period,
+			FRAMES_PER_TICK * fmt->channels * sizeof(int32_t));
+		uint8_t* split_frame = realloc(at->split_frame,
+			fmt->channels * sizeof(int32_t));
+		uint8_t* ahead_raw = realloc(at->ahead_raw,
+			LIMITER_LOOKAHEAD * fmt->channels * sizeof(int32_t));
+		int32_t* ahead = realloc(at->ahead,
+			LIMITER_LOOKAHEAD * fmt->channels * sizeof(int32_t));
+
+		if (period) {
+			at->period = period;
+		}
+
+		if (split_frame) {
+			at->split_frame = split_frame;
+		}
+
+		if (ahead_raw) {
+			at->ahead_raw = ahead_raw;
+		}
+
+		if (ahead) {
+			at->ahead = ahead;
+		}
+
+		if (!period || !split_frame || !ahead_raw || !ahead) {
+			perror("realloc");
+			return -1;
+		}
+
+		at->period_channels = fmt->channels;
+	}
+
+	if (limiter_setup(&at->limiter, fmt->channels, fmt->sample_rate) < 0) {
+		return -1;
+	}
+
+	at->format = *fmt;
+
+	return 0;
+}
+
+static void audio_period_free(struct audio_thread* at) {
+	free(at->period);
+	free(at->split_frame);
+	free(at->ahead_raw);
+	free(at->ahead);
+	limiter_free(&at->limiter);
+
+	at->period = NULL;
+	at->split_frame = NULL;
+	at->ahead_raw = NULL;
+	at->ahead = NULL;
+	at->period_channels = 0;
+}
+
+// pending formats whose position the tail reached or went past
+static size_t audio_formats_reached(const struct audio_thread* at) {
+	size_t tail = atomic_load_explicit(&at->ring.tail, memory_order_relaxed);
+	size_t done = 0;
+
+	while (done < at->pending_len && at->pending[done].position - tail > at->ring.size) {
+		// position is behind tail (unsigned difference wrapped)
+		done++;
+	}
+
+	while (done < at->pending_len && at->pending[done].position == tail) {
+		done++;
+	}
+
+	return done;
+}
+
+/*
+switches to every pending format whose position was reached. after a
+flush the tail can jump over several of them, the last one wins
+*/
+static int audio_apply_formats(struct player_state* st, float gain) {
+	struct audio_thread* at = &st->audio;
+	size_t done = audio_formats_reached(at);
+
+	if (done == 0) {
+		return 0;
+	}
+
+	const struct audio_command* cmd = &at->pending[done - 1];
+	const struct stream_format* fmt = &cmd->format;
+
+	// the end of the previous track is still played in its own format, unless skipped
+	if (audio_route(st, fmt, gain, cmd->resample_quality, cmd->crossfade_ms, !at->flushed) < 0) {
+		fprintf(stderr, "pcm reconfiguration failed\n");
+		return -1;
+	}
+
+	if (audio_use_format(at, fmt) < 0) {
+		return -1;
+	}
+
+	at->pending_len -= done;
+	memmove(at->pending, at->pending + done, at->pending_len * sizeof(at->pending[0]));
+
+	return 0;
+}
+
+// frames at the ring tail, up to max and never past the next pending format
+static size_t audio_frames_ready(struct audio_thread* at, size_t max_frames) {
+	size_t available = audio_ring_readable(&at->ring);
+
+	if (at->pending_len > 0) {
+		size_t tail = atomic_load_explicit(&at->ring.tail, memory_order_relaxed);
+		size_t until = at->pending[0].position - tail;
+
+		if (until < available) {
+			available = until;
+		}
+	}
+
+	size_t frames = available / at->format.frame_size;
+
+	return (frames > max_frames) ? max_frames : frames;
+}
+
+// at unity gain, or headroom down for a float source (its overs are kept for the limiter)
+static void convert_for_limiter(const struct stream_format* fmt, int32_t* dst,
+	const uint8_t* src, size_t frames, float headroom)
+{
+	if (headroom != 1.0f) {
+		fmt->convert_gain(dst, src, frames * fmt->channels, 1.0f / headroom);
+	} else {
+		fmt->convert(dst, src, frames * fmt->channels);
+	}
+}
+
+/*
+converts up to max_frames frames from the ring tail into dst, straight
+from the ring memory. with passthrough the device takes the file's own
+format and the frames are only copied. while the limiter is engaged the
+frames are converted without gain and it applies the gain, looking at the
+frames that follow in the ring without taking them
+*/
+static size_t audio_convert(struct player_state* st, void* dst,
+	size_t max_frames, float gain, int passthrough)
+{
+	struct audio_thread* at = &st->audio;
+	const struct stream_format* fmt = &at->format;
+	size_t frames = audio_frames_ready(at, max_frames);
+	uint64_t start = stats_now_ns();
+	size_t out_frame = passthrough ? fmt->frame_size : fmt->channels * sizeof(int32_t);
+	size_t done = 0;
+
+	limiter_set_gain(&at->limiter, gain);
+
+	int limit = !passthrough && limiter_engaged(&at->limiter);
+	float headroom = (fmt->audio_format == WAV_FORMAT_FLOAT) ? LIMITER_FLOAT_HEADROOM : 1.0f;
+
+	while (done < frames) {
+		const uint8_t* src;
+		size_t contiguous = audio_ring_peek(&at->ring, &src) / fmt->frame_size;
+
+		if (contiguous == 0) { // the next frame crosses the end of the ring
+			audio_ring_read(&at->ring, at->split_frame, fmt->frame_size);
+			src = at->split_frame;
+			contiguous = 1;
+		} else {
+			if (contiguous > frames - done) {
+				contiguous = frames - done;
+			}
+
+			audio_ring_advance(&at->ring, contiguous * fmt->frame_size);
+		}
+
+		uint8_t* out = (uint8_t*) dst + done * out_frame;
+
+		if (passthrough) {
+			memcpy(out, src, contiguous * fmt->frame_size);
+		} else if (limit) {
+			convert_for_limiter(fmt, (int32_t*) out, src, contiguous, headroom);
+		} else {
+			convert_frames(fmt, (int32_t*) out, src, contiguous, gain);
+		}
+
+		done += contiguous;
+	}
+
+	if (limit && frames > 0) {
+		size_t ahead = audio_frames_ready(at, LIMITER_LOOKAHEAD);
+
+		audio_ring_copy(&at->ring, at->ahead_raw, ahead * fmt->frame_size);
+		convert_for_limiter(fmt, at->ahead, at->ahead_raw, ahead, headroom);
+		limiter_process(&at->limiter, dst, frames, at->ahead, ahead, headroom);
+	}
+
+	if (frames > 0) {
+		stats_since(&st->stats, STAT_CONVERT, start);
+	}
+
+	return frames;
+}
+
+// keeps the newest frames given to the device, for a seek to fade them out
+static void audio_history_push(struct audio_thread* at, const void* buf, size_t frames) {
+	const uint8_t* src = buf;
+	size_t bytes = frames * at->history_frame_bytes;
+	size_t cap = at->history_cap;
+
+	if (cap == 0) {
+		return;
+	}
+
+	if (bytes > cap) {
+		src += bytes - cap;
+		bytes = cap;
+	}
+
+	size_t first = (bytes < cap - at->history_end) ? bytes : cap - at->history_end;
+
+	memcpy(at->history + at->history_end, src, first);
+	memcpy(at->history, src + first, bytes - first);
+	at->history_end = (at->history_end + bytes) % cap;
+	at->history_len = (at->history_len + bytes < cap) ? at->history_len + bytes : cap;
+}
+
+// one period reached the device: count it and look at how much it holds
+static void audio_period_done(struct player_state* st, const void* buf, size_t frames) {
+	long delay = st->output.ops->delay(&st->output);
+
+	audio_history_push(&st->audio, buf, frames);
+	stats_period(&st->stats);
+
+	if (delay >= 0 && st->device.rate > 0) {
+		uint64_t ns = (uint64_t) delay * 1000000000 / st->device.rate;
+
+		stats_add(&st->stats.hist[STAT_DELAY], ns);
+		atomic_store_explicit(&st->audio.delay_ns, ns, memory_order_relaxed);
+	}
+}
+
+static int audio_write(struct player_state* st, const void* buf, size_t frames) {
+	uint64_t start = stats_now_ns();
+	int ret = st->output.ops->write(&st->output, buf, frames);
+
+	stats_since(&st->stats, STAT_WRITE, start);
+
+	if (ret == 0) {
+		audio_period_done(st, buf, frames);
+	}
+
+	return ret;
+}
+
+// snd_pcm_recover for the mmap path, underruns are counted on the way
+static int audio_recover(struct player_state* st, int err) {
+	if (err == -EPIPE) {
+		stats_xrun(&st->stats);
+	}
+
+	return snd_pcm_recover(st->output.pcm, err, 1) < 0 ? -1 : 0;
+}
+
+// RW passthrough: writei takes the frames straight from the ring memory
+static int audio_rw_passthrough(struct player_state* st) {
+	struct audio_thread* at = &st->audio;
+	size_t frame_size = at->format.frame_size;
+	size_t frames = audio_frames_ready(at, FRAMES_PER_TICK);
+
+	if (frames == 0) {
+		return 0;
+	}
+
+	const uint8_t* src;
+	size_t contiguous = audio_ring_peek(&at->ring, &src) / frame_size;
+
+	if (contiguous == 0) { // the next frame crosses the end of the ring
+		audio_ring_read(&at->ring, at->split_frame, frame_size);
+		return audio_write(st, at->split_frame, 1);
+	}
+
+	if (contiguous > frames) {
+		contiguous = frames;
+	}
+
+	// tail only moves once the device has the frames, so they can't be overwritten
+	int ret = audio_write(st, src, contiguous);
+	audio_ring_advance(&at->ring, contiguous * frame_size);
+
+	return ret;
+}
+
+// RW access: convert into period, then writei copies it to the device
+static int audio_rw_period(struct player_state* st, float gain) {
+	struct audio_thread* at = &st->audio;
+
+	if (st->device.passthrough) {
+		return audio_rw_passthrough(st);
+	}
+
+	size_t frames = audio_convert(st, at->period, FRAMES_PER_TICK, gain, 0);
+
+	if (frames == 0) {
+		return 0;
+	}
+
+	return audio_write(st, at->period, frames);
+}
+
+/*
+mmap access: the fused conversion (or the passthrough copy) writes
+straight into the device ring, between this and audio_mmap_commit.
+room for up to *frames frames, *frames is 0 when there is none yet.
+nothing starts the stream on its own here (writei does it for RW), so
+a full buffer starts it, otherwise it's waited on
+*/
+static int audio_mmap_begin(struct player_state* st, uint8_t** dst,
+	snd_pcm_uframes_t* offset, snd_pcm_uframes_t* frames)
+{
+	snd_pcm_t* pcm = st->output.pcm;
+	snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm);
+	snd_pcm_uframes_t max = *frames;
+
+	*frames = 0;
+
+	if (avail < 0) {
+		return audio_recover(st, avail);
+	}
+
+	if (avail == 0) {
+		if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+			return snd_pcm_start(pcm) < 0 ? -1 : 0;
+		}
+
+		audio_wait(st, 1);
+		return 0;
+	}
+
+	const snd_pcm_channel_area_t* areas;
+	snd_pcm_uframes_t count = ((snd_pcm_uframes_t) avail < max) ? (snd_pcm_uframes_t) avail : max;
+	int err = snd_pcm_mmap_begin(pcm, &areas, offset, &count);
+
+	if (err < 0) {
+		return audio_recover(st, err);
+	}
+
+	// interleaved: one area, every frame right after the previous one
+	*dst = (uint8_t*) areas[0].addr
+		+ areas[0].first / 8 + *offset * (areas[0].step / 8);
+	*frames = count;
+
+	return 0;
+}
+
+static int audio_mmap_commit(struct player_state* st, const uint8_t* dst,
+	snd_pcm_uframes_t offset, size_t done)
+{
+	snd_pcm_sframes_t committed = snd_pcm_mmap_commit(st->output.pcm, offset, done);
+
+	if (committed < 0 || (size_t) committed != done) {
+		return audio_recover(st, committed < 0 ? committed : -EPIPE);
+	}
+
+	if (done > 0) {
+		audio_period_done(st, dst, done);
+	}
+
+	return 0;
+}
+
+/*
+hands frames already in the device format over: RW takes all of them,
+mmap what fits in the device ring. returns how many were taken
+*/
+static long audio_deliver(struct player_state* st, const uint8_t* src, size_t frames) {
+	if (!st->device.mmap) {
+		return (audio_write(st, src, frames) < 0) ? -1 : (long) frames;
+	}
+
+	uint8_t* dst;
+	snd_pcm_uframes_t offset;
+	snd_pcm_uframes_t room = frames;
+
+	if (audio_mmap_begin(st, &dst, &offset, &room) < 0) {
+		return -1;
 	}
 
-	if (v < INT32_MIN) {
-		return INT32_MIN;
+	if (room == 0) {
+		return 0;
 	}
 
-	return (int32_t) v;
+	memcpy(dst, src, room * st->output.frame_bytes);
+
+	return (audio_mmap_commit(st, dst, offset, room) < 0) ? -1 : (long) room;
 }
 
-void apply_volume(struct player_state* st, size_t frames)
-{
-	if (st->player_gain == 1.0f) {
+static int audio_mmap_period(struct player_state* st, float gain) {
+	uint8_t* dst;
+	snd_pcm_uframes_t offset;
+	snd_pcm_uframes_t frames = FRAMES_PER_TICK;
+
+	if (audio_mmap_begin(st, &dst, &offset, &frames) < 0) {
+		return -1;
+	}
+
+	if (frames == 0) {
+		return 0;
+	}
+
+	size_t done = audio_convert(st, dst, frames, gain, st->device.passthrough);
+
+	return audio_mmap_commit(st, dst, offset, done);
+}
+
+/*
+resampling: a block of the track is converted into period and resampled
+into resampled, at the device rate. the device gets that over as many
+calls as it takes, mmap only takes what fits in the ring
+*/
+static size_t audio_resample_block(struct player_state* st, float gain) {
+	struct audio_thread* at = &st->audio;
+	size_t frames = audio_convert(st, at->period, at->resample_block, gain, 0);
+	uint64_t start = stats_now_ns();
+
+	at->resampled_pos = 0;
+	at->resampled_len = resampler_process(&at->resampler, at->period, frames,
+		at->resampled, FRAMES_PER_TICK);
+
+	if (frames > 0) {
+		stats_since(&st->stats, STAT_RESAMPLE, start);
+	}
+
+	return at->resampled_len;
+}
+
+static int audio_resample_period(struct player_state* st, float gain) {
+	struct audio_thread* at = &st->audio;
+	size_t channels = at->format.channels;
+
+	if (at->resampled_pos == at->resampled_len && audio_resample_block(st, gain) == 0) {
+		return 0;
+	}
+
+	const int32_t* src = at->resampled + at->resampled_pos * channels;
+	long done = audio_deliver(st, (const uint8_t*) src, at->resampled_len - at->resampled_pos);
+
+	if (done < 0) {
+		return -1;
+	}
+
+	at->resampled_pos += done;
+
+	return 0;
+}
+
+/*	--- SEEKING --- */
+
+// device frames (history, faded) to s32, passthrough ones are in the track's format
+static void audio_to_s32(struct player_state* st, int32_t* dst, const uint8_t* src, size_t frames) {
+	size_t samples = frames * st->device.channels;
+
+	if (st->device.passthrough) {
+		st->audio.format.convert(dst, src, samples);
+	} else {
+		memcpy(dst, src, samples * sizeof(int32_t));
+	}
+}
+
+// back from s32 to the passthrough format, in place (every sample shrinks)
+static void audio_store_native(uint16_t bits_per_sample, uint8_t* buf, size_t samples) {
+	size_t bytes = bits_per_sample / 8;
+
+	for (size_t i = 0; i < samples; i++) {
+		int32_t v;
+		memcpy(&v, buf + i * sizeof(int32_t), sizeof(v));
+
+		uint8_t* out = buf + i * bytes;
+
+		switch (bits_per_sample) {
+			case 8:
+				out[0] = (uint8_t) ((v >> 24) + 128);
+				break;
+			case 16:
+				out[0] = (uint8_t) (v >> 16);
+				out[1] = (uint8_t) (v >> 24);
+				break;
+			case 24:
+				out[0] = (uint8_t) (v >> 8);
+				out[1] = (uint8_t) (v >> 16);
+				out[2] = (uint8_t) (v >> 24);
+				break;
+		}
+	}
+}
+
+// the newest frames of history were rewound, the oldest of them (up to xfade) fade out
+static void audio_history_rewind(struct player_state* st, size_t frames, size_t xfade) {
+	struct audio_thread* at = &st->audio;
+	size_t frame_bytes = at->history_frame_bytes;
+	size_t cap = at->history_cap;
+	size_t pos = (at->history_end + cap - frames * frame_bytes) % cap;
+	size_t count = (frames < xfade) ? frames : xfade;
+
+	at->history_end = pos;
+	at->history_len -= frames * frame_bytes;
+
+	for (size_t done = 0; done < count; ) {
+		size_t contiguous = (cap - pos) / frame_bytes;
+
+		if (contiguous > count - done) {
+			contiguous = count - done;
+		}
+
+		audio_to_s32(st, at->fade + done * st->device.channels, at->history + pos, contiguous);
+		pos = (pos + contiguous * frame_bytes) % cap;
+		done += contiguous;
+	}
+
+	at->fade_len = count;
+}
+
+/*
+the device kept playing what it had: the old frames that come next are
+the ones staged for it, then the ring up to position (the resampler's
+input would need resampling first, it's left out). they go after what
+fade already has
+*/
+static void audio_fade_queued(struct player_state* st, size_t position, size_t xfade, float gain) {
+	struct audio_thread* at = &st->audio;
+	size_t channels = st->device.channels;
+	size_t frames;
+
+	frames = at->faded_len - at->faded_pos;
+	frames = (frames < xfade - at->fade_len) ? frames : xfade - at->fade_len;
+	audio_to_s32(st, at->fade + at->fade_len * channels,
+		at->faded + at->faded_pos * st->output.frame_bytes, frames);
+	at->fade_len += frames;
+
+	if (at->resampling) {
+		frames = at->resampled_len - at->resampled_pos;
+		frames = (frames < xfade - at->fade_len) ? frames : xfade - at->fade_len;
+		memcpy(at->fade + at->fade_len * channels, at->resampled + at->resampled_pos * channels,
+			frames * channels * sizeof(int32_t));
+		at->fade_len += frames;
 		return;
 	}
 
-	size_t total_samples = frames * st->wav.channels;
+	size_t tail = atomic_load_explicit(&at->ring.tail, memory_order_relaxed);
+	size_t old = (position - tail) / at->format.frame_size;
+
+	frames = (old < xfade - at->fade_len) ? old : xfade - at->fade_len;
+	at->fade_len += audio_convert(st, at->fade + at->fade_len * channels, frames, gain, 0);
+}
+
+/*
+a seek drops what is queued at the old position: the ring up to
+cmd->position and the device buffer but SEEK_KEEP_FRAMES, with a
+rewind, so the new position is heard within a period. the old audio
+that would have come next (the frames rewound, or else the frames still
+queued) fades out under the first SEEK_XFADE_MS of the new position, so
+the splice doesn't click. a device that can't rewind is dropped, and a
+paused one too; the new position fades in from silence then
+*/
+static void audio_seek_start(struct player_state* st, const struct audio_command* cmd,
+	float gain, int paused)
+{
+	struct audio_thread* at = &st->audio;
+	struct output* out = &st->output;
+	size_t xfade = (size_t) st->device.rate * SEEK_XFADE_MS / 1000;
+	long delay = paused ? 0 : out->ops->delay(out);
+	long rewound = 0;
+	int dropped = paused && st->device.can_pause;
+
+	at->fade_len = 0;
+
+	if (delay > SEEK_KEEP_FRAMES && at->history_cap > 0) {
+		size_t want = delay - SEEK_KEEP_FRAMES;
+		size_t history = at->history_len / at->history_frame_bytes;
+
+		rewound = out->ops->rewind(out, (want < history) ? want : history);
+
+		if (rewound > 0) {
+			audio_history_rewind(st, rewound, xfade);
+		} else {
+			dropped = delay > FRAMES_PER_TICK;
+		}
+	}
+
+	if (dropped) {
+		out->ops->drop(out);
+		at->history_len = 0;
+		at->fade_len = 0;
+		delay = rewound = 0;
+	} else if (at->fade_len < xfade) {
+		audio_fade_queued(st, cmd->position, xfade, gain);
+	}
+
+	audio_ring_discard_to(&at->ring, cmd->position);
+	at->flushed = 1;
+	at->resampled_pos = at->resampled_len = 0;
+	at->faded_pos = at->faded_len = 0;
 
-	for (size_t i = 0; i < total_samples; i++) {
-		int64_t v = (int64_t)(st->wav.buf32[i] * st->player_gain);
-		st->wav.buf32[i] = clamp_s32(v);
+	if (at->resampling) {
+		resampler_reset(&at->resampler);
 	}
+
+	at->fade_frames = xfade;
+	at->fade_pos = 0;
+	at->seek_time = paused ? 0 : cmd->time;
+	at->seek_keep_ns = (delay > 0 && st->device.rate > 0)
+		? (uint64_t) (delay - rewound) * 1000000000 / st->device.rate : 0;
+	atomic_store_explicit(&at->delay_ns, at->seek_keep_ns, memory_order_relaxed);
 }
 
-int apply_offset(struct player_state* st, int64_t offset) {
-	int64_t frames_played_signed = (int64_t) st->wav.frames_played;
-	int64_t new_frame_pos = frames_played_signed + offset;
-	int64_t total_frames = (int64_t) st->wav.data_size / st->wav.frame_size;
+// up to max frames of the new position in s32, at the device rate
+static size_t audio_produce(struct player_state* st, int32_t* dst, size_t max, float gain) {
+	struct audio_thread* at = &st->audio;
+	size_t channels = at->format.channels;
 
-	if (new_frame_pos < 0) {
-		new_frame_pos = 0;
-	} else if (new_frame_pos > total_frames) {
-		new_frame_pos = total_frames;
+	if (!at->resampling) {
+		return audio_convert(st, dst, max, gain, 0);
+	}
+
+	if (at->resampled_pos == at->resampled_len && audio_resample_block(st, gain) == 0) {
+		return 0;
+	}
+
+	size_t frames = at->resampled_len - at->resampled_pos;
+	frames = (frames < max) ? frames : max;
+	memcpy(dst, at->resampled + at->resampled_pos * channels, frames * channels * sizeof(int32_t));
+	at->resampled_pos += frames;
+
+	return frames;
+}
+
+/*
+the first frames after a seek: equal power (the two positions have
+nothing to do with each other) from fade to the new position, staged in
+faded in the device format until the device took them all
+*/
+static int audio_crossfade_period(struct player_state* st, float gain) {
+	struct audio_thread* at = &st->audio;
+	size_t channels = st->device.channels;
+
+	if (at->faded_pos == at->faded_len) {
+		int32_t* mix = (int32_t*) at->faded;
+		size_t want = at->fade_frames - at->fade_pos;
+		size_t frames = audio_produce(st, mix, (want < FRAMES_PER_TICK) ? want : FRAMES_PER_TICK, gain);
+
+		if (frames == 0) {
+			return 0;
+		}
+
+		for (size_t i = 0; i < frames; i++) {
+			size_t k = at->fade_pos + i;
+			double t = (k + 0.5) / at->fade_frames * M_PI / 2;
+			double in = sin(t);
+			double out = cos(t);
+
+			for (size_t c = 0; c < channels; c++) {
+				double v = mix[i * channels + c] * in;
+
+				if (k < at->fade_len) {
+					v += at->fade[k * channels + c] * out;
+				}
+
+				v = (v > INT32_MAX) ? INT32_MAX : (v < INT32_MIN) ? INT32_MIN : v;
+				mix[i * channels + c] = (int32_t) v;
+			}
+		}
+
+		at->fade_pos += frames;
+
+		if (at->fade_pos == at->fade_frames) {
+			at->fade_frames = 0;
+		}
+
+		if (st->device.passthrough) {
+			audio_store_native(at->format.bits_per_sample, at->faded, frames * channels);
+		}
+
+		at->faded_pos = 0;
+		at->faded_len = frames;
 	}
 
-	off_t byte_offset = st->wav.data_offset + new_frame_pos * st->wav.frame_size;
+	long done = audio_deliver(st, at->faded + at->faded_pos * st->output.frame_bytes,
+		at->faded_len - at->faded_pos);
 
-	if (lseek(st->fd, byte_offset, SEEK_SET) == -1) {
-		perror("lseek");
+	if (done < 0) {
 		return -1;
 	}
 
-	st->wav.frames_played = new_frame_pos;
+	if (done > 0 && at->seek_time) {
+		stats_add(&st->stats.hist[STAT_SEEK], stats_now_ns() - at->seek_time + at->seek_keep_ns);
+		at->seek_time = 0;
+	}
 
-	st->wav.frames_left = total_frames - st->wav.frames_played;
+	at->faded_pos += done;
 
 	return 0;
 }
 
-int convert_wav_to_32
-(
-	struct player_state* st,
-	size_t frames
-) 
-{
-	size_t total_samples = frames * st->wav.channels;
-
-	const uint8_t* src = (const uint8_t*) st->wav.buf;
-	int32_t* dst = st->wav.buf32;
-
-	for (size_t i = 0; i < total_samples; i++) {
-		int32_t sample = 0;
-
-		if (st->wav.bits_per_sample == 8) {
-			uint8_t v = *src++;
-			sample = ((int32_t)v - 128) << 24;
-		} else if (st->wav.bits_per_sample == 16) {
-			int16_t v = (int16_t)(src[0] | (src[1] << 8));
-			src += 2;
-			sample = ((int32_t) v) << 16;
-		} else if (st->wav.bits_per_sample == 24) {
-			int32_t v = (src[0]) | (src[1] << 8) | (src[2] << 16);
-
-			if (v & 0x00800000) {
-				v |= 0xFF000000;
+// the ring ran dry before the device buffer was full, play what's there
+static void audio_mmap_kick(snd_pcm_t* pcm) {
+	if (snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED) {
+		snd_pcm_start(pcm);
+	}
+}
+
+static void* audio_thread_main(void* arg) {
+	struct player_state* st = (struct player_state*) arg;
+	struct audio_thread* at = &st->audio;
+
+	float gain = st->player_gain;
+	int paused = 0;
+	int stopping = 0;
+	int drain = 0;
+
+	while (1) {
+		struct audio_command cmd;
+
+		while (command_queue_pop(&at->commands, &cmd)) {
+			switch (cmd.type) {
+				case AUDIO_CMD_GAIN:
+					gain = cmd.gain;
+					break;
+				case AUDIO_CMD_PAUSE:
+					paused = 1;
+					audio_device_pause(st, 1);
+					break;
+				case AUDIO_CMD_RESUME:
+					paused = 0;
+					audio_device_pause(st, 0);
+					break;
+				case AUDIO_CMD_FORMAT:
+					// only miscounts until the oldest is reached, a flush keeps pending short
+					if (at->pending_len == COMMAND_QUEUE_SIZE) {
+						at->pending_len--;
+						memmove(at->pending, at->pending + 1, at->pending_len * sizeof(at->pending[0]));
+					}
+
+					at->pending[at->pending_len++] = cmd;
+					break;
+				case AUDIO_CMD_FLUSH:
+					audio_ring_discard_to(&at->ring, cmd.position);
+					at->flushed = 1;
+
+					// skipped while paused the formats pile up, the last one replaces the rest
+					size_t skipped = audio_formats_reached(at);
+
+					if (skipped > 1) {
+						at->pending_len -= skipped - 1;
+						memmove(at->pending, at->pending + skipped - 1,
+							at->pending_len * sizeof(at->pending[0]));
+					}
+
+					at->resampled_pos = at->resampled_len = 0;
+					at->faded_pos = at->faded_len = 0;
+					at->fade_frames = 0;
+					at->seek_time = 0;
+
+					if (at->resampling) {
+						resampler_reset(&at->resampler);
+					}
+
+					// what the paused device still holds belongs to the old position
+					if (paused && st->device.can_pause) {
+						st->output.ops->drop(&st->output);
+						at->history_len = 0;
+					}
+
+					break;
+				case AUDIO_CMD_SEEK:
+					audio_seek_start(st, &cmd, gain * at->format.gain, paused);
+					break;
+				case AUDIO_CMD_STOP:
+					stopping = 1;
+					drain = cmd.drain;
+					break;
 			}
+		}
 
-			src += 3;
-			sample = v << 8;
-		} else {			
-			return -1;
+		// the native format can't carry gain, back to S32 (a paused pcm can't drain)
+		if (!paused && st->device.passthrough && audio_needs_processing(gain * at->format.gain)
+			&& audio_device_configure(st, &at->format, 0, 1) < 0) {
+			fprintf(stderr, "pcm reconfiguration failed\n");
+			break;
+		}
+
+		// staged frames of the current format go out before any switch
+		int staged = at->resampled_pos < at->resampled_len || at->faded_pos < at->faded_len;
+
+		if (!paused && !staged && audio_apply_formats(st, gain) < 0) {
+			break;
+		}
+
+		audio_notify_space(at);
+
+		size_t available = audio_ring_readable(&at->ring);
+		int empty = available < at->format.frame_size && !staged;
+
+		if (stopping && (!drain || paused || empty)) {
+			break;
+		}
+
+		if (paused) {
+			audio_wait(st, 0);
+			continue;
+		}
+
+		if (empty) {
+			if (st->device.mmap) {
+				audio_mmap_kick(st->output.pcm);
+			}
+
+			audio_wait_data(st);
+			continue;
 		}
 
-		*dst++ = sample;
+		if (audio_wait_room(st)) {
+			continue;
+		}
+
+		// the player's volume and the loudness gain of the track being played
+		float level = gain * at->format.gain;
+		int ret;
+
+		if (at->fade_frames > 0 || at->faded_pos < at->faded_len) {
+			ret = audio_crossfade_period(st, level);
+		} else if (at->resampling) {
+			ret = audio_resample_period(st, level);
+		} else if (st->device.mmap) {
+			ret = audio_mmap_period(st, level);
+		} else {
+			ret = audio_rw_period(st, level);
+		}
+
+		if (ret < 0) {
+			fprintf(stderr, "pcm write failed\n");
+			break;
+		}
+
+		at->flushed = 0;
+	}
+
+	return NULL;
+}
+
+static void audio_close_wakeups(struct audio_thread* at) {
+	if (at->wake_fd >= 0) {
+		close(at->wake_fd);
+	}
+
+	if (at->space_fd >= 0) {
+		close(at->space_fd);
+	}
+
+	at->wake_fd = -1;
+	at->space_fd = -1;
+}
+
+static int audio_thread_start(struct player_state* st) {
+	struct audio_thread* at = &st->audio;
+
+	at->period = NULL;
+	at->split_frame = NULL;
+	at->ahead_raw = NULL;
+	at->ahead = NULL;
+	at->period_channels = 0;
+	at->pending_len = 0;
+	at->flushed = 0;
+	at->fade_frames = 0;
+	at->faded_pos = at->faded_len = 0;
+	at->seek_time = 0;
+	atomic_store(&at->delay_ns, 0);
+	limiter_reset(&at->limiter);
+
+	if (audio_use_format(at, &st->wav.format) < 0) {
+		audio_period_free(at);
+		return -1;
+	}
+
+	size_t ring_size = RING_PERIODS * FRAMES_PER_TICK * st->wav.channels * sizeof(int32_t);
+
+	if (audio_ring_init(&at->ring, ring_size) < 0) {
+		audio_period_free(at);
+		return -1;
 	}
 
+	at->queued[0] = (struct ring_format) {audio_ring_position(&at->ring), st->wav.format.frame_size};
+	at->queued_len = 1;
+
+	command_queue_init(&at->commands);
+	atomic_init(&at->want_data, 0);
+	atomic_init(&at->want_space, 0);
+	at->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	at->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (at->wake_fd < 0 || at->space_fd < 0
+		|| pthread_create(&at->thread, NULL, audio_thread_main, st) != 0) {
+		fprintf(stderr, "failed to create audio thread\n");
+		audio_close_wakeups(at);
+		audio_ring_free(&at->ring);
+		audio_period_free(at);
+		return -1;
+	}
+
+	at->started = 1;
+
 	return 0;
 }
 
+static void audio_thread_stop(struct player_state* st, int drain) {
+	struct audio_thread* at = &st->audio;
+
+	if (!at->started) {
+		return;
+	}
+
+	struct audio_command cmd = {
+		.type = AUDIO_CMD_STOP,
+		.drain = drain
+	};
+
+	audio_send_command(st, &cmd);
+	pthread_join(at->thread, NULL);
+
+	at->started = 0;
+	audio_close_wakeups(at);
+	audio_ring_free(&at->ring);
+	audio_period_free(at);
+	audio_resampler_release(at);
+}
+
 int audio_init(struct player_state* st) 
 {
-	int err;
-
-	if ((err = snd_pcm_open(&st->pcm, "default",
-		SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+	if (audio_route(st, &st->wav.format, st->player_gain,
+		st->resample_quality, st->crossfade_ms, 0) < 0)
+	{
+		audio_resampler_release(&st->audio);
+		audio_close(st);
 		return -1;
 	}
 
-	if ((err = snd_pcm_set_params(
-		st->pcm,
-		SND_PCM_FORMAT_S32_LE,
-		SND_PCM_ACCESS_RW_INTERLEAVED,
-		st->wav.channels,
-		st->wav.sample_rate,
-		1,
-		500000)) < 0) {
+	if (audio_thread_start(st) < 0) {
+		audio_resampler_release(&st->audio);
 		return -1;
 	}
 
@@ -119,18 +1556,228 @@ int audio_init(struct player_state* st)
 	return 0;
 }
 
+/*
+back to command mode: the audio thread goes away but the device stays
+open and prepared for the next play
+*/
 void audio_shutdown(struct player_state* st) {
-	if (!st->pcm) {
+	if (!st->audio.started) {
 		return;
 	}
 
-	snd_pcm_drain(st->pcm);
-	snd_pcm_close(st->pcm);
-	st->pcm = NULL;
+	// a paused player would never drain the ring
+	int drain = st->state == PLAYING;
+	audio_thread_stop(st, drain);
+
+	if (drain) {
+		st->output.ops->drain(&st->output);
+	} else {
+		st->output.ops->drop(&st->output);
+	}
+
+	st->audio.history_len = 0;
+
 	st->mode = COMMAND;
 	st->state = STOPPED;
 }
 
+// end of the session
+void audio_close(struct player_state* st) {
+	audio_shutdown(st);
+
+	if (st->output.opened) {
+		st->output.ops->close(&st->output);
+		st->output.opened = 0;
+	}
+
+	audio_seek_buffers_free(&st->audio);
+
+	st->device.channels = 0;
+	st->device.rate = 0;
+	st->device.mmap = 0;
+}
+
+/*	--- PRODUCER --- */
+
+/*
+the next *frames frames of a track (fewer if read() returns less): a
+pointer into the mapping, or wav->buf after a read()
+*/
+static const uint8_t* stream_read(int fd, struct wav_information* wav, size_t* frames) {
+	const uint8_t* src;
+
+	if (wav->data) { // mmap reader, no syscall and a single copy
+		size_t position = (size_t) (wav->frames_played * wav->frame_size);
+
+		wav_map_advise(wav, position);
+		src = wav->data + position;
+	} else {
+		ssize_t n = read(fd, wav->buf, *frames * wav->frame_size);
+
+		if (n <= 0) {
+			return NULL;
+		}
+
+		*frames = n / wav->frame_size;
+		src = (const uint8_t*) wav->buf;
+	}
+
+	wav->frames_played += *frames;
+	wav->frames_left -= *frames;
+
+	return src;
+}
+
+// same, converted to s32 into dst
+static int stream_read_s32(int fd, struct wav_information* wav, int32_t* dst, size_t* frames) {
+	if (*frames > wav->frames_left) {
+		*frames = wav->frames_left;
+	}
+
+	if (*frames == 0) {
+		return 0;
+	}
+
+	const uint8_t* src = stream_read(fd, wav, frames);
+
+	if (!src) {
+		return -1;
+	}
+
+	wav->format.convert(dst, src, *frames * wav->channels);
+
+	return 0;
+}
+
+/*
+the current track becomes the one fading out (it keeps its fd and
+buffers), st->wav is free for the next track. the fade lasts what is
+left of it
+*/
+int crossfade_init(struct player_state* st) {
+	struct crossfade* xf = &st->crossfade;
+	size_t channels = st->wav.channels;
+
+	if (channels > xf->channels) {
+		size_t samples = FRAMES_PER_TICK * channels;
+		int32_t* out = realloc(xf->out, samples * sizeof(int32_t));
+		int32_t* in = realloc(xf->in, samples * sizeof(int32_t));
+		float* gain_out = realloc(xf->gain_out, samples * sizeof(float));
+		float* gain_in = realloc(xf->gain_in, samples * sizeof(float));
+
+		xf->out = out ? out : xf->out;
+		xf->in = in ? in : xf->in;
+		xf->gain_out = gain_out ? gain_out : xf->gain_out;
+		xf->gain_in = gain_in ? gain_in : xf->gain_in;
+
+		if (!out || !in || !gain_out || !gain_in) {
+			perror("realloc");
+			return -1;
+		}
+
+		xf->channels = channels;
+	}
+
+	if (stream_format_init(&xf->format, WAV_FORMAT_PCM, channels, 32, st->wav.sample_rate) < 0) {
+		return -1;
+	}
+
+	xf->mix = mix_select();
+	xf->fd = st->fd;
+	xf->wav = st->wav;
+	xf->frames = st->wav.frames_left;
+	xf->pos = 0;
+	xf->active = 1;
+	xf->start = 0;
+
+	st->fd = -1;
+	memset(&st->wav, 0, sizeof(st->wav));
+
+	return 0;
+}
+
+void crossfade_free(struct crossfade* xf) {
+	free(xf->out);
+	free(xf->in);
+	free(xf->gain_out);
+	free(xf->gain_in);
+	xf->out = NULL;
+	xf->in = NULL;
+	xf->gain_out = NULL;
+	xf->gain_in = NULL;
+	xf->channels = 0;
+}
+
+/*
+during a crossfade both tracks are read, converted to s32 and mixed
+into the ring, the one ending going down and the current one coming up.
+equal power (cos/sin): two different tracks aren't correlated, so the
+loudness stays flat through the fade. returns 5 once it's over
+*/
+static int crossfade_stream(struct player_state* st) {
+	struct crossfade* xf = &st->crossfade;
+	size_t channels = xf->format.channels;
+	size_t writable;
+
+	while (xf->pos < xf->frames) {
+		writable = audio_ring_writable(&st->audio.ring) / xf->format.frame_size;
+
+		if (writable == 0) {
+			return 0;
+		}
+
+		size_t frames = xf->frames - xf->pos;
+		frames = (frames < FRAMES_PER_TICK) ? frames : FRAMES_PER_TICK;
+		frames = (frames < writable) ? frames : writable;
+
+		uint64_t start = stats_now_ns();
+
+		if (stream_read_s32(xf->fd, &xf->wav, xf->out, &frames) < 0) {
+			return -1;
+		}
+
+		size_t got = frames;
+
+		// the next track may be shorter than the fade
+		if (stream_read_s32(st->fd, &st->wav, xf->in, &got) < 0) {
+			got = 0;
+		}
+
+		memset(xf->in + got * channels, 0, (frames - got) * channels * sizeof(int32_t));
+
+		// each track keeps its own loudness gain, the mix goes out at 1.0
+		for (size_t i = 0; i < frames; i++) {
+			double t = (xf->pos + i + 0.5) / xf->frames * M_PI / 2;
+			float out = (float) cos(t) * xf->wav.format.gain;
+			float in = (float) sin(t) * st->wav.format.gain;
+
+			for (size_t c = 0; c < channels; c++) {
+				xf->gain_out[i * channels + c] = out;
+				xf->gain_in[i * channels + c] = in;
+			}
+		}
+
+		xf->mix(xf->out, xf->out, xf->in, xf->gain_out, xf->gain_in, frames * channels);
+		audio_ring_write(&st->audio.ring, xf->out, frames * xf->format.frame_size);
+		stats_since(&st->stats, STAT_READ, start);
+
+		xf->pos += frames;
+		audio_notify_data(&st->audio);
+
+		if (frames == 0) { // the track fading out ended early
+			break;
+		}
+	}
+
+	return 5;
+}
+
+/*
+producer side of the audio ring: queues the track's frames as they are in
+the file while there is room, the audio thread does the rest. returns 1
+at the end of the track, 4 at the point where it should start fading
+into the next one and 5 once that crossfade is over
+*/
 int play_wav_stream
 (
 	struct player_state* st
@@ -145,51 +1792,46 @@ int play_wav_stream
 		return -1;
 	}
 
-	if (st->wav.frames_left == 0) {
-		return 1;
+	if (st->crossfade.active) {
+		return crossfade_stream(st);
 	}
 
-	ssize_t n;
-
-	size_t frames = (st->wav.frames_left < FRAMES_PER_TICK) 
-		? st->wav.frames_left
-		: FRAMES_PER_TICK;
-
-	n = read(st->fd, st->wav.buf, frames * st->wav.frame_size);
+	size_t writable;
 
-	if (n <= 0) {
-		return -1;
-	}
-
-	size_t offset = 0;
-	size_t frames_to_write = n / st->wav.frame_size;
+	while ((writable = audio_ring_writable(&st->audio.ring) / st->wav.frame_size) > 0) {
+		if (st->wav.frames_left == 0) {
+			return 1;
+		}
 
-	if (convert_wav_to_32(st, frames_to_write) < 0) {
-		return -1;
-	}
+		// the frames from the fade point on are queued mixed with the next track
+		if (st->wav.frames_left <= st->crossfade.start) {
+			return 4;
+		}
 
-	apply_volume(st, frames_to_write);
+		uint64_t left = st->wav.frames_left - st->crossfade.start;
+		size_t frames = (left < FRAMES_PER_TICK) ? left : FRAMES_PER_TICK;
 
-	while (frames_to_write > 0) {
-		snd_pcm_sframes_t written = 
-			snd_pcm_writei(st->pcm, 
-				st->wav.buf32 + offset * st->wav.channels, frames_to_write);
+		if (frames > writable) {
+			frames = writable;
+		}
 
-		if (written < 0) {
-			if (written == -EPIPE) {
-				snd_pcm_prepare(st->pcm);
-				continue;
-			}
+		uint64_t start = stats_now_ns();
+		const uint8_t* src = stream_read(st->fd, &st->wav, &frames);
 
+		if (!src) {
 			return -1;
 		}
 
-		frames_to_write -= written;
-		st->wav.frames_played += written;
-		offset += written;
-	}
+		audio_ring_write(&st->audio.ring, src, frames * st->wav.frame_size);
+		stats_since(&st->stats, STAT_READ, start);
+		audio_notify_data(&st->audio);
 
-	st->wav.frames_left -= n / st->wav.frame_size;
+		// unsigned: a seek back counts as moving too
+		if (st->wav.frames_played - st->wav.prefetched
+			>= (uint64_t) st->wav.sample_rate * SEEK_PREFETCH_MS / 2000) {
+			seek_prefetch(st);
+		}
+	}
 
 	return 0;
 }
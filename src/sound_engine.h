@@ -4,10 +4,24 @@
 #include "types.h"
 
 void audio_shutdown(struct player_state* st);
-void apply_volume(struct player_state* st, size_t volume);
+void audio_close(struct player_state* st);
 int apply_offset(struct player_state* st, int64_t offset);
+uint64_t audio_heard_frames(struct player_state* st);
 int audio_init(struct player_state* st);
-int convert_wav_to_32(struct player_state* st, size_t frames);
+void convert_frames(const struct stream_format* fmt, int32_t* dst,
+	const uint8_t* src, size_t frames, float gain);
 int play_wav_stream(struct player_state* st;);
+int crossfade_init(struct player_state* st);
+void crossfade_free(struct crossfade* xf);
+
+/*	--- AUDIO THREAD --- */
+
+int audio_send_command(struct player_state* st, const struct audio_command* cmd);
+int audio_set_gain(struct player_state* st, float gain);
+int audio_set_paused(struct player_state* st, int paused);
+int audio_flush(struct player_state* st);
+int audio_seek(struct player_state* st, int64_t offset);
+int audio_set_format(struct player_state* st, const struct stream_format* fmt);
+int audio_want_space(struct player_state* st);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,173 @@
+#include "stats.h"
+#include <string.h>
+#include <time.h>
+
+static const char* metric_names[STAT_COUNT] = {
+	[STAT_READ] = "read",
+	[STAT_CONVERT] = "convert",
+	[STAT_RESAMPLE] = "resample",
+	[STAT_WRITE] = "write",
+	[STAT_DELAY] = "delay",
+	[STAT_RENDER] = "render",
+	[STAT_SEEK] = "seek",
+};
+
+// single writer: a load and a store, no locked instruction on the audio thread
+static void bump(_Atomic uint64_t* v, uint64_t by) {
+	atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + by,
+		memory_order_relaxed);
+}
+
+static uint64_t get(const _Atomic uint64_t* v) {
+	return atomic_load_explicit((_Atomic uint64_t*) v, memory_order_relaxed);
+}
+
+uint64_t stats_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// bucket i holds [2^(i-1), 2^i), 0 only holds 0
+static int bucket_of(uint64_t ns) {
+	int i = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	return (i < STATS_BUCKETS) ? i : STATS_BUCKETS - 1;
+}
+
+void stats_add(struct stats_hist* h, uint64_t ns) {
+	bump(&h->count, 1);
+	bump(&h->sum, ns);
+	bump(&h->buckets[bucket_of(ns)], 1);
+
+	if (ns > get(&h->max)) {
+		atomic_store_explicit(&h->max, ns, memory_order_relaxed);
+	}
+}
+
+uint64_t stats_since(struct stats* s, enum stats_metric m, uint64_t start) {
+	uint64_t now = stats_now_ns();
+
+	stats_add(&s->hist[m], now - start);
+
+	return now;
+}
+
+void stats_xrun(struct stats* s) {
+	if (s) {
+		bump(&s->xruns, 1);
+	}
+}
+
+void stats_period(struct stats* s) {
+	bump(&s->periods, 1);
+}
+
+void stats_reset(struct stats* s) {
+	atomic_store_explicit(&s->xruns, 0, memory_order_relaxed);
+	atomic_store_explicit(&s->periods, 0, memory_order_relaxed);
+
+	for (int m = 0; m < STAT_COUNT; m++) {
+		struct stats_hist* h = &s->hist[m];
+
+		atomic_store_explicit(&h->count, 0, memory_order_relaxed);
+		atomic_store_explicit(&h->sum, 0, memory_order_relaxed);
+		atomic_store_explicit(&h->max, 0, memory_order_relaxed);
+
+		for (int b = 0; b < STATS_BUCKETS; b++) {
+			atomic_store_explicit(&h->buckets[b], 0, memory_order_relaxed);
+		}
+	}
+}
+
+uint64_t stats_percentile(const struct stats_hist* h, double p) {
+	uint64_t count = get(&h->count);
+	uint64_t max = get(&h->max);
+
+	if (count == 0) {
+		return 0;
+	}
+
+	double rank = p * count;
+	uint64_t seen = 0;
+
+	// linear inside the bucket that holds the rank
+	for (int b = 0; b < STATS_BUCKETS; b++) {
+		uint64_t in = get(&h->buckets[b]);
+
+		if (in > 0 && seen + in > rank) {
+			double lower = b ? (double) (1ULL << (b - 1)) : 0;
+			double upper = b ? (double) (1ULL << b) : 0;
+			uint64_t v = (uint64_t) (lower + (upper - lower) * (rank - seen) / in);
+
+			return (v < max) ? v : max;
+		}
+
+		seen += in;
+	}
+
+	return max;
+}
+
+const char* stats_metric_name(enum stats_metric m) {
+	return metric_names[m];
+}
+
+/*	--- OUTPUT --- */
+
+void stats_print(const struct stats* s, FILE* f) {
+	fprintf(f, "xruns: %llu, periods: %llu\n\n",
+		(unsigned long long) get(&s->xruns), (unsigned long long) get(&s->periods));
+	fprintf(f, "%-9s %9s %10s %10s %10s %10s\n", "stage", "count", "mean us", "p50 us", "p99 us", "max us");
+
+	for (int m = 0; m < STAT_COUNT; m++) {
+		const struct stats_hist* h = &s->hist[m];
+		uint64_t count = get(&h->count);
+
+		if (count == 0) {
+			fprintf(f, "%-9s %9d %10s %10s %10s %10s\n", metric_names[m], 0, "-", "-", "-", "-");
+			continue;
+		}
+
+		fprintf(f, "%-9s %9llu %10.1f %10.1f %10.1f %10.1f\n", metric_names[m],
+			(unsigned long long) count,
+			get(&h->sum) / 1e3 / count,
+			stats_percentile(h, 0.50) / 1e3,
+			stats_percentile(h, 0.99) / 1e3,
+			get(&h->max) / 1e3);
+	}
+}
+
+void stats_print_json(const struct stats* s, FILE* f) {
+	fprintf(f, "{\"xruns\":%llu,\"periods\":%llu",
+		(unsigned long long) get(&s->xruns), (unsigned long long) get(&s->periods));
+
+	for (int m = 0; m < STAT_COUNT; m++) {
+		const struct stats_hist* h = &s->hist[m];
+		int last = 0;
+
+		fprintf(f, ",\"%s\":{\"count\":%llu,\"sum_ns\":%llu,\"max_ns\":%llu,"
+			"\"p50_ns\":%llu,\"p99_ns\":%llu,\"buckets\":[", metric_names[m],
+			(unsigned long long) get(&h->count),
+			(unsigned long long) get(&h->sum),
+			(unsigned long long) get(&h->max),
+			(unsigned long long) stats_percentile(h, 0.50),
+			(unsigned long long) stats_percentile(h, 0.99));
+
+		// trailing empty buckets left out, bucket i counts values below 2^i ns
+		for (int b = 0; b < STATS_BUCKETS; b++) {
+			if (get(&h->buckets[b])) {
+				last = b + 1;
+			}
+		}
+
+		for (int b = 0; b < last; b++) {
+			fprintf(f, "%s%llu", b ? "," : "", (unsigned long long) get(&h->buckets[b]));
+		}
+
+		fprintf(f, "]}");
+	}
+
+	fprintf(f, "}\n");
+}
@@ -0,0 +1,38 @@
+/*
+playback instrumentation
+
+counters and log2 histograms of what playing costs: reading the file
+(main thread), converting and resampling a period, the time blocked in
+the device write and what the device still holds after it (audio
+thread), drawing the ui and how long a seek takes to be heard. all
+values are ns.
+every histogram has a single writer and is updated with relaxed stores,
+so the main thread can read it while the audio thread is running. the
+percentiles are interpolated inside their bucket, so they are within a
+factor of two
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "types.h"
+#include <stdio.h>
+
+uint64_t stats_now_ns(void);
+
+void stats_add(struct stats_hist* h, uint64_t ns);
+
+// ns since start, returns now for the next stage
+uint64_t stats_since(struct stats* s, enum stats_metric m, uint64_t start);
+
+void stats_xrun(struct stats* s);
+void stats_period(struct stats* s);
+void stats_reset(struct stats* s);
+
+uint64_t stats_percentile(const struct stats_hist* h, double p);
+const char* stats_metric_name(enum stats_metric m);
+
+void stats_print(const struct stats* s, FILE* f);
+void stats_print_json(const struct stats* s, FILE* f);
+
+#endif
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <assert.h>
+#include <string.h>
 
 void print_riff_header(const struct riff_header* rhdr) {
 	printf("	--- RIFF HEADER --- 	\n");
@@ -80,6 +81,11 @@ void track_print(struct track* t) {
 	printf("path: %s\n", t->path);
 	printf("name: %s\n", t->name);
 
+	// analyzed in the background, may still be missing
+	if (atomic_load_explicit(&t->loudness_ready, memory_order_acquire)) {
+		printf("loudness: %.1f LUFS, true peak %.1f dBTP\n", t->loudness, t->true_peak);
+	}
+
 	int duration = (int) t->duration;
 	int minutes =  duration / 60;
 	int seconds = duration % 60;
@@ -106,17 +112,17 @@ void playlist_print(struct playlist* pl) {
 
 void printf_wav_information(struct wav_information* wav) {
 	printf("	---	 WAV INFORMATION ---\n");
-	printf("data_size: %ld\n", wav->data_size);
+	printf("data_size: %llu\n", (unsigned long long) wav->data_size);
 	printf("channels: %d\n", wav->channels);
 	printf("sample_rate: %d\n", wav->sample_rate);
-	printf("bits_per_sample: %d\n\n", wav->bits_per_sample);
+	printf("format: %s\n", wav->audio_format == WAV_FORMAT_FLOAT ? "float" : "pcm");
+	printf("bits_per_sample: %d (%d valid)\n\n", wav->bits_per_sample, wav->valid_bits);
 }
 
 int init_wav_buf(struct wav_information* wav) {
 	wav->buf = malloc(FRAMES_PER_TICK * wav->frame_size);
-	wav->buf32 = malloc(FRAMES_PER_TICK * wav->channels * sizeof(int32_t));
 
-    if (!wav->buf || !wav->buf32) {
+    if (!wav->buf) {
         perror("malloc");
         return -1;
     }
@@ -227,4 +233,192 @@ void random_list_free(struct random_list* rl) {
 	rl->indexes = NULL;
 	rl->current = 0;
 	rl->size = 0;
-}
\ No newline at end of file
+}
+/* --- AUDIO RING FUNCTIONS --- */
+
+int audio_ring_init(struct audio_ring* r, size_t size) {
+	size_t real_size = 1;
+
+	while (real_size < size) {
+		real_size <<= 1;
+	}
+
+	r->data = malloc(real_size);
+
+	if (!r->data) {
+		perror("malloc");
+		return -1;
+	}
+
+	r->size = real_size;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+
+	return 0;
+}
+
+void audio_ring_free(struct audio_ring* r) {
+	free(r->data);
+	r->data = NULL;
+	r->size = 0;
+}
+
+size_t audio_ring_readable(struct audio_ring* r) {
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+	return head - tail;
+}
+
+size_t audio_ring_writable(struct audio_ring* r) {
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+	return r->size - (head - tail);
+}
+
+/*
+both copies are split in two when the span crosses the end of data.
+the release store publishes the bytes before the new position
+*/
+size_t audio_ring_write(struct audio_ring* r, const void* src, size_t len) {
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t space = audio_ring_writable(r);
+
+	if (len > space) {
+		len = space;
+	}
+
+	size_t index = head & (r->size - 1);
+	size_t first = r->size - index;
+
+	if (first > len) {
+		first = len;
+	}
+
+	memcpy(r->data + index, src, first);
+	memcpy(r->data, (const uint8_t*) src + first, len - first);
+
+	atomic_store_explicit(&r->head, head + len, memory_order_release);
+
+	return len;
+}
+
+size_t audio_ring_read(struct audio_ring* r, void* dst, size_t len) {
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t available = audio_ring_readable(r);
+
+	if (len > available) {
+		len = available;
+	}
+
+	size_t index = tail & (r->size - 1);
+	size_t first = r->size - index;
+
+	if (first > len) {
+		first = len;
+	}
+
+	memcpy(dst, r->data + index, first);
+	memcpy((uint8_t*) dst + first, r->data, len - first);
+
+	atomic_store_explicit(&r->tail, tail + len, memory_order_release);
+
+	return len;
+}
+
+/*
+consumer side, zero copy: points ptr at the readable bytes that are
+contiguous in data (the span stops at the end of data) and returns how
+many there are. audio_ring_advance releases them
+*/
+size_t audio_ring_peek(struct audio_ring* r, const uint8_t** ptr) {
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t available = audio_ring_readable(r);
+	size_t index = tail & (r->size - 1);
+	size_t first = r->size - index;
+
+	*ptr = r->data + index;
+
+	return (available < first) ? available : first;
+}
+
+// copies up to len readable bytes without releasing them (a look-ahead)
+size_t audio_ring_copy(struct audio_ring* r, void* dst, size_t len) {
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t available = audio_ring_readable(r);
+
+	if (len > available) {
+		len = available;
+	}
+
+	size_t index = tail & (r->size - 1);
+	size_t first = r->size - index;
+
+	if (first > len) {
+		first = len;
+	}
+
+	memcpy(dst, r->data + index, first);
+	memcpy((uint8_t*) dst + first, r->data, len - first);
+
+	return len;
+}
+
+void audio_ring_advance(struct audio_ring* r, size_t len) {
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	atomic_store_explicit(&r->tail, tail + len, memory_order_release);
+}
+
+// producer side: position of the next byte that will be written
+size_t audio_ring_position(struct audio_ring* r) {
+	return atomic_load_explicit(&r->head, memory_order_relaxed);
+}
+
+// consumer side: drop everything queued before position
+void audio_ring_discard_to(struct audio_ring* r, size_t position) {
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+	// position is behind tail (already consumed) or ahead of head (invalid)
+	if (position - tail > head - tail) {
+		return;
+	}
+
+	atomic_store_explicit(&r->tail, position, memory_order_release);
+}
+
+/* --- COMMAND QUEUE FUNCTIONS --- */
+
+void command_queue_init(struct command_queue* q) {
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+}
+
+int command_queue_push(struct command_queue* q, const struct audio_command* cmd) {
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+	if (head - tail == COMMAND_QUEUE_SIZE) {
+		return -1; // full
+	}
+
+	q->items[head & (COMMAND_QUEUE_SIZE - 1)] = *cmd;
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+	return 0;
+}
+
+int command_queue_pop(struct command_queue* q, struct audio_command* cmd) {
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+	if (head == tail) {
+		return 0; // empty
+	}
+
+	*cmd = q->items[tail & (COMMAND_QUEUE_SIZE - 1)];
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+	return 1;
+}
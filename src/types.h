@@ -3,10 +3,24 @@
 
 #include <stdint.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <alsa/asoundlib.h>
 
 #define PATH_MAX_LENGTH 1024
 #define FRAMES_PER_TICK 1024
+#define RING_PERIODS 8 // ring capacity in FRAMES_PER_TICK periods
+#define COMMAND_QUEUE_SIZE 64 // must be a power of two
+#define MAP_WINDOW_SIZE (1 << 20) // bytes prefetched ahead of the mmap reader
+#define PRELOAD_AHEAD_MS 3000 // open the next track this long before the end
+#define PREFILL_MS 300 // audio of the next track brought into memory ahead
+#define WAV_HEADER_BLOCK 4096 // bytes read at once when parsing a header
+#define SEEK_STEP_S 5 // , and . move this many seconds
+#define SEEK_PREFETCH_MS 500 // audio around both seek targets kept in memory
+#define SEEK_KEEP_FRAMES (FRAMES_PER_TICK / 4) // left in the device on a seek
+#define SEEK_XFADE_MS 5 // old and new position overlap this long
+#define CROSSFADE_MAX_MS 30000 // longest crossfade between two tracks
+#define LOUDNESS_MAX_CHANNELS 8 // more than this and a track isn't analyzed
 
 struct riff_header {
 	char chunk_id[4]; // "RIFF"
@@ -40,6 +54,22 @@ struct track {
 	char* path;
 	char* name;
 	double duration;
+
+	// what the library index keeps so the header isn't parsed at startup
+	uint64_t size; // file size, with mtime tells if the entry is stale
+	int64_t mtime; // nanoseconds
+	uint64_t data_offset;
+	uint64_t data_size;
+	uint32_t sample_rate;
+	uint32_t byte_rate;
+	uint16_t channels;
+	uint16_t bits_per_sample;
+	uint16_t audio_format;
+
+	// ebu r128 analysis, filled in the background (see loudness.h)
+	_Atomic int loudness_ready; // the two below are valid once set
+	float loudness; // integrated, LUFS (-inf if all of it is gated out)
+	float true_peak; // dBTP
 };
 
 struct playlist { // a vector
@@ -59,18 +89,83 @@ enum play_state {
 	PAUSED
 };
 
+// converts samples (not frames) of the track's format to left aligned s32
+typedef void (*convert_fn)(int32_t* dst, const uint8_t* src, size_t samples);
+// same, multiplying by gain and saturating in the same pass
+typedef void (*convert_gain_fn)(int32_t* dst, const uint8_t* src,
+	size_t samples, float gain);
+// adds two s32 streams, each sample with its own gain, and saturates
+typedef void (*mix_fn)(int32_t* dst, const int32_t* a, const int32_t* b,
+	const float* gain_a, const float* gain_b, size_t samples);
+// multiplies each s32 sample by its own gain, in place, and saturates
+typedef void (*scale_fn)(int32_t* buf, const float* gain, size_t samples);
+// largest magnitude among s32 samples, as a float
+typedef float (*peak_fn)(const int32_t* buf, size_t samples);
+
+/*
+layout of the frames queued in the audio ring. it changes with the
+track, so each change travels through the command queue with the ring
+position where it starts
+*/
+struct stream_format {
+	uint16_t audio_format;
+	uint16_t channels;
+	uint16_t bits_per_sample;
+	uint32_t sample_rate;
+	size_t frame_size;
+	convert_fn convert; // used when gain is 1.0
+	convert_gain_fn convert_gain;
+	float gain; // of the track (loudness normalization), on top of the player gain
+};
+
+enum wav_chunk_type {
+	CHUNK_FMT,
+	CHUNK_DATA,
+	CHUNK_LIST, // LIST/INFO tags
+	CHUNK_CUE,
+	CHUNK_SMPL,
+	CHUNK_FACT,
+	CHUNK_TYPES
+};
+
+struct wav_chunk {
+	uint64_t offset; // of the payload in the file, 0 if the chunk isn't there
+	uint64_t size; // payload size, without padding (from ds64 for an rf64 data chunk)
+};
+
+// fmt audio_format, an extensible fmt is resolved to the one of its sub format
+#define WAV_FORMAT_PCM 0x0001
+#define WAV_FORMAT_FLOAT 0x0003 // ieee 754, 32-bit only
+#define WAV_FORMAT_EXTENSIBLE 0xFFFE
+#define WAV_FMT_EXTENSIBLE_SIZE 40 // bytes of an extensible fmt chunk
+#define WAV_DS64_SIZE 28 // riff size, data size, sample count and table length
+#define WAV_SIZE_IN_DS64 0xFFFFFFFF // 32-bit chunk size of an rf64 file: the real one is in ds64
+
 struct wav_information {
-	off_t data_offset;
-	size_t data_size;
-	size_t frames_left;
+	uint16_t audio_format; // WAV_FORMAT_PCM or WAV_FORMAT_FLOAT
+	uint64_t data_offset;
+	uint64_t data_size; // 64-bit, rf64 files go past 4 GiB
+	uint64_t frames_left;
 	size_t frame_size;
-	size_t frames_played;
+	uint64_t frames_played;
 	uint32_t byte_rate;
 	uint32_t sample_rate;
 	uint16_t channels;
-	uint16_t bits_per_sample;
-	int32_t* buf32;
+	uint16_t bits_per_sample; // of the container
+	uint16_t valid_bits; // of bits_per_sample that carry the sample (extensible fmt)
 	int8_t* buf;
+	struct stream_format format; // kernels are picked when the track is loaded
+	struct wav_chunk chunks[CHUNK_TYPES]; // filled by get_wav_information
+	uint64_t ds64_data_size; // data size of an rf64/bw64 file, 0 for riff
+
+	// mmap reader mode (see wav_map_data), data is NULL when using read()
+	const uint8_t* data;
+	void* map_base;
+	size_t map_length;
+	size_t advised; // end of the data already requested with MADV_WILLNEED
+	size_t kept_from; // part of the mapping that can still be resident
+	size_t kept_to;
+	size_t prefetched; // frames_played when the seek targets were last prefetched
 };
 
 struct random_list {
@@ -80,11 +175,383 @@ struct random_list {
 	size_t size;
 };
 
+/*
+lock-free single producer/single consumer byte ring.
+head and tail are free running positions (they never wrap), the index
+inside data is position & (size - 1), so size must be a power of two.
+only the producer stores head and only the consumer stores tail
+*/
+struct audio_ring {
+	uint8_t* data;
+	size_t size;
+	_Atomic size_t head; // producer position
+	_Atomic size_t tail; // consumer position
+};
+
+enum audio_command_type {
+	AUDIO_CMD_GAIN, // change gain
+	AUDIO_CMD_PAUSE, // stop writing to the device
+	AUDIO_CMD_RESUME,
+	AUDIO_CMD_FLUSH, // drop everything queued before position
+	AUDIO_CMD_SEEK, // like FLUSH, and the device too, crossfaded
+	AUDIO_CMD_FORMAT, // frames from position on use a new stream_format
+	AUDIO_CMD_STOP // leave the audio thread
+};
+
+enum resample_quality {
+	RESAMPLE_OFF, // the device is reconfigured to every track's rate
+	RESAMPLE_FAST,
+	RESAMPLE_MEDIUM,
+	RESAMPLE_BEST
+};
+
+struct audio_command {
+	enum audio_command_type type;
+	float gain;
+	size_t position; // ring position (AUDIO_CMD_FLUSH, AUDIO_CMD_SEEK, AUDIO_CMD_FORMAT)
+	uint64_t time; // when the key was pressed (AUDIO_CMD_SEEK)
+	struct stream_format format;
+	// the settings when it was queued, the main thread owns them (AUDIO_CMD_FORMAT)
+	enum resample_quality resample_quality;
+	unsigned int crossfade_ms;
+	int drain; // play what is left in the ring before stopping (AUDIO_CMD_STOP)
+};
+
+struct command_queue { // lock-free spsc queue, ui -> audio thread
+	struct audio_command items[COMMAND_QUEUE_SIZE];
+	_Atomic size_t head;
+	_Atomic size_t tail;
+};
+
+/*
+the audio thread is the only one touching the pcm after audio_init, it
+reconfigures the device itself when it reaches a track in another format.
+the main thread queues the track's frames into ring as they are in the
+file and talks to it through commands; conversion and gain happen on the
+audio thread, in one pass, right before writing to the device
+*/
+
+typedef float (*dot_fn)(const float* a, const float* b, size_t n);
+
+struct resampler { // see resampler.h
+	uint32_t in_rate;
+	uint32_t out_rate;
+	uint32_t up; // polyphase branches
+	uint32_t down; // branches the input moves per output sample
+	uint32_t taps; // coefficients per branch
+	uint16_t channels;
+	enum resample_quality quality;
+	float* filter; // up branches of taps coefficients, each one reversed
+	float* history; // one plane of cap input samples per channel
+	size_t cap;
+	size_t fill; // samples held in every plane
+	size_t pos; // newest input sample of the next output
+	uint32_t phase; // branch of the next output
+	dot_fn dot;
+};
+
+/*
+soft knee look-ahead limiter on the s32 frames, with the gain ramped
+over LIMITER_RAMP_FRAMES when it changes (see limiter.h)
+*/
+#define LIMITER_CEILING 0.989f // -0.1 dBFS, nothing goes out louder
+#define LIMITER_KNEE 0.25f // width of the knee around the ceiling (linear)
+#define LIMITER_LOOKAHEAD 64 // frames, the gain comes down this early at most
+#define LIMITER_RELEASE_MS 60 // back to no reduction after a peak
+#define LIMITER_RAMP_FRAMES FRAMES_PER_TICK // a gain change is spread over a period
+#define LIMITER_BLOCK 256 // frames processed at once
+#define LIMITER_FLOAT_HEADROOM 16.0f // f32 frames are limited from this far down, +24 dBFS overs intact
+
+struct limiter {
+	float level; // gain of the last frame, < 0 before the first one
+	float target;
+	float step; // per frame while ramping
+	size_t ramp_left; // frames until level reaches target
+	float envelope; // reduction of the last frame, 1.0 when not limiting
+	float release; // per frame, how much of the reduction is left
+	scale_fn scale;
+	convert_gain_fn scale_steady; // s32 by a single gain, in place
+	peak_fn peak;
+	size_t channels; // of the frames
+	size_t gain_channels; // gain was allocated for
+	float* gain; // LIMITER_BLOCK frames of per sample gains
+	float reduction[LIMITER_BLOCK + LIMITER_LOOKAHEAD]; // needed by each frame
+};
+
+struct ring_format { // frames from position on are frame_size bytes
+	size_t position;
+	size_t frame_size;
+};
+
+struct audio_thread {
+	pthread_t thread;
+	int started;
+	struct audio_ring ring;
+	struct command_queue commands;
+	struct stream_format format; // format of the frames at the ring tail
+	struct audio_command pending[COMMAND_QUEUE_SIZE]; // formats not reached yet
+	size_t pending_len;
+	struct ring_format queued[COMMAND_QUEUE_SIZE]; // main thread: what it queued, oldest first
+	size_t queued_len;
+	int32_t* period; // FRAMES_PER_TICK converted frames (RW access only)
+	size_t period_channels; // channels period was allocated for
+	uint8_t* split_frame; // a frame crossing the end of the ring, gathered
+	int flushed; // a FLUSH came since the last period, old frames are dropped
+	struct limiter limiter; // gain and limiting of the s32 frames
+	uint8_t* ahead_raw; // LIMITER_LOOKAHEAD frames past the ones converted, gathered
+	int32_t* ahead; // the same frames in s32, what the limiter looks ahead at
+
+	// tracks at another rate than the device go through the resampler
+	int resampling;
+	struct resampler resampler;
+	size_t resample_block; // input frames converted per block
+	int32_t* resampled; // output of the last block, at the device rate
+	size_t resampled_len;
+	size_t resampled_pos; // frames of resampled already given to the device
+
+	/*
+	seeking (see audio_seek_start): history keeps the last frames given to
+	the device, in its format, so the frames a seek rewinds can be faded
+	out. the crossfade mixes fade into the first frames of the new position
+	and stages them in faded
+	*/
+	uint8_t* history;
+	size_t history_cap; // bytes, the device buffer
+	size_t history_end;
+	size_t history_len;
+	size_t history_frame_bytes;
+	int32_t* fade; // old frames to fade out, s32
+	size_t fade_len; // frames in fade, the rest fades out from silence
+	size_t fade_frames; // length of the crossfade, 0 when none is running
+	size_t fade_pos;
+	uint8_t* faded; // FRAMES_PER_TICK crossfaded frames in the device format
+	size_t faded_len;
+	size_t faded_pos;
+	uint64_t seek_time; // of the seek whose first frame isn't out yet, else 0
+	uint64_t seek_keep_ns; // old audio the device still played after it
+	_Atomic uint64_t delay_ns; // queued in the device, for the main thread
+
+	// both threads sleep in poll, these eventfds wake them up
+	int wake_fd; // to the audio thread: a command, or frames after want_data
+	int space_fd; // to the main thread: half the ring is free after want_space
+	_Atomic int want_data; // the audio thread is waiting on an empty ring
+	_Atomic int want_space; // the main thread is waiting on a full ring
+};
+
+struct audio_device { // the pcm, open for the whole session
+	unsigned int channels; // format of the active hw_params, 0 if not set
+	unsigned int rate;
+	snd_pcm_format_t format;
+	int passthrough; // format is the track's own, frames go out unconverted
+	int mmap; // frames are written in place into the device buffer
+	int can_pause; // snd_pcm_pause works, the buffer is kept while paused
+};
+
+#define STATS_BUCKETS 40 // log2 buckets of ns, the last one takes everything above
+
+enum stats_metric {
+	STAT_READ, // file to ring, main thread
+	STAT_CONVERT, // ring to s32 (gain included) or to the device, per period
+	STAT_RESAMPLE,
+	STAT_WRITE, // time blocked in the device write
+	STAT_DELAY, // queued in the device after a period
+	STAT_RENDER, // ui frame, built and flushed
+	STAT_SEEK, // key press to the first frame heard at the new position
+	STAT_COUNT
+};
+
+struct stats_hist { // one writer, see stats.h
+	_Atomic uint64_t count;
+	_Atomic uint64_t sum;
+	_Atomic uint64_t max;
+	_Atomic uint64_t buckets[STATS_BUCKETS];
+};
+
+struct stats {
+	_Atomic uint64_t xruns;
+	_Atomic uint64_t periods;
+	struct stats_hist hist[STAT_COUNT];
+};
+
+struct output_ops;
+
+struct output { // where the frames of the audio thread go, see output.h
+	const struct output_ops* ops;
+	int opened;
+	struct stats* stats; // xruns are counted here
+	size_t frame_bytes; // of the configured format
+	size_t buffer_frames; // device buffer, 0 when writes never block
+	unsigned int rate;
+
+	snd_pcm_t* pcm; // alsa
+
+	int throttle; // null: consume at the device rate
+	struct timespec start; // null: clock of the first frame since the last drop
+	struct timespec paused_at;
+	uint64_t frames; // null: frames since start, wav: in the current file
+
+	char path[PATH_MAX_LENGTH]; // wav: file asked for, later formats get -N.wav
+	int fd; // wav: current file
+	unsigned int files; // wav: files started so far
+	snd_pcm_format_t format;
+	unsigned int channels;
+};
+
+/*
+library index: a binary file under ~/.cache/nyplay with the header fields
+of every track of a directory, mmaped at startup. layout:
+index_header | index_entry[count] (sorted by path) | path strings
+*/
+#define INDEX_MAGIC "NYIX"
+#define INDEX_VERSION 3 // 3: extensible fmts stored as their sub format
+#define INDEX_LOUDNESS 0x1 // index_entry.flags: loudness and true_peak are set
+
+struct index_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t count;
+	uint32_t strings_size;
+}__attribute__((packed));
+
+struct index_entry {
+	uint32_t path_offset; // into the string table
+	uint32_t path_length;
+	uint64_t size;
+	int64_t mtime;
+	uint64_t data_offset;
+	uint64_t data_size;
+	uint32_t sample_rate;
+	uint32_t byte_rate;
+	uint16_t channels;
+	uint16_t bits_per_sample;
+	uint16_t audio_format;
+	uint16_t flags;
+	double duration;
+	float loudness;
+	float true_peak;
+}__attribute__((packed));
+
+struct library_index {
+	char path[PATH_MAX_LENGTH]; // index file of the current directory
+	void* map;
+	size_t map_length;
+	const struct index_entry* entries;
+	const char* strings;
+	uint32_t count;
+	uint32_t strings_size;
+	size_t hits; // tracks taken from the index during the last scan
+};
+
+/* --- LOUDNESS --- */
+
+#define LOUDNESS_TARGET -18.0f // LUFS every analyzed track is brought to
+#define LOUDNESS_CEILING -1.0f // dBTP, normalization never pushes a true peak above it
+#define LOUDNESS_CHUNK_FRAMES 16384 // read and analyzed at once
+#define TRUE_PEAK_TAPS 12 // per phase of the 4x oversampling filter
+
+/*
+k-weighting of one track: a high shelf and a high pass (bs.1770), both
+biquads, for every channel. s1/s2 is the transposed direct form state
+*/
+struct kweight {
+	double b[2][3];
+	double a[2][3]; // a[i][0] is 1
+	double s1[2][LOUDNESS_MAX_CHANNELS];
+	double s2[2][LOUDNESS_MAX_CHANNELS];
+	size_t channels;
+};
+
+typedef void (*kweight_fn)(struct kweight* kw, const float* const* x, size_t n, double* energy);
+typedef float (*true_peak_fn)(const float* x, size_t n);
+
+struct loudness_pool { // background analysis of the playlist
+	pthread_t* threads;
+	int nthreads;
+	struct playlist* playlist;
+	struct library_index* library; // saved again once everything is analyzed
+	size_t* todo; // playlist indexes still without loudness
+	size_t todo_len;
+	_Atomic size_t next;
+	_Atomic size_t done;
+	_Atomic int running; // workers not finished
+	_Atomic int stop;
+	int saved;
+};
+
+struct probe_request { // one file of a batch header probe
+	const char* path;
+	struct wav_information wav;
+	int status; // 0 parsed, -1 failed
+};
+
+struct preload { // next track, opened ahead of time for gapless playback
+	int ready;
+	size_t track;
+	int fd;
+	struct wav_information wav;
+};
+
+/*
+crossfade between two tracks: the track ending keeps its own fd and
+wav_information (a second decoder) while the next one is already the
+current track, and play_wav_stream queues both mixed, as s32
+*/
+struct crossfade {
+	size_t start; // frames_left of the current track where its fade starts, 0 if none
+	int active;
+	int fd; // the track fading out
+	struct wav_information wav;
+	size_t frames; // length of this fade
+	size_t pos; // frames mixed so far
+	struct stream_format format; // of the mixed frames in the ring
+	mix_fn mix;
+	int32_t* out; // FRAMES_PER_TICK frames of each track, converted
+	int32_t* in;
+	float* gain_out; // equal power curves, one gain per sample
+	float* gain_in;
+	size_t channels; // the buffers were allocated for
+};
+
+/* --- SCREEN --- */
+
+#define SCREEN_ROWS 32 // rows of the player ui
+#define SCREEN_COLS 160 // widest terminal line drawn, wider ones are cut
+
+enum screen_style {
+	STYLE_PLAIN,
+	STYLE_LABEL, // underlined field names
+	STYLE_TRACK,
+	STYLE_ON,
+	STYLE_OFF,
+	STYLE_BAR, // filled part of the progress bar
+	STYLE_KEY // key bindings
+};
+
+struct screen_cell {
+	char ch[4]; // one utf-8 sequence
+	uint8_t len;
+	uint8_t style;
+};
+
+struct screen { // retained frame of the player ui, see screen.h
+	struct screen_cell cells[SCREEN_ROWS][SCREEN_COLS]; // frame being built
+	struct screen_cell shown[SCREEN_ROWS][SCREEN_COLS]; // what the terminal has
+	int cols; // usable width of the terminal
+	int valid; // shown matches the terminal, else the next flush clears it
+	int row; // cursor while building
+	int col;
+	uint8_t style;
+	char* out; // escape sequences of one flush, sent in a single write
+	size_t out_len;
+	size_t out_cap;
+};
+
 struct player_state {
 	int running; // controls main loop
 	int fd; // fd of the current archive
 	char dir_path[PATH_MAX_LENGTH]; // path of the current directory
 	int recursive; // read directory recursively
+	int scan_threads; // worker threads used by scan_library
 	int playlist_loop; // playlist will play on loop
 	int track_loop; // track will play on loop
 	size_t played; // how many tracks were played
@@ -95,13 +562,25 @@ struct player_state {
 	enum play_state state; // STOPPED or PLAYING or PAUSED
 
 	struct playlist playlist; // list of tracks
+	struct library_index library;
 	size_t current_track; // number of tracks
 	float player_gain;
+	int normalize; // apply the loudness gain of every track
+	struct loudness_pool loudness;
+	enum resample_quality resample_quality;
 
-	snd_pcm_t *pcm;
+	struct output output;
+	struct audio_device device;
 	struct wav_information wav;
+	struct preload preload;
+	unsigned int crossfade_ms; // 0 plays the tracks back to back
+	struct crossfade crossfade;
+	struct audio_thread audio;
 
 	int show_commands;
+	int show_stats;
+	struct screen screen;
+	struct stats stats;
 };
 
 void print_riff_header(const struct riff_header* rhdr);
@@ -128,4 +607,24 @@ void random_list_free(struct random_list* rl);
 void printf_wav_information(struct wav_information* wav);
 int init_wav_buf(struct wav_information* wav);
 
+/* --- AUDIO RING FUNCTIONS --- */
+
+int audio_ring_init(struct audio_ring* r, size_t size);
+void audio_ring_free(struct audio_ring* r);
+size_t audio_ring_readable(struct audio_ring* r);
+size_t audio_ring_writable(struct audio_ring* r);
+size_t audio_ring_write(struct audio_ring* r, const void* src, size_t len);
+size_t audio_ring_read(struct audio_ring* r, void* dst, size_t len);
+size_t audio_ring_peek(struct audio_ring* r, const uint8_t** ptr);
+size_t audio_ring_copy(struct audio_ring* r, void* dst, size_t len);
+void audio_ring_advance(struct audio_ring* r, size_t len);
+size_t audio_ring_position(struct audio_ring* r);
+void audio_ring_discard_to(struct audio_ring* r, size_t position);
+
+/* --- COMMAND QUEUE FUNCTIONS --- */
+
+void command_queue_init(struct command_queue* q);
+int command_queue_push(struct command_queue* q, const struct audio_command* cmd);
+int command_queue_pop(struct command_queue* q, struct audio_command* cmd);
+
 #endif
\ No newline at end of file